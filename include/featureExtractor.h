@@ -9,21 +9,26 @@
 #include <cstdio>
 #include "utils.h"
 #include "netStat.h"
+#include "pcapReader.h"
 
 /**
  *  class for feature extraction
   * Currently can do:
-  * 1. Extract features from pcap and get instance vectors
+  * 1. Extract features from pcap/pcapng (decoded natively, or through tshark) and get instance vectors
   * 2. Read the features from the tsv and csv files of the package, and get the instance vector
   * 3. Read the instance vector directly from the tsv and csv files of the instance vector
+  *    or from a memory-mapped FeatureBIN file (no parsing at all)
   * What to do next:
   * 4. Online packet capture, directly obtain the instance vector of each packet
  */
 
 
 // enumerated type, defined file type
+// PCAP is decoded natively by PcapReader, PCAPTshark converts the capture to tsv with tshark first (pcap2tcv),
+// PCAPTsharkPipe reads tshark's output through a pipe while tshark is still running (pcap2tcvPipe),
+// FeatureBIN is the binary instance vector format written by FeatureBinWriter / feature2bin
 enum FileType {
-    PCAP, PacketTSV, PacketCSV, FeatureCSV, FeatureTSV, OnlineNetDevice
+    PCAP, PacketTSV, PacketCSV, FeatureCSV, FeatureTSV, OnlineNetDevice, PCAPTshark, PCAPTsharkPipe, FeatureBIN
 };
 
 // Responsible for obtaining feature vectors. 
@@ -31,8 +36,31 @@ enum FileType {
 class FE {
 private:
     TsvReader *tsvReader = nullptr;
-    NetStat *netStat = nullptr;
+    PcapReader *pcapReader = nullptr;
+    FeatureBinReader *binReader = nullptr;
+    NetStatBase *netStat = nullptr;
     FileType fileType; // 当前文件的类型
+
+    // Timestamp of the last packet read (feature files carry no timestamps, it stays 0 for them)
+    double timestamp = 0;
+
+    // Open the reader that matches fileType
+    void open(const char *filename);
+
+    // Packets decoded by nextBatch before netStat processes them together
+    std::vector<PacketRecord> packets;
+
+    // Read the next packet of a packet file (pcap, or a packet tsv/csv), returns false at the end of the input
+    bool nextPacket(PacketRecord &pkt);
+
+    // Read the next packet from a line of tsvReader
+    bool nextTsvPacket(PacketRecord &pkt);
+
+    // Read the next packet decoded by pcapReader
+    bool nextPcapPacket(PacketRecord &pkt);
+
+    // Replace netStat by another NetStat with the same time windows
+    void replaceNetStat(NetStatBase *replacement);
 public:
     // netStat uses the default time window constructor, and reads the tsv package feature file by default
     FE(const char *filename, FileType ft = PacketTSV);
@@ -43,17 +71,63 @@ public:
     // destructor
     ~FE() {
         delete tsvReader;
+        delete pcapReader;
+        delete binReader;
         if (netStat != nullptr)delete netStat;
     }
 
     // Get the next instance vector and save it in result
     int nextVector(double *result);
 
+    // Get up to n instance vectors, stored row by row in X (n * getVectorSize() doubles).
+    // If timestamps is not null, the timestamp of each packet is stored in it (0 for feature files).
+    // Returns the number of vectors obtained, which is less than n only at the end of the input.
+    // The packets of a batch are passed to netStat together, so a parallel netStat works on them at once
+    int nextBatch(double *X, int n, double *timestamps = nullptr);
+
+    // Timestamp of the packet of the last instance vector
+    inline double getTimestamp() { return timestamp; }
+
+    // The NetStat the instance vectors of packets are computed by (eviction, lazy edges, parallel mode...),
+    // null for FeatureBIN files
+    inline NetStatBase *getNetStat() { return binReader != nullptr ? nullptr : netStat; }
+
+    // Compute the instance vectors of packets with a ShardedNetStat of this many shards (threads) instead,
+    // must be called before the first packet is read
+    void useShards(int shards);
+
+    // Compute the instance vectors of packets with a compact NetStat (float state, see newCompactNetStat) instead,
+    // must be called before the first packet is read
+    void useCompactState();
+
+    // Continue from the state of a NetStat saved by NetStatBase::saveSnapshot (its time windows and shards are used),
+    // must be called before the first packet is read
+    void restoreSnapshot(const char *snapshot);
+
+    // The instance vectors only have the features selected by mask (see FeatureMask). The updates and statistics
+    // they do not need are skipped: whole families, edges, time windows and single statistics (see StatSelection).
+    // For FeatureTSV/FeatureCSV files the columns of the features are selected, FeatureBIN files are read as they are.
+    // Must be called before the first vector is read, the mask is kept by useShards, useCompactState, restoreSnapshot
+    void setFeatureMask(const FeatureMask &mask);
+
+    // The instance vectors become the features order[0], order[1]... of the vectors as the mask gives them (see
+    // NetStatBase::setFeatureOrder), for example in the order of KitNET::getFeatureOrder(). Can be called at any time,
+    // kept like the mask. Returns false for FeatureBIN files, whose vectors are read as they are
+    bool setFeatureOrder(const std::vector<int> &order);
+
     // Return the size of the instance vector generated each time
-    inline int getVectorSize() { return netStat->getVectorSize(); }
+    inline int getVectorSize() { return binReader != nullptr ? binReader->getVectorSize() : netStat->getVectorSize(); }
+
+    // Return the time windows the instance vectors are computed with
+    inline const std::vector<double> &getLambdas() {
+        return binReader != nullptr ? binReader->getLambdas() : netStat->getLambdas();
+    }
 
 };
 
 
+// Write every remaining instance vector of fe into a FeatureBIN file, returns the number of vectors written
+long feature2bin(FE *fe, const char *filename);
+
 
 #endif //KITSUNE_CPP_FEATUREEXTRACTOR_H
@@ -7,6 +7,7 @@
 #define KITSUNE_CPP_KITNET_H
 
 #include <vector>
+#include <algorithm>
 #include "neuralnet.h"
 #include "cluster.h"
 
@@ -51,24 +52,48 @@ private:
     // Feature map, which holds the autoencoder to which each element of the feature instance vector is mapped.
     std::vector<std::vector<int> > *featureMap = nullptr;
 
-    // Integrated layer autoencoder
-    AE **ensembleLayer = nullptr;
+    // Integrated layer autoencoders, packed in one arena in the order of the feature map
+    AEEnsemble *ensembleLayer = nullptr;
 
     // Autoencoder for the output layer
     AE *outputLayer = nullptr;
 
-    // A vector of inputs to the integration layer
-    double **ensembleInput = nullptr;
+    // The inputs of the integration layer, the ones of each autoencoder after the ones of the previous autoencoder
+    double *ensembleInput = nullptr;
+
+    // The gather plan built with the feature map: ensembleInput[k] = x[featureOrder[k]]
+    std::vector<int> featureOrder;
 
     // The input vector of the output layer
     double *outputInput = nullptr;
 
+    // The size of the instance vectors, the rows of the batches (0 until setInputSize with constructor 1)
+    int inputSize = 0;
+
+    // The threads of the integration layer, applied when it is created
+    int threads = 1;
+
+    // The rows of a batch gathered for the integration layer at once, and the errors of the autoencoders of each row
+    static const int BatchRows = 64;
+    std::vector<double> batchInput, batchErrors;
+
     // Initialize the parameters required by the autoencoder
     KitNETParam *kitNetParam = nullptr;
 
     // Initialize KitNET, initialize according to feature parameters, etc.
     void init();
 
+    // train and execute with the inputs of the integration layer
+    double trainEnsemble(const double *input);
+
+    double executeEnsemble(const double *input);
+
+    // Gathers the first rows of X for the integration layer, returns how many
+    int gatherBatch(const double *X, int n);
+
+    // Throws if the size of the instance vectors is not set
+    void checkInputSize() const;
+
 public:
 
     // There are two types of constructors, one is to directly provide the feature map. The other is to train the feature map according to the parameters, and only after training
@@ -97,6 +122,7 @@ public:
      // 6. The learning rate of the integration layer 7. The learning rate of the output layer (both default 0.1 )
     KitNET(int n, int maxAE, int fm_train_num, double ensemble_vh_rate = 0.75, double output_vh_rate = 0.75,
            double ensemble_learning_rate = 0.1, double output_learning_rate = 0.1) {
+        inputSize = n;
         kitNetParam = new KitNETParam;
         kitNetParam->ensemble_learning_rate = ensemble_learning_rate;
         kitNetParam->ensemble_vh_rate = ensemble_vh_rate;
@@ -116,6 +142,37 @@ public:
     // Anterior propagation, returns the reconstruction error of the current data
     double execute(const double *x);
 
+    // The index in x of every input of the integration layer, the features of each autoencoder after the ones of the
+    // previous one. Empty while the feature map is being trained
+    const std::vector<int> &getFeatureOrder() const { return featureOrder; }
+
+    // train and execute with x already in the order of getFeatureOrder() (for example from FE::setFeatureOrder),
+    // the autoencoders read their inputs from x without a copy. Only once the feature map is trained
+    double trainOrdered(const double *x);
+
+    double executeOrdered(const double *x);
+
+    // The size of the instance vectors: n of constructor 2, what setInputSize gave for constructor 1
+    int getInputSize() const { return inputSize; }
+
+    // Set the size of the instance vectors, the row stride of the blocks of trainBatch and executeBatch. Needed with
+    // constructor 1 before the batches, the feature map may leave out features at the end of the vectors
+    void setInputSize(int n);
+
+    // Run the autoencoders of the integration layer on this many threads (the caller's and threads - 1 workers), 1 by
+    // default. Only worth it for large ensembles, and with the batches below that wait for the workers once per batch
+    void setThreads(int t);
+
+    // train and execute the n instances of the row-major block X (rows of getInputSize() values), the scores go to
+    // rmse[0..n).
+    // The same scores as train and execute one instance at a time: each autoencoder still sees the instances in order,
+    // execute runs the autoencoders DenseBatchRows instances at a time.
+    // With miniBatch, the autoencoders are trained with mini-batches of DenseBatchRows instances instead of one
+    // (AE::trainMiniBatch), a variant of the training with other scores
+    void trainBatch(const double *X, int n, double *rmse, bool miniBatch = false);
+
+    void executeBatch(const double *X, int n, double *rmse);
+
 
 };
 
@@ -14,51 +14,276 @@
   */
 
 #include <vector>
+#include <deque>
 #include <string>
-#include <map>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include "utils.h"
+#include "workerThread.h"
 
 
 /**
- *  A fixed-size queue that only inserts and does not delete
+ *  Protocol of a packet, decides what its "port" is when the per-port streams (HT_Hp) are keyed
  */
-class QueueFixed {
+enum PacketProtocol {
+    ProtoOther, ProtoTCP, ProtoUDP, ProtoICMP, ProtoARP
+};
+
+/**
+ *  The decoded fields of one packet that NetStat needs, with no strings involved
+ */
+struct PacketRecord {
+    // Value of srcMAC/dstMAC when the frame has no MAC address (MACs only use the low 48 bits)
+    static const uint64_t NoMAC = ~0ull;
+
+    // Value of ipVersion for an address that is not an IP address (only from the text overload, see below)
+    static const uint8_t TextAddress = 255;
+
+    uint64_t srcMAC, dstMAC;         // 48-bit MAC addresses
+    uint64_t srcIP[2], dstIP[2];     // 128-bit addresses (high, low word), IPv4 in the low 32 bits
+    uint8_t ipVersion;               // 4, 6, or 0 if the packet has no address (e.g. ARP for other protocols)
+    uint8_t protocol;                // PacketProtocol; ProtoOther means the MACs take the place of the IPs
+    uint16_t srcPort, dstPort;       // tcp/udp ports, 0 otherwise
+    double datagramSize;
+    double timestamp;
+};
+
+// Build a PacketRecord from the text forms accepted by NetStat::updateAndGetStats, the views need not be null-terminated
+PacketRecord makePacketRecord(StrView srcMAC, StrView dstMAC, StrView srcIP, StrView srcProtocol,
+                              StrView dstIP, StrView dstProtocol, double datagramSize, double timestamp);
+
+/**
+ *  Key of a stream in IncStatDB: a fixed-size binary tuple of addresses, ports and tags,
+ *  so that building and comparing keys never allocates
+ */
+struct StreamKey {
+    uint64_t w[5];
+
+    bool operator<(const StreamKey &other) const {
+        return std::memcmp(w, other.w, sizeof(w)) < 0;
+    }
+
+    bool operator==(const StreamKey &other) const {
+        return std::memcmp(w, other.w, sizeof(w)) == 0;
+    }
+
+    // 64-bit hash of the key, never 0 (0 marks an empty slot of StreamTable)
+    uint64_t hash() const {
+        uint64_t h = 0x9e3779b97f4a7c15ull;
+        for (int i = 0; i < 5; ++i) {
+            h ^= w[i] + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+            h *= 0xff51afd7ed558ccdull;
+        }
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h == 0 ? 1 : h;
+    }
+};
+
+
+/**
+ *  StreamTable, an open-addressing (linear probing) hash table from StreamKey to a pointer to V (the stream).
+ *  The hashes are kept in their own array, so a probe usually touches a single cache line,
+ *  and the key is only compared when the full 64-bit hash matches.
+ *  Erasing shifts the following entries back, so there are no tombstones.
+ */
+template<class V>
+class StreamTable {
+private:
+    struct Entry {
+        StreamKey key;
+        V *value;
+    };
+
+    uint64_t *hashes = nullptr; // 0 means the slot is empty
+    Entry *entries = nullptr;
+    size_t capacity = 0; // always a power of 2
+    size_t count = 0;
+
+    // Maximum load factor is 1/2, so probe sequences stay short
+    void grow() {
+        size_t oldCapacity = capacity;
+        uint64_t *oldHashes = hashes;
+        Entry *oldEntries = entries;
+        capacity = capacity == 0 ? 16 : capacity * 2;
+        hashes = new uint64_t[capacity]();
+        entries = new Entry[capacity];
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldHashes[i] == 0)continue;
+            size_t j = oldHashes[i] & mask;
+            while (hashes[j] != 0)j = (j + 1) & mask;
+            hashes[j] = oldHashes[i];
+            entries[j] = oldEntries[i];
+        }
+        delete[] oldHashes;
+        delete[] oldEntries;
+    }
+
 public:
-    // Queue Capacity, Static Elements
-    static const int QueueCapacity = 3;
+    StreamTable() = default;
 
+    StreamTable(const StreamTable &) = delete;
+
+    StreamTable &operator=(const StreamTable &) = delete;
+
+    ~StreamTable() {
+        delete[] hashes;
+        delete[] entries;
+    }
+
+    // Find the value of key, whose hash is h (key.hash()), returns nullptr if it is not in the table
+    inline V *find(const StreamKey &key, uint64_t h) const {
+        if (capacity == 0)return nullptr;
+        size_t mask = capacity - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            if (hashes[i] == h && entries[i].key == key) return entries[i].value;
+            if (hashes[i] == 0) return nullptr;
+        }
+    }
+
+    // Insert a key that is not in the table yet
+    void insert(const StreamKey &key, uint64_t h, V *value) {
+        if ((count + 1) * 2 > capacity)grow();
+        size_t mask = capacity - 1;
+        size_t i = h & mask;
+        while (hashes[i] != 0)i = (i + 1) & mask;
+        hashes[i] = h;
+        entries[i].key = key;
+        entries[i].value = value;
+        ++count;
+    }
+
+    // Remove key from the table, returns false if it was not there
+    bool erase(const StreamKey &key, uint64_t h) {
+        if (capacity == 0)return false;
+        size_t mask = capacity - 1;
+        size_t i = h & mask;
+        while (!(hashes[i] == h && entries[i].key == key)) {
+            if (hashes[i] == 0)return false;
+            i = (i + 1) & mask;
+        }
+        // Backward shift: move every following entry that may not stay behind the hole into it
+        for (size_t j = (i + 1) & mask; hashes[j] != 0; j = (j + 1) & mask) {
+            size_t home = hashes[j] & mask;
+            // The entry at j can fill the hole at i if its home slot is not in (i, j] (cyclically)
+            bool between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+            if (!between) {
+                hashes[i] = hashes[j];
+                entries[i] = entries[j];
+                i = j;
+            }
+        }
+        hashes[i] = 0;
+        --count;
+        return true;
+    }
+
+    size_t size() const { return count; }
+
+    // Remove every entry
+    void clear() {
+        if (count == 0)return;
+        for (size_t i = 0; i < capacity; ++i)hashes[i] = 0;
+        count = 0;
+    }
+
+    // Number of slots, slot(i) for i in [0, getCapacity()) visits every entry
+    size_t getCapacity() const { return capacity; }
+
+    // The value held in slot i, nullptr if the slot is empty
+    V *slot(size_t i) const { return hashes[i] != 0 ? entries[i].value : nullptr; }
+
+    // The hash held in slot i, 0 if the slot is empty
+    uint64_t slotHash(size_t i) const { return hashes[i]; }
+
+    // The slot that holds key, whose hash is h, the key must be in the table
+    size_t slotOf(const StreamKey &key, uint64_t h) const {
+        size_t mask = capacity - 1, i = h & mask;
+        while (!(hashes[i] == h && entries[i].key == key))i = (i + 1) & mask;
+        return i;
+    }
+
+    // Make the table empty with the given number of slots (0 or a power of 2), to restore a saved table
+    void reset(size_t slots) {
+        delete[] hashes;
+        delete[] entries;
+        capacity = slots;
+        count = 0;
+        hashes = capacity > 0 ? new uint64_t[capacity]() : nullptr;
+        entries = capacity > 0 ? new Entry[capacity] : nullptr;
+    }
+
+    // Put back an entry into the slot i it was saved from (after reset)
+    void restoreSlot(size_t i, const StreamKey &key, uint64_t h, V *value) {
+        hashes[i] = h;
+        entries[i].key = key;
+        entries[i].value = value;
+        ++count;
+    }
+
+    // Call f(key, value) on every entry
+    template<class F>
+    void forEach(F f) const {
+        for (size_t i = 0; i < capacity; ++i)
+            if (hashes[i] != 0) f(entries[i].key, entries[i].value);
+    }
+};
+
+
+/**
+ *  A fixed-size queue that only inserts and does not delete, the elements are read in place from the ring
+ */
+template<int Capacity>
+class QueueFixed {
 private:
-    double array[QueueFixed::QueueCapacity];
+    double array[Capacity];
     // The index where the current insertion is placed
-    int now_index;
+    int now_index = 0;
     // current number of elements
-    int now_size;
+    int now_size = 0;
 
 public:
-
-    QueueFixed() {
-        now_index = now_size = 0;
+    // insert new element
+    void insert(double x) {
+        array[now_index++] = x;
+        if (now_index >= Capacity)now_index = 0;
+        ++now_size;
     }
 
-    // insert new element
-    void insert(double x);
+    // Number of the elements kept, at most Capacity
+    int size() const { return now_size < Capacity ? now_size : Capacity; }
 
-    // Expand the queue into an array, copy it into arr, and return the number of elements in the array
-    int unroll(double *arr);
+    // The i-th oldest element kept, i < size()
+    double get(int i) const {
+        int j = (now_size < Capacity ? 0 : now_index) + i; // if it is full, now_index is the oldest one
+        return array[j < Capacity ? j : j - Capacity];
+    }
 
     // Returns the last element entered into the queue
-    double getLast();
-
+    double getLast() const { return array[now_index == 0 ? Capacity - 1 : now_index - 1]; }
 };
 
+// Number of the last points of a stream the extrapolation of its value is fitted to
+const int ExtrapolatorPoints = 3;
+
+/**
+ *  Predicts the value of a stream at a time t from its last Capacity (time, value) points, by Lagrange interpolation.
+ *  With 2 or 3 points it is the closed form of the line or parabola through them, read in place from the rings,
+ *  with a single division; otherwise (more points, or points at the same time) the general Lagrange formula
+ */
+template<int Capacity>
 class Extrapolator {
 private:
     // Maintain two queues, one of which is the independent variable t and the other is the function value v
-    QueueFixed tQ, vQ;
+    QueueFixed<Capacity> tQ, vQ;
 
-    // Save expanded value
-    double tArr[QueueFixed::QueueCapacity];
-    double vArr[QueueFixed::QueueCapacity];
+    // The general Lagrange interpolation of the sz points kept
+    double lagrange(double t, int sz) const;
 
 public:
     // insert new element
@@ -68,71 +293,433 @@ public:
     }
 
     // Predict the next value using Lagrangian interpolation
-    double predict(double t);
+    double predict(double t) const;
 };
 
 
+/**
+ *  Number of time windows (lambdas) of the statistics.
+ *  IncStat, IncStatCov, IncStatDB and NetStat take it as the template parameter N:
+ *  with N > 0 the per-window state is stored inline in the object and every per-window loop has a
+ *  compile-time trip count; DynamicWindows (0) takes the count from the lambdas at run time.
+ *  The classes are instantiated in netStat.cpp for N = 0 .. MaxFixedWindows.
+ *  Their second parameter Real is the type the per-window state is stored in, float for the compact NetStat
+ */
+const int DynamicWindows = 0;
+const int MaxFixedWindows = 8;
+
+// Alignment of IncStat and IncStatCov, so that their state starts on a cache line (their SlabPool keeps it)
+const size_t StatAlignment = 64;
+
+/**
+ *  The type of one per-window array of Real: Real[N], or a pointer into a single allocation for DynamicWindows
+ */
+template<int N, class Real = double>
+struct WindowArray {
+    typedef Real type[N];
+
+    // Nothing to allocate, the arrays are members
+    static void allocate(type **, int, int) {}
+
+    static void release(type &) {}
+};
+
+template<class Real>
+struct WindowArray<DynamicWindows, Real> {
+    typedef Real *type;
+
+    // Point the count arrays into one allocation of count * n values
+    static void allocate(type **arrays, int count, int n) {
+        Real *p = new Real[(size_t) count * n];
+        for (int i = 0; i < count; ++i) *arrays[i] = p + (size_t) i * n;
+    }
+
+    // Release the allocation, first is the array allocate put at the front
+    static void release(type &first) { delete[] first; }
+};
+
+
+/**
+ * FeatureMask 选择统计向量中的特征. 完整的统计向量中四类流的特征依次是 (每一项是所有时间窗口的值):
+ * MI[weight,mean,var], H[weight,mean,var,radius,magnitude,cov,pcc], jit[weight,mean,var], Hp[与H相同],
+ * 选中的特征按这个顺序组成NetStat的统计向量. 没有选中的特征需要的更新和计算也被跳过:
+ * 一类流没有选中的特征时不更新; H/Hp没有选中cov和pcc时不维护边, radius和magnitude直接由两个流计算;
+ * 二维统计都没有选中时不查找目的流 (见work). 一类流只衰减和更新选中的时间窗口所在的范围,
+ * 只计算选中的统计在选中的时间窗口的值 (见selection)
+ */
+struct StatSelection;
+
+class FeatureMask {
+public:
+    // 四类流和它们的统计, MI和jit只有一维统计
+    enum Family {
+        MI, H, Jit, Hp, FamilyCount
+    };
+    enum Stat {
+        Weight, Mean, Var, Radius, Magnitude, Cov, Pcc, StatCount
+    };
+
+    // 一类流要做的工作: 不更新, 只更新一维统计, 一维统计和不需要边的二维统计 (radius, magnitude), 维护边
+    enum Work {
+        WorkNone, Work1D, WorkPairs, WorkEdges
+    };
+
+private:
+    int windows;
+    // 按完整的统计向量的顺序, 每个特征是否选中
+    std::vector<bool> enabled;
+
+    // 完整的统计向量中每类流的第一个特征的位置 (以时间窗口的个数为单位)
+    static int familyOffset(Family f) { return f == MI ? 0 : f == H ? 3 : f == Jit ? 10 : 13; }
+
+    static bool has2D(Family f) { return f == H || f == Hp; }
+
+public:
+    // windows个时间窗口的所有特征都选中
+    explicit FeatureMask(int windows = 0) : windows(windows), enabled(windows * 20, true) {}
+
+    int getWindows() const { return windows; }
+
+    // 完整的统计向量的维度
+    int size() const { return enabled.size(); }
+
+    // 选中的特征的个数
+    int count() const;
+
+    // 特征在完整的统计向量中的下标
+    int index(Family f, Stat s, int window) const;
+
+    // 选中或者不选一类流的一个统计, window为-1时是所有的时间窗口
+    FeatureMask &set(Family f, Stat s, bool on, int window = -1);
+
+    // 选中或者不选一类流的所有统计
+    FeatureMask &setFamily(Family f, bool on, int window = -1);
+
+    // 选中或者不选完整的统计向量中的一个特征
+    FeatureMask &set(int feature, bool on);
+
+    bool get(int feature) const { return enabled[feature]; }
+
+    bool get(Family f, Stat s, int window) const { return enabled[index(f, s, window)]; }
+
+    // 一类流的选中的特征需要做的工作, 更新哪些时间窗口见selection
+    Work work(Family f) const;
+
+    // 一类流选中的统计和要更新的时间窗口, keep是无论是否选中都要更新的时间窗口
+    StatSelection selection(Family f, int keep) const;
+};
+
+/**
+ * StatSelection 是一类流选中的统计和它们的时间窗口, 由FeatureMask::selection得到, 供IncStatDB使用.
+ * IncStatDB只衰减和更新[begin, end)中的时间窗口: 选中的时间窗口, 以及最长的时间窗口 (删除不活跃的流和边要用它的权值)
+ * 所在的最小范围. 范围之外的时间窗口的状态不再是最新的, 重新进入范围时从空的状态开始 (见IncStatDB::setSelection)
+ */
+struct StatSelection {
+    int begin = 0, end = 0;
+
+    // 每个统计 (下标是FeatureMask::Stat) 选中的时间窗口, 从小到大. 统计按这个顺序写出, 与完整的统计向量的顺序相同
+    std::vector<int> windows[FeatureMask::StatCount];
+
+    bool has(FeatureMask::Stat s) const { return !windows[s].empty(); }
+
+    // 选中的一维统计的个数, 以及所有选中的统计的个数
+    int size1D() const {
+        return (int) (windows[FeatureMask::Weight].size() + windows[FeatureMask::Mean].size() +
+                      windows[FeatureMask::Var].size());
+    }
+
+    int size() const {
+        int n = 0;
+        for (const std::vector<int> &w: windows)n += w.size();
+        return n;
+    }
+};
+
+/**
+ *  DecayFactors computes the decay factors 2^(-lambda_i * diff) of all the windows for a time difference at once,
+ *  and keeps the last few sets. The streams and edges touched by one packet were mostly last updated by the
+ *  same earlier packet, so they decay by the same diff and share one set of factors.
+ *  Each IncStatDB owns one, which IncStat and IncStatCov use when they decay. It also holds the range of windows
+ *  [begin(), end()) the IncStatDB keeps up to date (see StatSelection): only those are computed, decayed and updated
+ */
+template<int N>
+class DecayFactors {
+private:
+    typedef typename WindowArray<N>::type Windows;
+
+    // Number of the sets of factors kept, they are replaced round robin
+    static const int Slots = 4;
+
+    Windows factors[Slots];
+    double diffs[Slots];
+    int next = 0;
+
+    std::vector<double> *lambdas;
+
+    int first = 0, last;
+
+    inline int windows() const { return N > 0 ? N : (int) lambdas->size(); }
+
+public:
+    DecayFactors(std::vector<double> *l) {
+        lambdas = l;
+        last = windows();
+        Windows *arrays[Slots];
+        for (int k = 0; k < Slots; ++k) {
+            arrays[k] = &factors[k];
+            diffs[k] = -1; // diff is always positive
+        }
+        WindowArray<N>::allocate(arrays, Slots, windows());
+    }
+
+    DecayFactors(const DecayFactors &) = delete;
+
+    DecayFactors &operator=(const DecayFactors &) = delete;
+
+    ~DecayFactors() {
+        WindowArray<N>::release(factors[0]);
+    }
+
+    inline int begin() const { return first; }
+
+    inline int end() const { return last; }
+
+    // Only the windows [b, e) are computed from now on, the sets kept are dropped
+    void setRange(int b, int e) {
+        first = b;
+        last = e;
+        for (double &diff: diffs)diff = -1;
+    }
+
+    // The factor of every window in the range for a time difference diff > 0,
+    // valid until Slots other diffs are asked for
+    inline const double *get(double diff) {
+        for (int k = 0; k < Slots; ++k)
+            if (diffs[k] == diff)return factors[k];
+        int k = next;
+        next = (next + 1) % Slots;
+        diffs[k] = diff;
+        for (int i = first; i < last; ++i) factors[k][i] = std::exp2(-(*lambdas)[i] * diff);
+        return factors[k];
+    }
+};
+
+
+/**
+ *  The mean, variance and standard deviation of an IncStat, computed from its sums CF1, CF2 and weights w.
+ *  With double state (Cached) they are kept in arrays once computed for the windows [begin, end) the IncStatDB
+ *  keeps up to date, until the stream inserts a new value.
+ *  The compact float state keeps nothing: every value is computed again, in double, when it is asked for
+ */
+template<int N, class Real, bool Cached = std::is_same<Real, double>::value>
+class DerivedStats {
+private:
+    typedef typename WindowArray<N>::type Windows;
+
+    Windows cur_mean, cur_var, cur_std;
+
+    // Is the current mean, variance, and standard deviation valid (when false, needs to be recalculated)
+    bool mean_valid = false, var_valid = false, std_valid = false;
+
+public:
+    void allocate(int n) {
+        Windows *arrays[] = {&cur_mean, &cur_var, &cur_std};
+        WindowArray<N>::allocate(arrays, 3, n);
+    }
+
+    void release() { WindowArray<N>::release(cur_mean); }
+
+    void invalidate() { mean_valid = var_valid = std_valid = false; }
+
+    void copy(const DerivedStats &other, int n) {
+        for (int i = 0; i < n; ++i) {
+            cur_mean[i] = other.cur_mean[i];
+            cur_var[i] = other.cur_var[i];
+            cur_std[i] = other.cur_std[i];
+        }
+        mean_valid = other.mean_valid;
+        var_valid = other.var_valid;
+        std_valid = other.std_valid;
+    }
+
+    void calMean(const Real *CF1, const Real *w, int begin, int end) {
+        if (!mean_valid) { // recalculate when needed
+            mean_valid = true;
+            for (int i = begin; i < end; ++i)
+                cur_mean[i] = CF1[i] / w[i];
+        }
+    }
+
+    void calVar(const Real *CF1, const Real *CF2, const Real *w, int begin, int end) {
+        if (!var_valid) {
+            var_valid = true;
+            calMean(CF1, w, begin, end); // The calculation requires the mean value, first update the mean value
+            for (int i = begin; i < end; ++i)
+                cur_var[i] = std::fabs(CF2[i] / w[i] - cur_mean[i] * cur_mean[i]);
+        }
+    }
+
+    void calStd(const Real *CF1, const Real *CF2, const Real *w, int begin, int end) {
+        if (!std_valid) {
+            std_valid = true;
+            calVar(CF1, CF2, w, begin, end); // Calculation requires variance, calculate it first
+            for (int i = begin; i < end; ++i)
+                cur_std[i] = std::sqrt(cur_var[i]);
+        }
+    }
+
+    double mean(const Real *, const Real *, int i) const { return cur_mean[i]; }
+
+    double var(const Real *, const Real *, const Real *, int i) const { return cur_var[i]; }
+
+    double stdev(const Real *, const Real *, const Real *, int i) const { return cur_std[i]; }
+};
+
+template<int N, class Real>
+class DerivedStats<N, Real, false> {
+public:
+    static constexpr double NoiseFloor = 1e-6;
+
+    void allocate(int) {}
+
+    void release() {}
+
+    void invalidate() {}
+
+    void copy(const DerivedStats &, int) {}
+
+    void calMean(const Real *, const Real *, int, int) {}
+
+    void calVar(const Real *, const Real *, const Real *, int, int) {}
+
+    void calStd(const Real *, const Real *, const Real *, int, int) {}
+
+    double mean(const Real *CF1, const Real *w, int i) const { return (double) CF1[i] / w[i]; }
+
+    // The float sums are only good to about 1e-7 of their size, a variance below NoiseFloor of the mean square is
+    // rounding noise and is taken as 0 (what a stream of constant values gets with double state)
+    double var(const Real *CF1, const Real *CF2, const Real *w, int i) const {
+        double m = mean(CF1, w, i), square = (double) CF2[i] / w[i];
+        double v = std::fabs(square - m * m);
+        return v > NoiseFloor * square ? v : 0;
+    }
+
+    double stdev(const Real *CF1, const Real *CF2, const Real *w, int i) const {
+        return std::sqrt(var(CF1, CF2, w, i));
+    }
+};
+
+
+template<int N, class Real = double>
 class IncStatCov; // Because of cross-references, declare this class first
 
 
 /**
- *  IncStat is the incremental data statistics of a specific stream
+ *  IncStat is the incremental data statistics of a specific stream.
+ *  Real is the type the per-window state is stored in: double, or float for the compact NetStat (see newCompactNetStat)
  */
+template<int N, class Real = double>
 class IncStat {
 private:
-    // The decay factor of the stream, which is the pointer to the time window list
-    std::vector<double> *lambdas;
+    typedef typename WindowArray<N, Real>::type Windows;
 
     // Statistical linear sum, square sum, and weight list
     // the i-th value corresponds to the statistical information of the i-th time window
-    double *CF1 = nullptr, *CF2 = nullptr, *w = nullptr;
+    alignas(StatAlignment) Windows CF1;
+    Windows CF2, w;
+
+    // The current mean, variance, standard deviation, cached only with double state
+    DerivedStats<N, Real> derived;
+
+    // Only kept for lazy edges: the sums of the residuals r = v - mean (mean right after inserting v)
+    // and of r * v of the inserted values, decayed like CF1, and the number of values summed up.
+    // A lazy edge takes in the change of these sums since it last looked at them (see IncStatCov::settle)
+    Windows residual, residualValue;
+    uint64_t inserts = 0;
+
+    // The decay factor of the stream, which is the pointer to the time window list
+    std::vector<double> *lambdas;
 
     // last timestamp
     double lastTimestamp;
 
-    // Is the current mean, variance, and standard deviation valid (when false, needs to be recalculated)
-    bool mean_valid, var_valid, std_valid;
-
     // Is the type different? 
     // If true, use the new timestamp as data (also for calculating timestamp statistics)
     bool isTypeDiff;
 
-public:
-    // The ID of the current stream index
-    std::string ID;
+    // Number of time windows, a constant unless N is DynamicWindows
+    inline int windows() const { return N > 0 ? N : (int) lambdas->size(); }
 
-    // The current mean, variance, standard deviation list
-    // the i-th value corresponds to the statistical information of the i-th time window
-    double *cur_mean = nullptr, *cur_var = nullptr, *cur_std = nullptr;
+public:
+    friend class IncStatCov<N, Real>;
 
     // the collection of streams associated with the current stream
-    std::vector<IncStatCov *> covs;
+    std::vector<IncStatCov<N, Real> *> covs;
+
+    // The key of the stream in its IncStatDB and its neighbours in the LRU list of the IncStatDB
+    StreamKey key;
+    IncStat *lruPrev = nullptr, *lruNext = nullptr;
 
-    // Constructor, the parameters are the ID of the current stream, lambda, the initialization timestamp, 
-    // whether to use the timestamp as statistics
-    IncStat(const std::string &_ID, std::vector<double> *_lambdas, double init_time = 0, bool isTypediff = false);
+    // The index of the stream in its pool, while a snapshot is written
+    uint32_t snapshotIndex = 0;
 
-    // Destructor, to destroy the pointer content of the edge information
+    // Constructor, the parameters are lambda, the initialization timestamp,
+    // whether to use the timestamp as statistics (the key of the stream is kept by IncStatDB)
+    IncStat(std::vector<double> *_lambdas, double init_time = 0, bool isTypediff = false);
+
+    // Destructor, the edges are destroyed by the IncStatDB
     ~IncStat();
 
-    // A function to insert new data, the parameters are vstatistics, ttimestamp
-    void insert(double v, double t = 0);
+    // A function to insert new data, the parameters are vstatistics, ttimestamp, the decay factors of the IncStatDB,
+    // whether to add the residual of v to the sums kept for lazy edges
+    void insert(double v, double t, DecayFactors<N> &decay, bool trackResiduals = false);
 
     // Execute decay, the parameter is the current timestamp
-    void processDecay(double timestamp);
+    void processDecay(double timestamp, DecayFactors<N> &decay);
+
+    // Copy the statistics of another stream (not its key or edges), used for the mirrors of ShardedNetStat
+    void copyState(const IncStat &other);
+
+    // A snapshot holds the stream byte for byte in the image of its pool (see IncStatDB::save).
+    // saveArrays writes what is outside of the object: the per-window arrays with DynamicWindows.
+    // restoreImage sets up again the members of a stream copied from an image that hold allocations or pointers,
+    // and reads back what saveArrays wrote (its edges and LRU neighbours are set by IncStatDB::restore)
+    void saveArrays(SnapshotWriter &out) const;
 
-    // Calculate mean
-    void calMean();
+    void restoreImage(SnapshotReader &in, std::vector<double> *l);
+
+    // Calculate mean, of the windows [begin, end) the IncStatDB keeps up to date
+    void calMean(int begin, int end) { derived.calMean(&CF1[0], &w[0], begin, end); }
 
     // Calculate the variance
-    void calVar();
+    void calVar(int begin, int end) { derived.calVar(&CF1[0], &CF2[0], &w[0], begin, end); }
 
     // Calculate standard deviation
-    void calStd();
+    void calStd(int begin, int end) { derived.calStd(&CF1[0], &CF2[0], &w[0], begin, end); }
+
+    // The mean, variance, standard deviation of the i-th time window, after calMean, calVar, calStd
+    double mean(int i) const { return derived.mean(&CF1[0], &w[0], i); }
+
+    double var(int i) const { return derived.var(&CF1[0], &CF2[0], &w[0], i); }
 
-    // Get all the one-dimensional statistical information
+    double stdev(int i) const { return derived.stdev(&CF1[0], &CF2[0], &w[0], i); }
+
+    // Get the selected one-dimensional statistical information
     // (weight, mean, variance), and append the result to the result, and return the number of increased data
-    int getAll1DStats(double *result);
+    int get1DStats(const StatSelection &selection, double *result);
+
+    // The selected radius and magnitude of this stream and another one, as IncStatCov gives them, without an edge
+    // (see FeatureMask), and return the number of data added
+    int getPairStats(IncStat &other, const StatSelection &selection, double *result);
+
+    // Start the windows [begin, end) again from the state of a new stream (see IncStatDB::setSelection)
+    void clearWindows(int begin, int end);
+
+    // The weight of the i-th time window as it would be after decaying to time t (the state is not changed)
+    double decayedWeight(int i, double t) const;
+
+    // Whether the timestamps themselves are the statistics
+    bool getIsTypeDiff() const { return isTypeDiff; }
 };
 
 
@@ -140,154 +727,602 @@ public:
  * IncStatCov 维护两个流之间的关系(连边),
  * 里面存放着两个流的指针和他们两个之间的统计信息
  */
+template<int N, class Real>
 class IncStatCov {
 private:
-    // 维护的时间窗口列表的指针
-    std::vector<double> *lambdas;
+    typedef typename WindowArray<N, Real>::type Windows;
+
     // 每个值减去均值的乘积和 , sum (A-uA)(B-uB), 协方差的分子部分
-    double *CF3 = nullptr;
     // 当前权值
-    double *w3 = nullptr;
+    alignas(StatAlignment) Windows CF3;
+    Windows w3;
+    // 维护的时间窗口列表的指针
+    std::vector<double> *lambdas;
     // 上次时间戳
     double lastTimestamp;
     // 两个拉格朗日外推法的类
-    Extrapolator ex1, ex2;
+    Extrapolator<ExtrapolatorPoints> ex1, ex2;
+
+    // 懒更新的边记录的两个流的残差和与权值的快照, 以及快照对应的时间和插入的个数. 不是懒更新的边为nullptr
+    struct Snapshot {
+        Windows residual, residualValue, w;
+        double time;
+        uint64_t inserts;
+    };
+    Snapshot *snapshots = nullptr;
+
+    // 时间窗口的个数, N 不是 DynamicWindows 时是常量
+    inline int windows() const { return N > 0 ? N : (int) lambdas->size(); }
+
+    // 记录第side个流(0: incS1, 1: incS2)当前的残差和
+    void takeSnapshot(int side);
+
+    // 将第side个流在快照之后插入的值计入协方差, 然后重新记录快照
+    void settleSide(int side, DecayFactors<N> &decay);
 
 public:
     // 两个流的指针:
-    IncStat *incS1, *incS2;
+    IncStat<N, Real> *incS1, *incS2;
     // 被引用的数量, 如果为0就销毁
     int refNum;
 
+    // 写快照时在内存池中的序号
+    uint32_t snapshotIndex = 0;
+
     // 构造函数, 参数分别是两个流的指针,lambdas指针,初始时间戳
-    IncStatCov(IncStat *inc1, IncStat *inc2, std::vector<double> *l, double init_time) {
+    IncStatCov(IncStat<N, Real> *inc1, IncStat<N, Real> *inc2, std::vector<double> *l, double init_time) {
         lambdas = l;
         incS1 = inc1;
         incS2 = inc2;
         lastTimestamp = init_time;
 
-        CF3 = new double[lambdas->size()];
-        for (size_t i = 0; i < lambdas->size(); ++i)CF3[i] = 0;
-        w3 = new double[lambdas->size()];
+        Windows *arrays[] = {&CF3, &w3};
+        WindowArray<N, Real>::allocate(arrays, 2, windows());
+        for (int i = 0; i < windows(); ++i)CF3[i] = 0;
         // 防止除以0
-        for (size_t i = 0; i < lambdas->size(); ++i)w3[i] = 1e-20;
+        for (int i = 0; i < windows(); ++i)w3[i] = 1e-20;
     }
 
     // 析构函数, (指向的类的实例会由map析构的时候调用的), 只需要delete掉自己new的即可
     ~IncStatCov() {
-        if (CF3 != nullptr) delete[] CF3;
-        if (w3 != nullptr) delete[] w3;
+        WindowArray<N, Real>::release(CF3);
+        dropLazy();
     }
 
     //更新这两个流的协方差等统计信息.
-    //只能是两个流其中一个流更新完调用的, 然后参数就是更新完的那个流的ID, 更新完的那个流更新用的v和t
+    //只能是两个流其中一个流更新完调用的, 然后参数就是更新完的那个流的指针, 更新完的那个流更新用的v和t
     //也就是其中一个流insert方法更新之后, 就紧接着调用这个方法, 更新相关的统计数据
-    void updateCov(const std::string &ID, double v, double t);
+    void updateCov(const IncStat<N, Real> *updated, double v, double t, DecayFactors<N> &decay);
 
-    // 执行衰减函数
-    void processDecay(double t);
+    // 执行衰减函数, 衰减因子由IncStatDB的decay计算
+    void processDecay(double t, DecayFactors<N> &decay);
 
+    // 以下四个函数只计算selection中选中的时间窗口
     // 计算两个流的radius( 方差和的平方根 ), 返回增加的数据的个数
-    int getRadius(double *result);
+    int getRadius(const StatSelection &selection, double *result);
 
     // 计算两个流的均值平方和的平方根, 返回增加的数据的个数
-    int getMagnitude(double *result);
+    int getMagnitude(const StatSelection &selection, double *result);
 
     // 计算两个流的协方差, 返回增加的数据的个数
-    int getCov(double *result);
+    int getCov(const StatSelection &selection, double *result);
 
     // 计算两个流的相关系数, 返回增加的数据的个数
-    int getPcc(double *result);
+    int getPcc(const StatSelection &selection, double *result);
+
+    //获取选中的二维统计信息 [ radius,magnitude,cov,pcc ], 返回增加的数据的个数
+    int get2DStats(const StatSelection &selection, double *result);
+
+    // 时间窗口[begin, end)回到新建的边的状态, 两个流的这些时间窗口也已经回到新建的流的状态
+    void clearWindows(int begin, int end);
+
+    // 第i个时间窗口的权值衰减到时间t之后的值 (不改变状态, 懒更新的边需要先settle)
+    double decayedWeight(int i, double t) const;
+
+    // 变成懒更新的边: 之后两个流插入新值时不再调用updateCov, 而是累积在流的残差和里, 在settle时一次计入.
+    // 外推的值按照被更新的流自己的值计算 (即updateCov中predict在刚插入的点上的值),
+    // 另一个流的均值使用settle时的均值, 所以这个流在两次settle之间均值变化时结果是近似的
+    void makeLazy();
+
+    // 懒更新的边: 衰减到时间t, 并计入两个流在上次settle之后插入的值
+    void settle(double t, DecayFactors<N> &decay);
+
+    // 懒更新的边刚刚建立时, 计入被更新的流(incS1)刚插入的值v (对应updateCov)
+    void addFirst(double v, double t, DecayFactors<N> &decay);
+
+    // 回到每次都更新的边, 调用前应该先settle
+    void dropLazy();
+
+    bool isLazy() const { return snapshots != nullptr; }
+
+    // 快照中边按字节保存在内存池的镜像里 (见IncStatDB::save). saveArrays写入对象之外的部分:
+    // 是否懒更新, DynamicWindows时的时间窗口数组, 懒更新的快照.
+    // restoreImage 在从镜像复制来的边上重新设置指针 (两个流应该已经restoreImage), 并读回saveArrays写入的内容
+    void saveArrays(SnapshotWriter &out) const;
+
+    void restoreImage(SnapshotReader &in, std::vector<double> *l, IncStat<N, Real> *s1, IncStat<N, Real> *s2);
+};
 
-    //获取所有的二维统计信息 [ radius,magnitude,cov,pcc ], 返回增加的数据的个数
-    int getAll2DStats(double *result);
+
+/**
+ *  IncStatDB 删除不活跃的流的策略. 默认不删除任何流
+ */
+struct EvictionPolicy {
+    // 最长的时间窗口(最小的lambda)下衰减后的权值小于epsilon的边会被删除,
+    // 权值小于epsilon并且没有边的流也会被删除(jitter的流除外). 为0表示不按权值删除
+    double epsilon = 0;
+
+    // 每个IncStatDB最多保存的流的个数, 超过时删除最久没有被访问的流(LRU). 为0表示不限制, 否则至少为2
+    size_t maxStreams = 0;
+
+    // 每次更新时检查的哈希表的槽的个数, 检查的工作均摊到每个包上, 不会一次扫描整个表
+    int sweepPerUpdate = 8;
+};
+
+/**
+ *  IncStatDB 的流和边的数量, 以及被删除的数量
+ */
+struct EvictionCounters {
+    size_t streams = 0, edges = 0;
+    size_t evictedStreams = 0, evictedEdges = 0;
+
+    EvictionCounters &operator+=(const EvictionCounters &other) {
+        streams += other.streams;
+        edges += other.edges;
+        evictedStreams += other.evictedStreams;
+        evictedEdges += other.evictedEdges;
+        return *this;
+    }
 };
 
 
 /**
  *  IncStatDB 维护当前统计的一类流的集合
  */
+template<int N, class Real = double>
 class IncStatDB {
 private:
-    // 统计的一类流的集合, string为对应的键值, value 为指向对应流的指针
-    std::map<std::string, IncStat *> stats;
+    // 统计的一类流的集合, StreamKey为对应的键值, value 为指向对应流的指针
+    StreamTable<IncStat<N, Real> > stats;
+
+    // 找到键值对应的流, 没有的话新建一个
+    IncStat<N, Real> *getStream(const StreamKey &ID, double t, bool isTypeDiff);
+
+    // 更新流的一维信息, 返回增加的数据的个数
+    int update1D(IncStat<N, Real> *incStat, double t, double v, double *result);
+
+    // 更新两个流之间的二维信息, 返回增加的数据的个数.
+    // incStat2为nullptr时只更新第一个流的边 (懒更新时什么都不做), 不返回统计
+    int update2D(IncStat<N, Real> *incStat1, IncStat<N, Real> *incStat2, double t1, double v1, double *result);
+
+    // 这一类流共用的衰减因子, 以及更新的时间窗口的范围
+    DecayFactors<N> decay;
+
+    // 选中的统计和它们的时间窗口 (见setSelection), 默认是所有的统计和时间窗口
+    StatSelection selection;
+
+    // 流和边的内存池, 删除的流和边的内存会被复用, IncStatDB析构时一次性释放
+    SlabPool streamPool, edgePool;
+
+    // 在内存池中新建一条边, 加入两个流的边的列表 (懒更新时也加入索引)
+    IncStatCov<N, Real> *newEdge(IncStat<N, Real> *incStat1, IncStat<N, Real> *incStat2, double t);
+
+    // 内存池中序号为i的流和边 (写快照和读回快照时按内存池的顺序访问)
+    IncStat<N, Real> *stream(size_t i) const { return static_cast<IncStat<N, Real> *>(streamPool.object(i)); }
+
+    IncStatCov<N, Real> *edge(size_t i) const { return static_cast<IncStatCov<N, Real> *>(edgePool.object(i)); }
+
+    // 析构并回收到内存池
+    void destroy(IncStat<N, Real> *incStat) {
+        incStat->~IncStat<N, Real>();
+        streamPool.release(incStat);
+    }
+
+    void destroy(IncStatCov<N, Real> *incStatCov) {
+        incStatCov->~IncStatCov<N, Real>();
+        edgePool.release(incStatCov);
+    }
+
+    // 是否懒更新边. 懒更新时边按两个流的指针索引, 每个包只更新被查询的一条边
+    bool lazyEdges = false;
+
+    // 流是否被复制到别的IncStatDB中 (见ShardedNetStat), 这时懒更新边的流即使没有边也要记录残差和
+    bool mirrored = false;
+    StreamTable<IncStatCov<N, Real> > edges;
+
+    // 边在edges中的键值, 与两个流的顺序无关
+    static StreamKey edgeKey(const IncStat<N, Real> *a, const IncStat<N, Real> *b) {
+        uint64_t x = reinterpret_cast<uintptr_t>(a), y = reinterpret_cast<uintptr_t>(b);
+        StreamKey key = {{x < y ? x : y, x < y ? y : x, 0, 0, 0}};
+        return key;
+    }
+
+    // 删除策略, 最长的时间窗口的下标, 见到的最新的时间戳
+    EvictionPolicy policy;
+    int longestWindow = 0;
+    double now = -INFINITY;
+
+    // 下一次检查的哈希表的槽
+    size_t sweepCursor = 0;
+
+    // LRU链表, 表头是最近访问的流 (只在设置了maxStreams时维护)
+    IncStat<N, Real> *lruHead = nullptr, *lruTail = nullptr;
+
+    EvictionCounters counters;
+
+    // 每次更新开始时调用: 记录时间戳, 检查sweepPerUpdate个槽, 删除不活跃的边和流
+    void sweep(double t);
+
+    // 将流移动到LRU链表的表头
+    void touch(IncStat<N, Real> *incStat);
+
+    // 从LRU链表中摘下流
+    void unlink(IncStat<N, Real> *incStat);
+
+    // 删除一条边, 从两个流中去掉它
+    void removeEdge(IncStatCov<N, Real> *incStatCov);
+
+    // 删除一个流和它所有的边
+    void evict(IncStat<N, Real> *incStat);
     // lambdas 维护的时间窗口列表的 指针
     std::vector<double> *lambdas;
 
 public:
     // 构造器, 将时间窗口的指针列表传过来
-    IncStatDB(std::vector<double> *l) {
+    IncStatDB(std::vector<double> *l) : decay(l), streamPool(sizeof(IncStat<N, Real>), alignof(IncStat<N, Real>)),
+                                        edgePool(sizeof(IncStatCov<N, Real>), alignof(IncStatCov<N, Real>)) {
         lambdas = l;
+        for (size_t i = 1; i < lambdas->size(); ++i)
+            if (lambdas->at(i) < lambdas->at(longestWindow))longestWindow = i;
+        selection = FeatureMask(lambdas->size()).selection(FeatureMask::H, longestWindow);
+    }
+
+    // 设置统计向量中这一类流选中的统计 (见StatSelection), 之后只衰减和更新[begin, end)中的时间窗口, 只计算选中的统计.
+    // 之前不在范围中的时间窗口没有跟着衰减, 所有的流和边的这些时间窗口回到新建时的状态, 之后重新累积
+    void setSelection(const StatSelection &s);
+
+    // 设置删除不活跃的流的策略
+    void setEvictionPolicy(const EvictionPolicy &p);
+
+    // 设置是否懒更新边 (见IncStatCov::makeLazy), 默认每个包更新第一个流的所有边.
+    // 懒更新时每个包的开销与流的边的个数无关, 但二维统计是近似的
+    void setLazyEdges(bool lazy);
+
+    // 设置流是否被复制到别的IncStatDB中
+    void setMirrored(bool m) { mirrored = m; }
+
+    // 对每个流的键值调用f(key)
+    template<class F>
+    void forEachStreamKey(F f) const {
+        stats.forEach([&f](const StreamKey &key, IncStat<N, Real> *) { f(key); });
     }
 
-    // 更新指定流的一维信息, 并将统计值[weight,mean,std]追加到result里, 返回增加的数据的个数
-    int updateGet1DStats(const std::string &ID, double t, double v, double *result,
+    // 在快照中写入所有的流和边, 以及删除策略和计数. 格式 (每一项都是8字节或者补齐到8字节):
+    // 流的个数, 哈希表的槽的个数, 边的个数, 删除的流和边的个数, now, 删除策略, sweepCursor, 标志(懒更新, 被复制),
+    // 更新的时间窗口的范围 (两个uint32); 流和边的内存池的镜像 (见SlabPool::save), 流和边按字节保存在里面.
+    // 之后按内存池的顺序, 序号都是内存池中的序号: 每个流: 所在的槽, 哈希值, 边的个数, IncStat::saveArrays;
+    // 每条边: 两个流的序号 (两个uint32), IncStatCov::saveArrays; 所有流的边的序号组成的一个数组 (uint32);
+    // 设置了maxStreams时LRU链表中流的序号 (uint32, 从表头开始)
+    void save(SnapshotWriter &out);
+
+    // 从快照中读回 save 写入的内容, 只能在新建的IncStatDB上调用. 内存池的镜像整个复制到新的slab中,
+    // 然后一遍将序号换成指针, 流放回原来的槽, 所以之后的删除与保存前一致.
+    // 保存时不在范围中的时间窗口回到空的状态 (见setSelection)
+    void restore(SnapshotReader &in);
+
+    // 流和边的内存池的统计信息
+    const PoolStats &getStreamPoolStats() const { return streamPool.getStats(); }
+
+    const PoolStats &getEdgePoolStats() const { return edgePool.getStats(); }
+
+    // 当前流和边的数量, 以及被删除的数量
+    EvictionCounters getCounters() const {
+        EvictionCounters c = counters;
+        c.streams = stats.size();
+        return c;
+    }
+
+    // 更新指定流的一维信息, 并将选中的统计值[weight,mean,var]追加到result里 (见setSelection, 下同), 返回增加的数据的个数
+    int updateGet1DStats(const StreamKey &ID, double t, double v, double *result,
                          bool isTypeDiff = false);
 
     // 更新指定流的二维信息,将[radius,magnitude,cov,pcc]添加到结果里面
     // 参数分别是: 第一个流的ID,第二个流的ID, 第一个流的统计信息,时间戳, 结果的数组的指针, 返回增加的数据的个数
-    int updateGet2DStats(const std::string &ID1, const std::string &ID2, double t1, double v1,
+    int updateGet2DStats(const StreamKey &ID1, const StreamKey &ID2, double t1, double v1,
                          double *result, bool isTypediff = false);
 
     // 更新指定流的一维,二维信息, 将一维的[ weight,mean,std]和二维的[radius,magnitude,cov,pcc]返回
     // 参数分别是: 流的ID, 时间戳, 统计数据, 结果数组的指针, 最后一个如果设置true,就用时间戳作为统计数据
     // 返回增加的数据的个数
-    int updateGet1D2DStats(const std::string &ID1, const std::string &ID2, double t1,
+    // 第一个流只查找一次
+    int updateGet1D2DStats(const StreamKey &ID1, const StreamKey &ID2, double t1,
                            double v1, double *result, bool isTypediff = false) {
-        int offset = updateGet1DStats(ID1, t1, v1, result, isTypediff);
-        return offset + updateGet2DStats(ID1, ID2, t1, v1, result + offset, isTypediff);
+        sweep(t1);
+        IncStat<N, Real> *incStat1 = getStream(ID1, t1, isTypediff);
+        int offset = update1D(incStat1, t1, v1, result);
+        return offset + update2D(incStat1, getStream(ID2, t1, isTypediff), t1, v1, result + offset);
+    }
+
+    // 更新第一个流的一维信息, 将一维统计和两个流的[radius,magnitude]添加到result里, 不维护两个流之间的边
+    // (没有选中cov和pcc时使用, 见FeatureMask), 返回写入的数据的个数
+    int updateGet1DPairStats(const StreamKey &ID1, const StreamKey &ID2, double t1, double v1, double *result) {
+        sweep(t1);
+        IncStat<N, Real> *incStat1 = getStream(ID1, t1, false);
+        int offset = update1D(incStat1, t1, v1, result);
+        return offset + incStat1->getPairStats(*getStream(ID2, t1, false), selection, result + offset);
     }
 
-    // 析构函数, 将维护的incStat 的指针的集合指向的值, 全部释放掉
+    // 以下是ShardedNetStat使用的函数, 流在它所在的分片中只更新一维信息, 边所在的分片保存两个流的副本和它们之间的边
+
+    // 更新指定流的一维信息, 并将统计值追加到result里, 返回这个流 (用来更新它的副本)
+    const IncStat<N, Real> *updateGet1DStream(const StreamKey &ID, double t, double v, double *result) {
+        sweep(t);
+        IncStat<N, Real> *incStat = getStream(ID, t, false);
+        update1D(incStat, t, v, result);
+        return incStat;
+    }
+
+    // 找到指定的流, 没有的话新建一个, 返回它现在的状态
+    const IncStat<N, Real> *getStreamState(const StreamKey &ID, double t) { return getStream(ID, t, false); }
+
+    // 这个IncStatDB保存的是副本: 第一个流插入v之后的状态是state1, 更新它的副本以及副本在这里的边.
+    // state2不为nullptr时 (这两个流之间的边在这里), 还要将这条边的[radius,magnitude,cov,pcc]添加到result里,
+    // state2是第二个流现在的状态, 返回增加的数据的个数
+    int updateMirrored2D(const StreamKey &ID1, const IncStat<N, Real> &state1, const StreamKey &ID2,
+                         const IncStat<N, Real> *state2, double t1, double v1, double *result);
+
+    // 析构函数, 将维护的incStat 的指针的集合指向的值, 全部析构掉, 内存由内存池一次性释放
     ~IncStatDB() {
 //        std::fprintf(stderr, "the number of incStat is: %d\n", stats.size());
 //        int ans = 0;
 //        int m = 0;
-        for (auto it:stats) {
-//            ans += it.second->covs.size();
-//            if (it.second->covs.size() > m)m = it.second->covs.size();
-            delete it.second;
-        }
+        stats.forEach([this](const StreamKey &, IncStat<N, Real> *incStat) {
+//            ans += incStat->covs.size();
+//            if (incStat->covs.size() > m)m = incStat->covs.size();
+            // 边被两个流引用, 维护一个refNum, 当减为0的时候才析构
+            for (auto v : incStat->covs)
+                if ((--v->refNum) == 0)destroy(v);
+            destroy(incStat);
+        });
 //        std::fprintf(stderr, "the number of incStatCov is %d\n", ans);
 //        std::fprintf(stderr, "the max number of incStatCov is %d\n", m);
     }
 };
 
 /**
- * NetStat 类维护着当前的网络统计信息, 包括主机,分组抖动, 网络信道等统计信息
- * 负责将包生成统计的实例向量
+ * NetStatBase 是所有NetStat<N>的公共接口, FE通过它使用与时间窗口个数对应的NetStat<N>
  */
-
-class NetStat {
-private:
+class NetStatBase {
+protected:
     // 时间窗口
     std::vector<double> lambdas;
+
+    // 选中的特征, 以及四类流各自要做的工作和选中的统计 (见setFeatureMask)
+    FeatureMask mask;
+    FeatureMask::Work work[FeatureMask::FamilyCount];
+    StatSelection selection[FeatureMask::FamilyCount];
+
+    // 掩码选中的特征的个数, 以及每类流的第一个选中的特征在其中的位置, 各类流把选中的统计直接写到自己的位置
+    int maskedSize = 0;
+    int columns[FeatureMask::FamilyCount];
+
+    // 统计向量的各个特征在完整的统计向量中的下标, 选中所有特征并且没有设置顺序时为空
+    std::vector<int> selected;
+
+    // setFeatureOrder设置的顺序 (下标是掩码选中的特征的序号), 没有设置时为空
+    std::vector<int> order;
+
+    // 设置了顺序时, 各类流先把掩码选中的特征写到这里, 再按顺序挑出
+    std::vector<double> maskedRows;
+
+    // n个包的掩码选中的特征的位置 (每行maskedSize个): 没有设置顺序时就是result, 否则是maskedRows
+    double *maskedRowsFor(double *result, int n);
+
+    // 从n行掩码选中的特征masked中按顺序挑出, 按行写到result. masked就是result时什么都不做
+    void orderFeatures(const double *masked, int n, double *result) const;
+
+    // 由mask得到各类流的工作, 选中的统计和位置. 不更新的一类流的时间窗口的范围不变
+    void selectStats();
+
+    // 将各类流选中的统计交给它们的IncStatDB (见IncStatDB::setSelection)
+    virtual void applySelections() = 0;
+
+public:
+    // 写快照的文件头和时间窗口, shards 为 0 表示 NetStat, valueBytes 是状态的每个值的字节数
+    void writeSnapshotHeader(SnapshotWriter &out, uint32_t shards, uint32_t dbCount, uint32_t valueBytes) const;
+
+    // 写入/读回所有IncStatDB的状态, readSnapshot只在loadNetStat新建的对象上调用, dbCount是文件头中IncStatDB的个数
+    virtual void writeSnapshot(SnapshotWriter &out) = 0;
+
+    virtual void readSnapshot(SnapshotReader &in, uint32_t dbCount) = 0;
+
+    friend NetStatBase *loadNetStat(const char *filename);
+
+    // 正在写后台快照的子进程的pid (没有时为0), 上一个后台快照是否成功
+    long snapshotChild = 0;
+    bool snapshotSucceeded = true;
+
+public:
+    NetStatBase(const std::vector<double> &l) : lambdas(l), mask(l.size()) { selectStats(); }
+
+    // 后台快照还没有写完时等待它写完
+    virtual ~NetStatBase() { waitSnapshot(); }
+
+    // 主要的调用函数, 传进去一个解码好的包, 返回对应的统计向量. 每个包的处理过程中不会分配内存 (新的流除外)
+    virtual int updateAndGetStats(const PacketRecord &pkt, double *result) = 0;
+
+    // 批量处理n个包, 第i个包的统计向量写到result + i * getVectorSize(), 返回n.
+    // 并行模式下四类流在各自的线程里处理整批包, 结果与逐个调用updateAndGetStats完全相同
+    virtual int updateAndGetBatch(const PacketRecord *pkts, int n, double *result) = 0;
+
+    // 文本形式的调用函数, 将文本解析成PacketRecord再统计, 文本应该是FE/tshark输出的格式:
+    // MAC为aa:bb:cc:dd:ee:ff, IP为点分十进制或IPv6格式, 端口为数字或者"icmp"/"arp"/"" (其他协议, 这时IP被MAC代替).
+    // 不能解析的地址按照文本的哈希值区分
+    // 参数分别是: 源MAC,目的MCA,源IP, IP协议类型, 目的IP, 目的IP协议类型, 数据包大小, 数据包时间戳
+    int updateAndGetStats(const std::string &srcMAC, const std::string &dstMAC,
+                          const std::string &srcIP, const std::string &srcProtocol,
+                          const std::string &dstIP, const std::string &dstProtocol,
+                          double datagramSize, double timestamp, double *result);
+
+    // 返回生成的统计实例向量的维度, 即选中的特征的个数 (默认全部选中, 每个lambda对应20个特征)
+    int getVectorSize() const { return order.empty() ? maskedSize : (int) order.size(); }
+
+    // 完整的统计向量的维度
+    int getFullVectorSize() const { return lambdas.size() * 20; }
+
+    // 统计向量只包含mask选中的特征 (顺序见FeatureMask), 各类流只做选中的特征需要的工作, 只更新选中的时间窗口所在的范围,
+    // 只计算选中的统计 (见FeatureMask::work, StatSelection). 应该在处理第一个包之前设置: 不维护的边在之后重新选中cov/pcc时
+    // 不是最新的, 重新选中的时间窗口从空的状态开始. mask的时间窗口个数必须与lambdas相同, 至少选中一个特征.
+    // 没有cov和pcc时源和目的是同一个流的包的radius和magnitude由这个流自己计算 (不再取它的第一条边)
+    void setFeatureMask(const FeatureMask &m);
+
+    const FeatureMask &getFeatureMask() const { return mask; }
+
+    // 统计向量改为掩码选中的特征中的第order[0], order[1]...个 (例如KitNET::getFeatureOrder(), 使每个自编码器的输入
+    // 连续), 可以只包含部分特征或重复. 有掩码时本来就要挑出选中的特征, 这个顺序不增加开销. 可以在任何时候设置,
+    // order为空时恢复掩码的顺序, setFeatureMask会清除顺序
+    void setFeatureOrder(const std::vector<int> &o);
+
+    const std::vector<int> &getFeatureOrder() const { return order; }
+
+    // 统计向量的第i个特征在完整的统计向量中的下标
+    int getFeatureIndex(int i) const { return selected.empty() ? i : selected[i]; }
+
+    // 返回时间窗口列表
+    const std::vector<double> &getLambdas() const { return lambdas; }
+
+    // 设置四类流的删除不活跃的流的策略
+    virtual void setEvictionPolicy(const EvictionPolicy &p) = 0;
+
+    // 设置是否懒更新流之间的边 (见IncStatDB::setLazyEdges)
+    virtual void setLazyEdges(bool lazy) = 0;
+
+    // 设置是否并行处理批量的包 (见updateAndGetBatch), 并行模式多用三个线程
+    virtual void setParallel(bool parallel) = 0;
+
+    virtual bool isParallel() const = 0;
+
+    // 四类流的流和边的内存池的统计信息的总和
+    virtual PoolStats getStreamPoolStats() const = 0;
+
+    virtual PoolStats getEdgePoolStats() const = 0;
+
+    // 四类流的流和边的数量, 以及被删除的数量的总和
+    virtual EvictionCounters getCounters() const = 0;
+
+    // 将所有的流, 边, 外推法的队列和时间戳保存到快照文件filename, 之后可以用loadNetStat恢复.
+    // 先写到filename.tmp再改名, 写失败时报错, 原来的快照不受影响
+    void saveSnapshot(const char *filename);
+
+    // 在后台保存快照: fork出的子进程写出fork时的状态 (写时复制), 调用者马上可以继续处理包.
+    // 上一个后台快照还没有写完时什么都不做, 返回false. 没有fork的平台(WIN32)上在当前线程保存
+    bool saveSnapshotInBackground(const char *filename);
+
+    // 等待后台快照写完, 返回上一个后台快照是否成功
+    bool waitSnapshot();
+};
+
+/**
+ * NetStat 类维护着当前的网络统计信息, 包括主机,分组抖动, 网络信道等统计信息
+ * 负责将包生成统计的实例向量. N 是时间窗口的个数 (DynamicWindows 表示运行时决定)
+ */
+template<int N, class Real = double>
+class NetStat : public NetStatBase {
+private:
     // 统计四类流的信息,
     //1. HT_jit: 主机与主机之间的抖动统计 只统计1维 (3个特征)
     //2. HT_MI: MAC-IP发送流的关系统计  只统计1维 (3个特征)
     //3. HT_H: 维护源主机发送流的一维带宽统计和与目的主机发送流之间的二维统计
     //4. HT_Hp: 维护源主机端口发送流的一维带宽统计和与目的主机端口发送流之间的二维统计 (7个特征), 这个与上面的HT_H不同是键值是ip+port, 考虑每个端口
-    IncStatDB *HT_jit = nullptr, *HT_MI = nullptr, *HT_H = nullptr, *HT_Hp = nullptr;
+    IncStatDB<N, Real> *HT_jit = nullptr, *HT_MI = nullptr, *HT_H = nullptr, *HT_Hp = nullptr;
+
+    // 统计向量中四类流的顺序, 与FeatureMask::Family相同
+    enum Family {
+        FamilyMI, FamilyH, FamilyJit, FamilyHp, FamilyCount
+    };
+
+    // 更新一类流, 把它的统计写到完整的统计向量result中它的位置, 返回写入的个数. 不同类的流互不相关, 可以在不同线程里同时更新
+    int updateFamily(int family, const PacketRecord &pkt, double *result);
+
+    // 一个线程要处理的一类流和一批包
+    struct FamilyJob {
+        NetStat *netStat;
+        int family;
+        const PacketRecord *pkts;
+        int n;
+        double *result;
+    };
+
+    static void runFamily(void *job);
+
+    // 并行模式下分别更新HT_MI, HT_jit, HT_Hp的线程 (HT_H在调用者的线程里更新), 串行模式下为nullptr
+    WorkerThread *workers[3] = {nullptr, nullptr, nullptr};
 
 public:
-    // 构造器, 参数是lambdas
+    // 构造器, 参数是lambdas, N 不是 DynamicWindows 时lambdas的个数必须是N
     NetStat(const std::vector<double> &l);
 
     // 无参构造器, 使用默认的lambdas
     NetStat();
 
-    // 主要的调用函数, 传进去一个包信息, 返回对应的统计向量
-    // 参数分别是: 源MAC,目的MCA,源IP, IP协议类型, 目的IP, 目的IP协议类型, 数据包大小, 数据包时间戳
-    int updateAndGetStats(const std::string &srcMAC, const std::string &dstMAC,
-                          const std::string &srcIP, const std::string &srcProtocol,
-                          const std::string &dstIP, const std::string &dstProtocol,
-                          double datagramSize, double timestamp, double *result);
+    using NetStatBase::updateAndGetStats;
+
+    int updateAndGetStats(const PacketRecord &pkt, double *result) override;
+
+    int updateAndGetBatch(const PacketRecord *pkts, int n, double *result) override;
+
+    void setEvictionPolicy(const EvictionPolicy &p) override {
+        HT_jit->setEvictionPolicy(p);
+        HT_MI->setEvictionPolicy(p);
+        HT_H->setEvictionPolicy(p);
+        HT_Hp->setEvictionPolicy(p);
+    }
+
+    void setLazyEdges(bool lazy) override {
+        HT_H->setLazyEdges(lazy);
+        HT_Hp->setLazyEdges(lazy);
+    }
+
+    void setParallel(bool parallel) override;
+
+    bool isParallel() const override { return workers[0] != nullptr; }
+
+    PoolStats getStreamPoolStats() const override {
+        PoolStats p = HT_jit->getStreamPoolStats();
+        p += HT_MI->getStreamPoolStats();
+        p += HT_H->getStreamPoolStats();
+        p += HT_Hp->getStreamPoolStats();
+        return p;
+    }
+
+    PoolStats getEdgePoolStats() const override {
+        PoolStats p = HT_jit->getEdgePoolStats();
+        p += HT_MI->getEdgePoolStats();
+        p += HT_H->getEdgePoolStats();
+        p += HT_Hp->getEdgePoolStats();
+        return p;
+    }
+
+    EvictionCounters getCounters() const override {
+        EvictionCounters c = HT_jit->getCounters();
+        c += HT_MI->getCounters();
+        c += HT_H->getCounters();
+        c += HT_Hp->getCounters();
+        return c;
+    }
+
+protected:
+    void applySelections() override;
 
-    // 返回生成的统计实例向量的维度, 当前是每个lambda对应20个特征
-    int getVectorSize() { return lambdas.size() * 20; }
+    // 四个IncStatDB的顺序是 HT_jit, HT_MI, HT_H, HT_Hp
+    void writeSnapshot(SnapshotWriter &out) override;
 
+    void readSnapshot(SnapshotReader &in, uint32_t dbCount) override;
+
+public:
     // 析构函数, delete掉 new 的四个实例
     ~NetStat() {
+        setParallel(false);
         delete HT_H;
         delete HT_Hp;
         delete HT_MI;
@@ -295,6 +1330,168 @@ public:
     }
 };
 
+/**
+ * ShardedNetStat 按流的键值的哈希把流分到若干个分片, 每个分片有自己的IncStatDB, 同一批包由各个分片在各自的线程里处理.
+ * 一个包的每个流只在它所在的分片中更新一维统计. 两个流之间的边所在的分片由两个流的键值一起决定, 这个分片保存两个流的副本:
+ * 流所在的分片处理完这批包的一维统计后, 记录每个包之后源流和目的流的状态, 边所在的分片再按包的顺序用这些状态更新副本和边.
+ * 一个流的状态只在它自己的包中改变, 所以结果与NetStat相同, 只有以下情况例外:
+ * 源和目的是同一个流的包 (NetStat取这个流的第一条边, 这里取这个分片中的第一条边), 删除不活跃的流 (每个分片分别删除),
+ * 以及懒更新边的舍入误差 (分片中的流总是记录残差和)
+ */
+template<int N>
+class ShardedNetStat : public NetStatBase {
+private:
+    // 一个分片的流: 四类流的一维统计, 以及HT_H, HT_Hp的边和边的两个流的副本
+    struct Shard {
+        IncStatDB<N> *HT_jit, *HT_MI, *HT_H, *HT_Hp;
+        IncStatDB<N> *edges_H, *edges_Hp;
+    };
+    std::vector<Shard> shards;
+
+    // 包的各个流的键值和所在的分片, 边所在的分片.
+    // visitH, visitHp是HT_H, HT_Hp中源流的副本可能在的分片 (第shard % 64位), 在更新一维统计时由源流所在的分片填写
+    struct PacketKeys {
+        StreamKey MI, jit, H1, H2, Hp1, Hp2;
+        uint64_t hashH1, hashH2, hashHp1, hashHp2;
+        int shardMI, shardJit, shardH1, shardH2, shardHp1, shardHp2, shardEdgeH, shardEdgeHp;
+        uint64_t visitH, visitHp;
+    };
+
+    // 流的副本可能在的分片 (第shard % 64位), 只多不少: 副本被删除后它的位不清除.
+    // 每个流的记录在流所在的分片中, 按包的顺序维护, 所以更新副本时每个分片只需要处理副本可能在这里的包
+    struct MirrorDirectory {
+        StreamTable<uint64_t> table;
+        std::deque<uint64_t> masks;
+
+        // 流的记录, 没有的话新建一个空的
+        uint64_t &get(const StreamKey &key, uint64_t h) {
+            uint64_t *mask = table.find(key, h);
+            if (mask == nullptr) {
+                masks.push_back(0);
+                mask = &masks.back();
+                table.insert(key, h, mask);
+            }
+            return *mask;
+        }
+
+        void clear() {
+            table.clear();
+            masks.clear();
+        }
+    };
+
+    // 每个分片中HT_H, HT_Hp的流的副本的记录 (只在维护边时使用), 以及上一次重建之后记录的总数
+    MirrorDirectory *directoryH = nullptr, *directoryHp = nullptr;
+    size_t directoryLive = 0;
+
+    static uint64_t shardBit(int shard) { return (uint64_t) 1 << (shard % 64); }
+
+    // 所有分片的记录的总数
+    size_t directorySize() const;
+
+    // 根据各个分片中现有的副本重建记录 (记录中有很多已经删除的副本时, 以及读回快照之后)
+    void rebuildDirectories();
+
+    // 一批包最多的个数, 更大的批被分成几批处理
+    static const int BatchCapacity = 512;
+
+    // 当前一批包的键值, 以及每个包之后HT_H, HT_Hp中源流和目的流的状态
+    std::vector<PacketKeys> keys;
+    IncStat<N> *states = nullptr;
+
+    IncStat<N> &state(int which, int i) { return states[which * BatchCapacity + i]; }
+
+    // 一批包分三步处理, 每一步中各个分片同时工作, 一步完成之后才开始下一步:
+    // 计算键值 (每个分片算一段包), 更新一维统计并记录流的状态, 更新副本和边
+    enum Step {
+        StepKeys, Step1D, Step2D
+    };
+
+    // 一个分片在一步中要做的工作
+    struct ShardJob {
+        ShardedNetStat *netStat;
+        int shard, step;
+        const PacketRecord *pkts;
+        int n;
+        double *result;
+    };
+
+    std::vector<ShardJob> jobs;
+
+    static void runShard(void *job);
+
+    void computeKeys(int shard, const PacketRecord *pkts, int n);
+
+    void update1D(int shard, const PacketRecord *pkts, int n, double *result);
+
+    void update2D(int shard, const PacketRecord *pkts, int n, double *result);
+
+    // 处理不超过BatchCapacity个包, parallel为false时所有分片都在调用者的线程里处理
+    void processBatch(const PacketRecord *pkts, int n, double *result, bool parallel);
+
+    // 并行模式下处理第1到shards-1个分片的线程 (第0个分片在调用者的线程里), 串行模式下为空
+    std::vector<WorkerThread *> workers;
+
+    int shardOf(uint64_t hash) const { return (int) ((hash >> 32) % shards.size()); }
+
+public:
+    // 构造器, 参数是分片的个数和lambdas, 默认是并行模式
+    ShardedNetStat(int shardCount, const std::vector<double> &l);
+
+    using NetStatBase::updateAndGetStats;
+
+    // 单个包在调用者的线程里处理
+    int updateAndGetStats(const PacketRecord &pkt, double *result) override;
+
+    int updateAndGetBatch(const PacketRecord *pkts, int n, double *result) override;
+
+    int getShardCount() const { return shards.size(); }
+
+    void setEvictionPolicy(const EvictionPolicy &p) override;
+
+    void setLazyEdges(bool lazy) override;
+
+    void setParallel(bool parallel) override;
+
+    bool isParallel() const override { return !workers.empty(); }
+
+    PoolStats getStreamPoolStats() const override;
+
+    PoolStats getEdgePoolStats() const override;
+
+    // 流的个数不包括副本
+    EvictionCounters getCounters() const override;
+
+    ~ShardedNetStat();
+
+protected:
+    // edges_H, edges_Hp与HT_H, HT_Hp选中的统计相同
+    void applySelections() override;
+
+    // 每个分片依次写 HT_jit, HT_MI, HT_H, HT_Hp, edges_H, edges_Hp
+    void writeSnapshot(SnapshotWriter &out) override;
+
+    void readSnapshot(SnapshotReader &in, uint32_t dbCount) override;
+};
+
+// 默认的时间窗口 {5, 3, 1, 0.1, 0.01}
+const std::vector<double> &defaultLambdas();
+
+// 新建一个NetStat: lambdas的个数不超过MaxFixedWindows时是NetStat<lambdas.size()>, 否则是NetStat<DynamicWindows>
+NetStatBase *newNetStat(const std::vector<double> &lambdas = defaultLambdas());
+
+// 新建一个有shards个分片的ShardedNetStat, 时间窗口的个数的选择与newNetStat相同
+NetStatBase *newShardedNetStat(int shards, const std::vector<double> &lambdas = defaultLambdas());
+
+// 新建一个紧凑模式的NetStat: 流和边的状态用float保存, 均值/方差/标准差不缓存, 每次需要时重新计算.
+// 每个流和边占用的内存大约减半, 统计向量与newNetStat的相对误差见 test/compactNetStatAccuracy.cpp
+NetStatBase *newCompactNetStat(const std::vector<double> &lambdas = defaultLambdas());
+
+// 从NetStatBase::saveSnapshot写的快照新建NetStat或ShardedNetStat, 时间窗口和分片个数与保存时相同.
+// 文件被映射到内存中, 流和边的内存池的镜像整个复制到新的slab, 再将保存的序号换成指针, 流放回原来的槽;
+// 删除策略和懒更新也与保存时相同, 并行模式为新建时的默认值
+NetStatBase *loadNetStat(const char *filename);
+
 
 
 #endif //KITSUNE_CPP_NETSTAT_H
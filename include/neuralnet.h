@@ -9,69 +9,166 @@
 
 #include <cstdio>
 #include <cstring>
+#include <vector>
 #include "utils.h"
 
 
+// The instruction sets the Dense kernels are written for
+enum SimdLevel {
+    SimdScalar, SimdAVX2, SimdAVX512
+};
+
+// The widest instruction set of the CPU that has kernels (SimdScalar on other architectures and compilers)
+SimdLevel detectSimdLevel();
+
+// Choose the kernels of the Dense layers created from now on, by default the ones of detectSimdLevel();
+// a level the CPU lacks is lowered to it, a layer narrower than a vector uses the scalar kernels.
+// Every level gives exactly the same results: the sums are added up in the same order, without fused multiply-add
+void setDenseSimdLevel(SimdLevel level);
+
+SimdLevel getDenseSimdLevel();
+
+// The weights of a row are padded to a multiple of this many doubles (one cache line, a full AVX-512 register)
+const int DenseLanes = 8;
+
+// The batches go through the layers this many rows at a time: the kernels weight the rows with each row of W
+// they load (small matrix products), and the sums of the rows are independent. It is also the size of a mini-batch
+const int DenseBatchRows = 4;
+
+// The kernels of one vector instruction set (see neuralnet.cpp)
+struct DenseKernels;
+
+class WorkerThread;
+
+// AE::reconstruct has a fused kernel for every visible size up to this one, with a hidden size up to it as well
+const int FusedAEMaxSize = 16;
+
+// Whether the autoencoders created from now on reconstruct with the fused kernels (the default), of the level of
+// the Dense kernels. The fused kernels give exactly the same errors as the layer by layer reconstruction
+void setFusedAE(bool on);
+
+bool getFusedAE();
+
+template<class Activation>
+class BasicAE;
+
+/**
+ *  Where the arrays of one autoencoder are: in its two Dense layers for AE, in the arena for AEEnsemble.
+ *  The rows of the weights are padded to the strides like in Dense
+ */
+struct AEArrays {
+    int visible, hidden; // the sizes of the layers
+
+    int hiddenStride, visibleStride; // the lengths of the rows of the encoder's weights and of the decoder's weights
+
+    double *encoderW, *encoderBias, *decoderW, *decoderBias;
+
+    double *min_v, *max_v; // the bounds of the 0-1 normalization
+};
+
 /**
- *  Simple fully connected network layer
+ *  Simple fully connected network layer. Activation is the activation policy (see utils.h): with the policies known at
+ *  compile time (SigmoidActivation, ReLUActivation...) the activation and its derivative are inlined into the loops
+ *  over the outputs, Dense calls them through the function pointers given to its constructor
  */
-class Dense {
+template<class Activation>
+class BasicDense {
 private:
     int n_in;    // input size
 
     int n_out;    // output size
 
-    double **W = nullptr; // connection weight
+    int stride; // n_out rounded up to a multiple of DenseLanes, the length of a row of W and of the output buffers
 
-    double *bias = nullptr; // threshold
+    // connection weight, n_in rows of stride doubles in one aligned buffer:
+    // W[i * stride + j] connects input i to output j, the padding stays 0.
+    // The forward pass adds up the rows, backpropagation reads the rows and adds to them, so every pass streams W
+    double *W = nullptr;
 
-    double (*activation)(double); // function pointer to the activation function
+    double *bias = nullptr; // threshold, stride doubles
 
-    double (*activationDerivative)(double); // function pointer to the derivative of the activation function (parameter is the function value of the activation function)
+    Activation activation; // the activation function and its derivative (parameter is the function value)
 
     double learning_rate; // learning rate
 
     double *inputValue = nullptr; //Temporary variable to hold the input value
 
-    double *outputValue = nullptr; // Temporary variable to hold the output value
+    double *outputValue = nullptr; // Temporary variable to hold the output value, stride doubles (the padding stays 0)
+
+    // The weighted sums of the forward pass before the activation, DenseBatchRows rows of stride doubles
+    double *sum = nullptr;
+
+    const DenseKernels *kernels; // The kernels chosen when the layer is created, nullptr for the scalar code
+
+    friend class BasicAE<Activation>; // The autoencoder gives the fused kernels the weights
 
 public:
-    // Constructor, the parameters are the number of input neurons, the number of output neurons, activation function, derivative of activation function, learning rate (default 0.1)
-    Dense(int inSize, int outSize, double (*activationFunc)(double), double (*activationDerivativeFunc)(double),
-          double lr = 0.1);
+    // Constructor, the parameters are the number of input neurons, the number of output neurons, the activation policy,
+    // learning rate (default 0.1)
+    BasicDense(int inSize, int outSize, const Activation &act, double lr = 0.1);
+
+    // Constructor of Dense, the parameters are the number of input neurons, the number of output neurons, activation function, derivative of activation function, learning rate (default 0.1)
+    template<class F>
+    BasicDense(int inSize, int outSize, F *activationFunc, F *activationDerivativeFunc, double lr = 0.1)
+            : BasicDense(inSize, outSize, Activation(activationFunc, activationDerivativeFunc), lr) {}
+
+    ~BasicDense();
 
-    ~Dense();
+    BasicDense(const BasicDense &) = delete;
+
+    BasicDense &operator=(const BasicDense &) = delete;
 
     // For forward propagation, the third parameter indicates whether to save the temporary variable of the input and output values. (Only false when forward propagation, must be true when bp is required after propagation)
     void feedForward(const double *input, double *output, bool saveValue = false);
 
+    // feedForward of the n rows of input (n_in each) into the rows of output (n_out each), the same outputs as row by row
+    void feedForwardBatch(const double *input, double *output, int n);
+
     // Backpropagate the error, and save the error propagated to the previous layer to g. The capacity of g needs to be max(n_in,n_out)
     void BackPropagation(double *g);
 };
 
+// The layer with the activation called through function pointers, any function can be given at run time
+typedef BasicDense<PointerActivation> Dense;
+
 
 /**
- *  Autoencoder class, by maintaining two fully connected layers (encoder and decoder)
+ *  Autoencoder class, by maintaining two fully connected layers (encoder and decoder) with the activation policy
  */
-class AE {
+template<class Activation>
+class BasicAE {
 private:
     int visible_size; // The size of the visible layer
 
     int hidden_size; // hidden layer size
 
-    Dense *encoder = nullptr, *decoder = nullptr; // Two-layer neural network, encoder and decoder
+    // Two-layer neural network, encoder and decoder
+    BasicDense<Activation> *encoder = nullptr, *decoder = nullptr;
 
     double *min_v = nullptr, *max_v = nullptr; // 0-1 normalization needs to maintain the maximum and minimum values
 
     double *tmp_x, *tmp_y, *tmp_z, *tmp_g; // Temporary variables
 
+    // The rows of the batches: the normalized inputs (visible_size apart), the outputs of the encoder and of the
+    // decoder and the errors (stride apart), DenseBatchRows of each
+    double *batch_x, *batch_y, *batch_z, *batch_g;
+
+    AEArrays arrays; // The arrays of the layers, for the fused reconstruct
+
+    // The fused reconstruct of the sizes, nullptr when they have none
+    double (*fusedReconstruct)(AEArrays &ae, const double *x) = nullptr;
+
     // 0-1 normalization, the result is saved in tmp_x
     void normalize(const double *x);
 
 public:
     // Constructor, the parameter is the number of visible layer, hidden layer, learning rate, default 0.01
-    AE(int v_sz, int h_sz, double _learning_rate = 0.01);
-    ~AE();
+    BasicAE(int v_sz, int h_sz, double _learning_rate = 0.01);
+    ~BasicAE();
+
+    BasicAE(const BasicAE &) = delete;
+
+    BasicAE &operator=(const BasicAE &) = delete;
 
     // reconstruction, returns the root mean error of the reconstruction
     double reconstruct(const double *x);
@@ -79,7 +176,134 @@ public:
     // training, returns the root mean error of the reconstruction
     double train(const double *x);
 
+    // reconstruct the n rows of X (visible_size each), the errors go to errors[0..n). The same errors as row by row
+    void reconstructBatch(const double *X, int n, double *errors);
+
+    // Mini-batch SGD of the n rows of X, DenseBatchRows at a time: the rows of a mini-batch go forward and back
+    // with the same weights, then their updates are added up in one step. The learning rate stays the one of a row,
+    // so it is train with the updates of a few rows delayed, not the same weights. errors as with train
+    void trainMiniBatch(const double *X, int n, double *errors);
 };
 
+// The autoencoder of KitNET, sigmoid is inlined
+typedef BasicAE<SigmoidActivation> AE;
+
+
+/**
+ *  The autoencoders of an ensemble layer packed into one aligned arena: the normalization bounds, the weights,
+ *  the biases and the buffers of every autoencoder follow each other in the order they are used, and the
+ *  autoencoders in the order they are evaluated, so a pass over the ensemble streams the arena from start to end.
+ *  The weights are initialized in the order of as many BasicAE created one after the other, so the errors are the
+ *  same as theirs.
+ *  The autoencoders are independent, with setThreads they are split into consecutive groups of about the same work
+ *  that run on persistent worker threads, with the same errors
+ */
+template<class Activation>
+class BasicAEEnsemble {
+private:
+    // One autoencoder, its arrays and buffers are in the arena
+    struct Member {
+        AEArrays arrays;
+
+        // The normalized input and the outputs of the encoder and of the decoder, DenseBatchRows rows of the strides
+        double *x, *y, *z;
+
+        // The sums of the kernels and the gradient propagated by the decoder, DenseBatchRows rows of the larger stride
+        double *sum, *g;
+
+        const DenseKernels *encoderKernels, *decoderKernels; // nullptr for the scalar code, like in Dense
+
+        double (*fusedReconstruct)(AEArrays &ae, const double *x); // nullptr when the sizes have none
+    };
+
+    std::vector<Member> members;
+
+    double *arena = nullptr;
+
+    int inputSize = 0; // The sum of the visible sizes
+
+    double learning_rate;
+
+    std::vector<int> inputOffsets; // Where the inputs of each autoencoder start in a row of inputs
+
+    // The autoencoders [groupStarts[g], groupStarts[g + 1]) run on thread g, thread 0 is the caller
+    std::vector<int> groupStarts;
+
+    std::vector<WorkerThread *> workers;
+
+    enum Pass {
+        Reconstruct, Train, TrainMiniBatch
+    };
+
+    // The autoencoders of a group with n rows of inputs
+    struct GroupJob {
+        BasicAEEnsemble *ensemble;
+        int first, last;
+        const double *X;
+        int n;
+        double *errors;
+        Pass pass;
+    };
+
+    std::vector<GroupJob> jobs;
+
+    static void runGroup(void *job);
+
+    // Every autoencoder of [first, last) goes through the n rows, so its part of the arena stays in the cache
+    void runMembers(int first, int last, const double *X, int n, double *errors, Pass pass);
+
+    void runBatch(const double *X, int n, double *errors, Pass pass);
+
+    double reconstructMember(Member &m, const double *x);
+
+    double trainMember(Member &m, const double *x);
+
+    // Like BasicAE::reconstructBatch and BasicAE::trainMiniBatch for up to DenseBatchRows rows of X (inputSize apart),
+    // the errors of row r go to errors[r * size()]
+    void reconstructRows(Member &m, const double *X, int rows, double *errors);
+
+    void trainRows(Member &m, const double *X, int rows, double *errors);
+
+public:
+    // One autoencoder for each pair of visible and hidden sizes, in this order
+    BasicAEEnsemble(const std::vector<int> &visibleSizes, const std::vector<int> &hiddenSizes,
+                    double _learning_rate = 0.01);
+
+    ~BasicAEEnsemble();
+
+    BasicAEEnsemble(const BasicAEEnsemble &) = delete;
+
+    BasicAEEnsemble &operator=(const BasicAEEnsemble &) = delete;
+
+    int size() const { return members.size(); }
+
+    // The length of the inputs: the inputs of the autoencoders one after the other
+    int getInputSize() const { return inputSize; }
+
+    // Reconstructs the inputs of every autoencoder, errors receives the root mean errors (size() of them)
+    void reconstruct(const double *x, double *errors);
+
+    // Trains every autoencoder with its inputs, errors receives the root mean errors of the reconstructions
+    void train(const double *x, double *errors);
+
+    // reconstruct and train for n rows of inputs (getInputSize() each), the errors of row i are at errors + i * size().
+    // Each group of autoencoders takes the whole batch in one job, the errors are the same as row by row
+    void reconstructBatch(const double *X, int n, double *errors);
+
+    void trainBatch(const double *X, int n, double *errors);
+
+    // Like BasicAE::trainMiniBatch for every autoencoder, the errors as with trainBatch
+    void trainMiniBatch(const double *X, int n, double *errors);
+
+    // Run on this many threads (the caller's and threads - 1 workers, at most one per autoencoder), 1 by default.
+    // Every call waits for the workers: the batches amortize it for small ensembles
+    void setThreads(int threads);
+
+    int getThreads() const { return groupStarts.size() - 1; }
+};
+
+// The ensemble layer of KitNET
+typedef BasicAEEnsemble<SigmoidActivation> AEEnsemble;
+
 
 #endif //KITSUNE_CPP_NEURALNET_H
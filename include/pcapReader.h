@@ -0,0 +1,142 @@
+/**
+ * @brief Native reader for libpcap and pcapng capture files.
+ *
+ * Decodes the link, network and transport headers of every frame directly into the
+ * fields that FE needs, so a capture no longer has to go through tshark and a .tsv copy.
+ */
+#ifndef KITSUNE_CPP_PCAPREADER_H
+#define KITSUNE_CPP_PCAPREADER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ *  The decoded header fields of one frame.
+ *  Each group mirrors one or more of the tshark fields that pcap2tcv extracts
+ *  (frame.time_epoch, frame.len, eth.*, ip.*, ipv6.*, tcp.*, udp.*, icmp.*, arp.*),
+ *  and a has* flag is false exactly when tshark would leave the corresponding columns empty.
+ */
+struct PcapPacket {
+    // frame.time_epoch and frame.len (the original length on the wire)
+    double timestamp;
+    int frameLen;
+
+    // eth.src, eth.dst
+    bool hasEth;
+    uint8_t ethSrc[6], ethDst[6];
+
+    // ip.src, ip.dst
+    bool hasIPv4;
+    uint8_t ipv4Src[4], ipv4Dst[4];
+
+    // ipv6.src, ipv6.dst
+    bool hasIPv6;
+    uint8_t ipv6Src[16], ipv6Dst[16];
+
+    // tcp.srcport/tcp.dstport or udp.srcport/udp.dstport
+    bool hasTCP, hasUDP;
+    uint16_t srcPort, dstPort;
+
+    // icmp.type, icmp.code
+    bool hasICMP;
+    uint8_t icmpType, icmpCode;
+
+    // arp.opcode, arp.src.hw_mac, arp.src.proto_ipv4, arp.dst.hw_mac, arp.dst.proto_ipv4
+    // hasARPIPv4 is set when the addresses are Ethernet/IPv4 (the only kind tshark's proto_ipv4 fields cover)
+    bool hasARP, hasARPIPv4;
+    uint16_t arpOpcode;
+    uint8_t arpSrcMAC[6], arpDstMAC[6];
+    uint8_t arpSrcIP[4], arpDstIP[4];
+
+    // Reset all the has* flags
+    void clear();
+};
+
+
+// Format a MAC address the way tshark prints eth.src (aa:bb:cc:dd:ee:ff), returns the length written
+int formatMAC(const uint8_t *mac, char *out);
+
+// Format an IPv4 address in dotted decimal, returns the length written
+int formatIPv4(const uint8_t *ip, char *out);
+
+// Format an IPv6 address in the RFC 5952 compressed form, returns the length written
+int formatIPv6(const uint8_t *ip, char *out);
+
+
+/**
+ *  PcapReader, reads a libpcap (.pcap, micro- or nanosecond, either byte order) or
+ *  pcapng (.pcapng) file frame by frame and decodes the headers of each frame.
+ *  Supported link types: Ethernet (with 802.1Q/802.1ad tags), raw IP, Linux cooked (SLL/SLL2) and BSD loopback.
+ *  IP fragments are not reassembled, unlike tshark by default: the first fragment has the ports of its transport
+ *  header and the others none, where tshark gives the ports to the frame that completes the datagram. So the
+ *  streams of fragmented traffic (mostly large UDP datagrams) differ from the tshark path
+ */
+class PcapReader {
+private:
+    std::FILE *fp = nullptr;
+
+    // Buffer holding the current frame (or pcapng block)
+    std::vector<uint8_t> buffer;
+
+    // true if the file is pcapng, false if it is the classic libpcap format
+    bool isNg;
+
+    // true if the file was written with the opposite byte order
+    bool swapped;
+
+    // libpcap: true if the timestamps are in nanoseconds; link type of the file
+    bool nanosecond;
+    uint32_t linkType;
+
+    // pcapng: link type and timestamp resolution of each interface of the current section
+    struct Interface {
+        uint32_t linkType;
+        uint64_t units;      // ticks per second
+        int decimals;        // digits of the fraction if units is a power of 10, otherwise -1
+    };
+    std::vector<Interface> interfaces;
+
+    uint16_t read16(const uint8_t *p) const;
+
+    uint32_t read32(const uint8_t *p) const;
+
+    // Read n bytes to the front of buffer, returns false at the end of the file
+    bool readBytes(size_t n);
+
+    // Read the pcapng section header whose first 12 bytes (type, length, byte-order magic) are already in buffer
+    void readSectionHeader();
+
+    // Read the next pcapng block into buffer, returns its type, or 0 at the end of the file
+    uint32_t readBlock(uint32_t &length);
+
+    // Parse an interface description block held in buffer
+    void readInterface(uint32_t length);
+
+    // Decode the link layer (and everything above it) of a captured frame
+    void decodeLink(uint32_t link, const uint8_t *p, uint32_t len, PcapPacket &pkt);
+
+    // Decode an Ethernet type / payload pair
+    void decodeEtherType(uint16_t type, const uint8_t *p, uint32_t len, PcapPacket &pkt);
+
+    void decodeIPv4(const uint8_t *p, uint32_t len, PcapPacket &pkt);
+
+    void decodeIPv6(const uint8_t *p, uint32_t len, PcapPacket &pkt);
+
+    void decodeTransport(uint8_t proto, const uint8_t *p, uint32_t len, PcapPacket &pkt);
+
+public:
+    // Constructor, the parameter is the name of the capture file
+    PcapReader(const char *filename);
+
+    // Read and decode the next frame, returns false when there are no more frames
+    bool nextPacket(PcapPacket &pkt);
+
+    ~PcapReader() {
+        if (fp != nullptr) std::fclose(fp);
+    }
+};
+
+
+#endif //KITSUNE_CPP_PCAPREADER_H
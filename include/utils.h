@@ -10,84 +10,160 @@
  */
 
 #include <cstdio>
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <utility>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
 
 
 // 将pcap文件转为tsv,并且返回tsv文件的指针
 FILE *pcap2tcv(const char *);
 
+// 只读地将整个文件映射到内存, 返回起始地址并把大小写入size, 失败(或者平台不支持, 或者文件为空)返回nullptr
+const char *mapFileReadOnly(const char *filename, size_t &size);
+
+// 解除mapFileReadOnly建立的映射
+void unmapFile(const char *data, size_t size);
+
+// 分配按alignment字节对齐的内存 (alignment是2的幂), 失败时抛出std::bad_alloc, 用alignedFree释放
+void *alignedAlloc(size_t size, size_t alignment);
+
+void alignedFree(void *p);
+
+// 启动tshark解析pcap文件, 返回tshark标准输出的管道 (不生成tsv文件).
+// tshark还在运行的时候就可以一边读取一边提取特征, 需要用pclose关闭 (TsvReader的isPipe参数)
+FILE *pcap2tcvPipe(const char *);
+
+
+/*
+ *  StrView, 不拥有内存的字符串视图 (指针+长度), 用于零拷贝地访问某一列
+ *  (项目使用C++11, 没有std::string_view)
+ */
+struct StrView {
+    const char *data;
+    size_t size;
+
+    bool empty() const { return size == 0; }
+
+    std::string toString() const { return std::string(data, size); }
+};
+
+
+/*
+ *  解析地址的文本形式, 成功返回true. 参数都是视图, 不需要以'\0'结尾
+ */
+
+// 解析 aa:bb:cc:dd:ee:ff 格式的MAC地址, 结果在低48位
+bool parseMAC(StrView s, uint64_t &mac);
+
+// 解析点分十进制的IPv4地址
+bool parseIPv4(StrView s, uint32_t &ip);
+
+// 解析IPv6地址 (支持"::"压缩和结尾内嵌的IPv4), ip[0]为高64位, ip[1]为低64位
+bool parseIPv6(StrView s, uint64_t ip[2]);
+
+// 文本的128位哈希值 (两个不同种子和乘数的FNV-1a), 用于无法解析的地址
+void hashText(StrView s, uint64_t h[2]);
+
 
 /*
  *  TvsReader , 负责读取tsv,csv格式的类, 使用文件名初始化, 对于每行可以通过列的id读取
+ *  使用文件名初始化时可以选择mmap模式: 整个文件映射到内存, 直接在映射的内存上逐行解析, 不拷贝每一行
  */
 class TsvReader {
 private:
-    std::FILE *fp;
+    std::FILE *fp = nullptr;
     char *buffer;
-    std::vector<int> id; // 当前buffer里面第i列的位置(从0开始)
+    int bufferSize; // buffer的当前容量, 遇到更长的行会扩容, 不会截断
+    const char *line = nullptr; // 当前行的起始位置 (指向buffer或者映射的内存)
+    std::vector<int> id; // 当前行里面第i列的位置(从0开始)
     char delimitor;  // 当前分隔符
+    bool isPipe = false; // fp是否是popen打开的管道 (析构时需要pclose)
+
+    // mmap模式: 映射的文件内容, 大小, 下一行的位置
+    const char *mapped = nullptr;
+    size_t mappedSize = 0, mappedPos = 0;
 
-    // 常量, 缓冲区大小
+    // 常量, 缓冲区初始大小
     static const int BufferSize = 3000;
+
+    // 将文件映射到内存, 失败(或者平台不支持)返回false
+    bool mapFile(const char *filename);
+
+    // 从fp中读取一整行到buffer中, 返回false表示读到了文件末尾
+    bool readLine();
+
+    // 读取映射内存中的下一行, 返回false表示读到了文件末尾
+    bool nextMappedLine();
+
 public:
-    // 构造器, 参数为文件的名字和分隔符, 默认是tsv文件(分隔符为'\t')
-    TsvReader(const char *filename, char d = '\t') {
-        fp = nullptr;
+    // 构造器, 参数为文件的名字,分隔符和是否使用mmap, 默认是tsv文件(分隔符为'\t')
+    TsvReader(const char *filename, char d = '\t', bool useMmap = false) {
+        delimitor = d;
+        bufferSize = BufferSize;
+        buffer = new char[bufferSize];
+        if (useMmap && mapFile(filename))return;
         fp = std::fopen(filename, "r");
         if (fp == nullptr) {
             std::fprintf(stderr, "\nTsvReader: File name is invalid!\n");
+            delete[] buffer;
             throw -1;
         }
-        delimitor = d;
-        buffer = new char[BufferSize];
     }
 
-    //构造器, 参数为文件指针和分隔符, 默认是tsv文件(分隔符为'\t')
-    TsvReader(FILE *_fp, char d = '\t') {
+    //构造器, 参数为文件指针, 分隔符和文件指针是否是管道, 默认是tsv文件(分隔符为'\t')
+    TsvReader(FILE *_fp, char d = '\t', bool pipe = false) {
         fp = _fp;
+        isPipe = pipe;
         if (fp == nullptr) {
             std::fprintf(stderr, "\nTsvReader: File pointer is invalid!\n");
             throw -1;
         }
         delimitor = d;
-        buffer = new char[BufferSize];
+        bufferSize = BufferSize;
+        buffer = new char[bufferSize];
     }
 
     // 读取并预处理下一行, 返回当前行的列数. 如果读到了最后一行, 返回0
     int nextLine();
 
+    // 返回第col列的视图, 指向当前行的内存, 读取下一行后失效
+    inline StrView getView(int col) {
+        const char *begin = line + id[col];
+        const char *end = begin;
+        while (*end != delimitor && *end != '\r' && *end != '\n' && *end != '\0')++end;
+        return StrView{begin, (size_t) (end - begin)};
+    }
+
     // 将第col列变成string返回
     std::string getString(int col);
 
     // 将col列变成int返回
     inline int getInt(int col) {
         int ans = 0;
-        int now = id[col];
-        while (buffer[now] >= '0' && buffer[now] <= '9')
-            ans = (ans << 3) + (ans << 1) + buffer[now++] - '0';
+        const char *now = line + id[col];
+        while (*now >= '0' && *now <= '9')
+            ans = (ans << 3) + (ans << 1) + *now++ - '0';
         return ans;
     }
 
     // 将第col列变成double返回
     inline double getDouble(int col) {
-        return strtod(buffer + id[col], nullptr);
+        return strtod(line + id[col], nullptr);
     }
 
     // 判断第col列有没有值
     inline bool hasValue(int col) {
-        int now = id[col];
-        return buffer[now] != delimitor && buffer[now] != '\r' && buffer[now] != '\n' && buffer[now] != '\0';
+        char c = line[id[col]];
+        return c != delimitor && c != '\r' && c != '\n' && c != '\0';
     }
 
     // 析构函数, 释放空间
-    ~TsvReader() {
-        if (fp != nullptr) std::fclose(fp);
-        delete[] buffer;
-    }
+    ~TsvReader();
 
 };
 
@@ -123,6 +199,284 @@ public:
 };
 
 
+/**
+ *  FeatureBIN 实例向量的二进制格式 (本机字节序):
+ *  文件头 FeatureBinHeader, 然后是 lambdaCount 个double的时间窗口,
+ *  之后是紧密排列的行, 每行 vectorSize 个double. 行数由文件大小得到.
+ *  头部的大小是8的倍数, 所以映射之后行数据可以直接当作double数组读取, 不需要任何解析
+ */
+struct FeatureBinHeader {
+    char magic[8];        // "KITSFEAT"
+    uint32_t version;     // 格式的版本, 当前为1
+    uint32_t vectorSize;  // 每个实例向量的维度
+    uint32_t lambdaCount; // 时间窗口的个数
+    uint32_t reserved;    // 保留, 为0
+
+    static const char Magic[8];
+    static const uint32_t Version = 1;
+};
+
+/**
+ *  读取FeatureBIN文件的类, 优先使用mmap, 每一行直接返回映射内存里的指针
+ */
+class FeatureBinReader {
+private:
+    std::FILE *fp = nullptr;
+    double *buffer = nullptr; // 不能映射时, 保存fread读到的当前行
+
+    const char *mapped = nullptr;
+    size_t mappedSize = 0;
+    const double *rows = nullptr; // 映射内存中第一行的位置
+
+    int vectorSize;
+    std::vector<double> lambdas;
+    size_t rowCount = 0, nowRow = 0;
+
+public:
+    // 构造器, 参数为文件名
+    FeatureBinReader(const char *filename);
+
+    // 返回下一行的指针, 读取下一行之前有效. 没有更多的行时返回nullptr
+    const double *next();
+
+    // 返回之后最多maxNum个连续行的指针, 行数保存在num里(为0表示没有更多的行), 读取下一批之前有效
+    const double *nextBlock(int maxNum, int &num);
+
+    int getVectorSize() const { return vectorSize; }
+
+    // 生成这个文件的NetStat使用的时间窗口
+    const std::vector<double> &getLambdas() const { return lambdas; }
+
+    ~FeatureBinReader();
+};
+
+/**
+ *  生成FeatureBIN文件的类, 用法与TsvWriter相同
+ */
+class FeatureBinWriter {
+private:
+    FILE *fp = nullptr;
+    int vectorSize;
+public:
+    // 构造器, 参数分别是 文件名, 实例向量的维度, 时间窗口
+    FeatureBinWriter(const char *filename, int vector_size, const std::vector<double> &lambdas);
+
+    void write(const double *p, int n) {
+        if (n != vectorSize) {
+            std::fprintf(stderr, "\nFeatureBinWriter: vector size mismatch!\n");
+            throw -1;
+        }
+        std::fwrite(p, sizeof(double), n, fp);
+    }
+
+    ~FeatureBinWriter() { std::fclose(fp); }
+};
+
+
+/**
+ *  NetStat 状态快照的文件头 (见NetStatBase::saveSnapshot), 本机字节序.
+ *  之后是 windows 个double的时间窗口, 然后是 dbCount 个IncStatDB的段 (格式见IncStatDB::save).
+ *  所有的字段都是8字节或者按8字节对齐写入的, 所以映射之后double数组可以直接读取
+ */
+struct SnapshotHeader {
+    char magic[8];     // "KITSSNAP"
+    uint32_t version;  // 格式的版本, 当前为5
+    uint32_t windows;  // 时间窗口的个数
+    uint32_t shards;   // 0 表示NetStat, 否则是ShardedNetStat的分片个数
+    uint32_t dbCount;  // IncStatDB的个数
+    uint32_t valueBytes; // 流和边的状态的每个值的字节数: 8 (double), 4 (紧凑模式的float)
+    uint32_t reserved;
+
+    static const char Magic[8];
+    static const uint32_t Version = 5;
+};
+
+/**
+ *  写快照文件的类: 先写到 filename.tmp, finish 时改名为 filename, 所以文件要么是完整的旧快照, 要么是完整的新快照.
+ *  文件和缓冲区在构造时准备好, 写的过程中不再分配内存 (fork出的子进程也可以安全地使用)
+ */
+class SnapshotWriter {
+private:
+    std::FILE *fp = nullptr;
+    std::string path, tempPath;
+    char *buffer;
+    size_t used = 0, capacity;
+    size_t written = 0; // 写入的总字节数
+    bool failed = false, finished = false;
+
+    void flush();
+
+public:
+    // 构造器, 参数为文件名和缓冲区的大小
+    SnapshotWriter(const char *filename, size_t bufferSize = 1 << 20);
+
+    SnapshotWriter(const SnapshotWriter &) = delete;
+
+    SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+    void write(const void *p, size_t n);
+
+    template<class T>
+    void put(const T &x) { write(&x, sizeof(T)); }
+
+    // 补齐到8字节的倍数
+    void align();
+
+    // 写完, 关闭并改名, 返回是否成功 (失败时删除临时文件)
+    bool finish();
+
+    // 只关闭文件, 不删除也不改名 (文件由fork出的子进程继续写)
+    void detach();
+
+    ~SnapshotWriter();
+};
+
+/**
+ *  读快照文件的类: 优先使用mmap, 读取的数据直接指向映射的内存, 不逐条解析
+ */
+class SnapshotReader {
+private:
+    const char *mapped = nullptr;
+    size_t size = 0, pos = 0;
+    std::vector<char> copy; // 不能映射时读入的文件内容
+    std::string filename;
+
+public:
+    // 构造器, 参数为文件名
+    SnapshotReader(const char *filename);
+
+    SnapshotReader(const SnapshotReader &) = delete;
+
+    SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+    // 返回接下来的n个字节, 文件不够长时报错
+    const void *take(size_t n);
+
+    template<class T>
+    T get() {
+        T x;
+        std::memcpy(&x, take(sizeof(T)), sizeof(T));
+        return x;
+    }
+
+    // 接下来的n个double (8字节对齐)
+    const double *doubles(size_t n) { return static_cast<const double *>(take(sizeof(double) * n)); }
+
+    // 跳过补齐的字节
+    void align() { take((8 - pos % 8) % 8); }
+
+    // 是否已经读到文件的末尾
+    bool atEnd() const { return pos == size; }
+
+    ~SnapshotReader();
+};
+
+
+/**
+ *  SlabPool 的统计信息
+ */
+struct PoolStats {
+    size_t slabs = 0;       // 申请的slab的个数
+    size_t bytes = 0;       // slab占用的字节数
+    size_t live = 0;        // 正在使用的对象的个数
+    size_t peak = 0;        // live的最大值
+    size_t allocations = 0; // 分配的总次数
+    size_t recycled = 0;    // 其中复用释放过的对象的次数
+
+    PoolStats &operator+=(const PoolStats &other) {
+        slabs += other.slabs;
+        bytes += other.bytes;
+        live += other.live;
+        peak += other.peak;
+        allocations += other.allocations;
+        recycled += other.recycled;
+        return *this;
+    }
+};
+
+/**
+ *  定长对象的内存池: 每次向系统申请一整块(slab)可以放slabObjects个对象的内存,
+ *  释放的对象放进空闲链表, 下次分配直接复用, 分配和释放都是O(1), 析构时一次性释放所有的slab.
+ *  只管理内存, 构造和析构由使用者调用 (placement new 和显式调用析构函数)
+ */
+class SlabPool {
+private:
+    size_t objectSize, alignment, slabObjects;
+    std::vector<void *> slabs;
+    // 当前slab中还没有分配过的部分
+    char *cursor = nullptr, *end = nullptr;
+    // 释放的对象组成的链表, 链表的指针存放在对象本身的内存里
+    void *freeList = nullptr;
+    PoolStats stats;
+    // 按地址排序的slab和它们的序号, 由对象的地址找到它的序号 (见indexOf)
+    std::vector<std::pair<const char *, size_t> > byAddress;
+    // 按序号记录每个对象是否在使用中的位图 (见findLive), 随slab一起分配, 写快照时不再分配内存
+    std::vector<uint64_t> liveBits;
+
+    // 申请一个新的slab
+    void grow();
+
+public:
+    // 参数分别是 对象的大小, 对齐的字节数 (2的幂), 每个slab中对象的个数
+    SlabPool(size_t objectSize, size_t alignment = 64, size_t slabObjects = 256);
+
+    SlabPool(const SlabPool &) = delete;
+
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    ~SlabPool();
+
+    // 分配一个对象的内存
+    inline void *allocate() {
+        void *p;
+        if (freeList != nullptr) {
+            p = freeList;
+            freeList = *static_cast<void **>(p);
+            ++stats.recycled;
+        } else {
+            if (cursor == end)grow();
+            p = cursor;
+            cursor += objectSize;
+        }
+        ++stats.allocations;
+        if (++stats.live > stats.peak)stats.peak = stats.live;
+        return p;
+    }
+
+    // 释放allocate分配的对象的内存
+    inline void release(void *p) {
+        *static_cast<void **>(p) = freeList;
+        freeList = p;
+        --stats.live;
+    }
+
+    const PoolStats &getStats() const { return stats; }
+
+    // 分配过的对象的个数 (包括已经释放的). 对象按所在的slab和在slab中的位置编号为 [0, used())
+    size_t used() const { return slabs.size() * slabObjects - (end - cursor) / objectSize; }
+
+    // 序号为i的对象的内存
+    void *object(size_t i) const { return static_cast<char *>(slabs[i / slabObjects]) + i % slabObjects * objectSize; }
+
+    // allocate返回的对象的序号
+    size_t indexOf(const void *p) const;
+
+    // 沿着空闲链表找出使用中的对象, 之后到下一次allocate或release之前可以用isLive查询. 不分配内存
+    void findLive();
+
+    // 序号为i的对象是否在使用中 (在findLive或restore之后)
+    bool isLive(size_t i) const { return (liveBits[i / 64] >> i % 64 & 1) != 0; }
+
+    // 在快照中写入内存池的镜像: 对象的大小, used(), 使用中的对象的位图, 以及前used()个对象的内存
+    // (释放的对象也原样写入). 在findLive之后调用, 不分配内存
+    void save(SnapshotWriter &out) const;
+
+    // 读回save写入的镜像, 整个slab复制到新申请的slab中, 对象的序号不变, 保存时释放的对象回到空闲链表.
+    // 只能在空的内存池上调用, 使用中的对象的内容由使用者修正 (其中的指针还是保存时的地址)
+    void restore(SnapshotReader &in);
+};
+
+
 /**
  *  一系列常见的激活函数
  */
@@ -139,16 +493,70 @@ inline double ReLU(double x) {
     return x < 0 ? 0 : x;
 }
 
+// pReLU 和 ELU 在 x < 0 时的系数
+const double pReLUAlpha = 0.01, ELUAlpha = 0.01;
+
 inline double pReLU(double x) {
-    const static double alpha = 0.01;
-    return x < 0 ? alpha * x : x;
+    return x < 0 ? pReLUAlpha * x : x;
 }
 
 inline double ELU(double x) {
-    const static double alpha = 0.01;
-    return x < 0 ? alpha * (std::exp(x) - 1) : x;
+    return x < 0 ? ELUAlpha * (std::exp(x) - 1) : x;
 }
 
+// 以下导数的参数与sigmoidDerivative相同, 是激活函数的函数值
+inline double ReLUDerivative(double fx) {
+    return fx > 0 ? 1 : 0;
+}
+
+inline double pReLUDerivative(double fx) {
+    return fx < 0 ? pReLUAlpha : 1;
+}
+
+inline double ELUDerivative(double fx) {
+    return fx < 0 ? fx + ELUAlpha : 1;
+}
+
+/**
+ *  激活函数的策略类, 作为BasicDense/BasicAE的模板参数. value是激活函数, derivative是它的导数 (参数是函数值).
+ *  编译时确定的策略被内联到计算的循环中, PointerActivation在运行时通过函数指针调用 (Dense使用的策略)
+ */
+struct SigmoidActivation {
+    double value(double x) const { return sigmoid(x); }
+
+    double derivative(double fx) const { return sigmoidDerivative(fx); }
+};
+
+struct ReLUActivation {
+    double value(double x) const { return ReLU(x); }
+
+    double derivative(double fx) const { return ReLUDerivative(fx); }
+};
+
+struct PReLUActivation {
+    double value(double x) const { return pReLU(x); }
+
+    double derivative(double fx) const { return pReLUDerivative(fx); }
+};
+
+struct ELUActivation {
+    double value(double x) const { return ELU(x); }
+
+    double derivative(double fx) const { return ELUDerivative(fx); }
+};
+
+struct PointerActivation {
+    double (*function)(double);
+
+    double (*derivativeFunction)(double);
+
+    PointerActivation(double (*f)(double), double (*d)(double)) : function(f), derivativeFunction(d) {}
+
+    double value(double x) const { return function(x); }
+
+    double derivative(double fx) const { return derivativeFunction(fx); }
+};
+
 
 /**
  * 一些回归评价指标
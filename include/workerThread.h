@@ -0,0 +1,120 @@
+/**
+ * @brief A worker thread fed through a lock-free single-producer single-consumer queue.
+ *
+ * The thread that owns a WorkerThread submits jobs (a function and its context) and later waits for them,
+ * no lock is taken on this path. An idle worker spins, then yields, then sleeps until the next job.
+ */
+#ifndef KITSUNE_CPP_WORKERTHREAD_H
+#define KITSUNE_CPP_WORKERTHREAD_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ *  SpscQueue, a bounded ring buffer that one thread pushes to and one other thread pops from.
+ *  The two indexes live on separate cache lines, so the two threads do not write to the same line
+ */
+template<class T>
+class SpscQueue {
+private:
+    T *ring;
+    size_t mask; // capacity - 1, the capacity is a power of 2
+
+    char pad0[64];
+    std::atomic<size_t> head; // next slot to pop, written by the consumer
+    char pad1[64];
+    std::atomic<size_t> tail; // next slot to push, written by the producer
+    char pad2[64];
+
+public:
+    // The capacity is rounded up to a power of 2
+    explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+        size_t c = 2;
+        while (c < capacity)c *= 2;
+        ring = new T[c];
+        mask = c - 1;
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    ~SpscQueue() { delete[] ring; }
+
+    // Producer: returns false if the queue is full
+    bool push(const T &x) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask)return false;
+        ring[t & mask] = x;
+        tail.store(t + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Consumer: returns false if the queue is empty
+    bool pop(T &x) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_seq_cst))return false;
+        x = ring[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_seq_cst);
+    }
+};
+
+
+/**
+ *  WorkerThread runs the jobs submitted to it in order, on its own thread.
+ *  submit and wait must be called from one thread (the owner)
+ */
+class WorkerThread {
+public:
+    typedef void (*Task)(void *context);
+
+private:
+    struct Job {
+        Task task;
+        void *context;
+    };
+
+    SpscQueue<Job> queue;
+
+    // Number of jobs submitted (only touched by the owner) and finished (written by the worker)
+    uint64_t submitted = 0;
+    std::atomic<uint64_t> completed;
+
+    std::atomic<bool> stopping, sleeping;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    std::thread thread;
+
+    void loop();
+
+public:
+    // capacity: the number of jobs that can wait in the queue
+    explicit WorkerThread(size_t capacity = 64);
+
+    WorkerThread(const WorkerThread &) = delete;
+
+    WorkerThread &operator=(const WorkerThread &) = delete;
+
+    // Finishes the submitted jobs and joins the thread
+    ~WorkerThread();
+
+    // Run task(context) on the worker, waits for room if the queue is full
+    void submit(Task task, void *context);
+
+    // Wait until every submitted job has finished
+    void wait();
+};
+
+
+#endif //KITSUNE_CPP_WORKERTHREAD_H
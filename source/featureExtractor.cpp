@@ -5,38 +5,88 @@
  */
 #include "../include/featureExtractor.h"
 
+#include <cstring>
+
 
 // netStat uses the default time window constructor, and reads the tsv package feature file by default
 FE::FE(const char *filename, FileType ft) {
     fileType = ft;
-    netStat = new NetStat();
-    if (fileType == PacketTSV || fileType == FeatureTSV) {// delimiter is tab
-        tsvReader = new TsvReader(filename, '\t');
-    } else if (fileType == PacketCSV || fileType == FeatureCSV) {// Delimiter is ','
-        tsvReader = new TsvReader(filename, ',');
-    } else if (fileType == PCAP) { // Files that need to be converted to tsv
-        tsvReader = new TsvReader(pcap2tcv(filename));
-    }
-    // The read package feature file needs to use netStat statistics
-    if (fileType == PCAP || fileType == PacketCSV || fileType == PacketTSV) {
-        // There is a header, so you need to read the header first
-        tsvReader->nextLine();
-    }
+    netStat = newNetStat();
+    open(filename);
 }
 
 // The constructor of the specified time window, the package feature file of the tsv read by default
 FE::FE(const char *filename, const std::vector<double> &lambdas, FileType ft) {
     fileType = ft;
-    netStat = new NetStat(lambdas);
+    netStat = newNetStat(lambdas);
+    open(filename);
+}
+
+
+// The same time windows, the streams are split among the shards
+void FE::useShards(int shards) {
+    if (binReader != nullptr)return;
+    replaceNetStat(newShardedNetStat(shards, netStat->getLambdas()));
+}
+
+void FE::useCompactState() {
+    if (binReader != nullptr)return;
+    replaceNetStat(newCompactNetStat(netStat->getLambdas()));
+}
+
+
+// The restored NetStat replaces the one of the constructor
+void FE::restoreSnapshot(const char *snapshot) {
+    if (binReader != nullptr)return;
+    replaceNetStat(loadNetStat(snapshot));
+}
+
+
+// The feature mask and the order set so far are kept
+void FE::replaceNetStat(NetStatBase *replacement) {
+    FeatureMask mask = netStat->getFeatureMask();
+    std::vector<int> order = netStat->getFeatureOrder();
+    delete netStat;
+    netStat = replacement;
+    if (mask.getWindows() == (int) netStat->getLambdas().size()) {
+        netStat->setFeatureMask(mask);
+        netStat->setFeatureOrder(order);
+    }
+}
+
+
+// Feature files only have their columns selected, packets are computed by netStat with the mask
+void FE::setFeatureMask(const FeatureMask &mask) {
+    if (binReader != nullptr)return;
+    netStat->setFeatureMask(mask);
+}
+
+
+// Feature files have their columns gathered in the order like the masked ones
+bool FE::setFeatureOrder(const std::vector<int> &order) {
+    if (binReader != nullptr)return false;
+    netStat->setFeatureOrder(order);
+    return true;
+}
+
+
+// Open the reader that matches fileType
+void FE::open(const char *filename) {
     if (fileType == PacketTSV || fileType == FeatureTSV) {// delimiter is tab
-        tsvReader = new TsvReader(filename, '\t');
+        tsvReader = new TsvReader(filename, '\t', true);
     } else if (fileType == PacketCSV || fileType == FeatureCSV) {// Delimiter is ','
-        tsvReader = new TsvReader(filename, ',');
-    } else if (fileType == PCAP) { // Files that need to be converted to tsv
+        tsvReader = new TsvReader(filename, ',', true);
+    } else if (fileType == PCAPTshark) { // Files that need to be converted to tsv
         tsvReader = new TsvReader(pcap2tcv(filename));
+    } else if (fileType == PCAPTsharkPipe) { // Streamed from tshark, nothing is written to disk
+        tsvReader = new TsvReader(pcap2tcvPipe(filename), '\t', true);
+    } else if (fileType == PCAP) { // Decoded directly, no tsv is generated
+        pcapReader = new PcapReader(filename);
+    } else if (fileType == FeatureBIN) { // Memory-mapped binary vectors
+        binReader = new FeatureBinReader(filename);
     }
     // The read package feature file needs to use netStat statistics
-    if (fileType == PCAP || fileType == PacketCSV || fileType == PacketTSV) {
+    if (fileType == PCAPTshark || fileType == PCAPTsharkPipe || fileType == PacketCSV || fileType == PacketTSV) {
         // There is a header, so you need to read the header first
         tsvReader->nextLine();
     }
@@ -46,44 +96,178 @@ FE::FE(const char *filename, const std::vector<double> &lambdas, FileType ft) {
 // Read the characteristics of a line of packets from the reader, pass it to netstat to obtain the vector of the next group of instances,
 // If successful, return the number of vectors, otherwise return 0
 int FE::nextVector(double *result) {
-    int cols = tsvReader->nextLine();
-    if (cols == 0)return 0;
+    if (fileType == FeatureBIN) {
+        const double *row = binReader->next();
+        if (row == nullptr)return 0;
+        int num = binReader->getVectorSize();
+        std::memcpy(result, row, sizeof(double) * num);
+        return num;
+    }
     if (fileType == FeatureTSV || fileType == FeatureCSV) { // If you read the vector information directly, read the double directly
+        int cols = tsvReader->nextLine();
         int num = getVectorSize();
-        if (cols < num)return 0;
-        for (int i = 0; i < num; ++i)result[i] = tsvReader->getDouble(i);
+        if (cols == 0 || cols < netStat->getFullVectorSize())return 0;
+        for (int i = 0; i < num; ++i)result[i] = tsvReader->getDouble(netStat->getFeatureIndex(i));
+        return num;
+    }
+    // Incremental statistics with netStat
+    PacketRecord pkt;
+    if (!nextPacket(pkt))return 0;
+    return netStat->updateAndGetStats(pkt, result);
+}
+
+
+// Read the next packet of a packet file, returns false at the end of the input
+bool FE::nextPacket(PacketRecord &pkt) {
+    return fileType == PCAP ? nextPcapPacket(pkt) : nextTsvPacket(pkt);
+}
+
+
+// The columns are parsed in place into a PacketRecord, no string is built
+bool FE::nextTsvPacket(PacketRecord &pkt) {
+    if (tsvReader->nextLine() == 0)return false;
+    StrView srcIP, dstIP, srcport, dstport;
+    if (tsvReader->hasValue(4)) {// Ipv4
+        srcIP = tsvReader->getView(4);
+        dstIP = tsvReader->getView(5);
+    } else { // Ipv6
+        srcIP = tsvReader->getView(17);
+        dstIP = tsvReader->getView(18);
+    }
+    if (tsvReader->hasValue(6)) {//tcp
+        srcport = tsvReader->getView(6);
+        dstport = tsvReader->getView(7);
+    } else if (tsvReader->hasValue(8)) { // udp
+        srcport = tsvReader->getView(8);
+        dstport = tsvReader->getView(9);
+    } else { // It is neither tcp nor udp, it may be a layer 1 or layer 2 packet such as arp or icmp
+        if (tsvReader->hasValue(10)) { // icmp
+            srcport = dstport = StrView{"icmp", 4};
+        } else if (tsvReader->hasValue(12)) { // arp
+            srcport = dstport = StrView{"arp", 3};
+            // Use the source ip and destination ip in the arp packet as ip information
+            srcIP = tsvReader->getView(14);
+            dstIP = tsvReader->getView(16);
+        } else { // For other protocols, use source and destination MAC assignments
+            srcport = dstport = StrView{"", 0};
+            srcIP = tsvReader->getView(2);
+            dstIP = tsvReader->getView(3);
+        }
+    }
+    timestamp = tsvReader->getDouble(0);
+    pkt = makePacketRecord(tsvReader->getView(2), tsvReader->getView(3), srcIP, srcport, dstIP,
+                           dstport, tsvReader->getDouble(1), timestamp);
+    return true;
+}
+
+
+// Get up to n instance vectors into the row-major block X, returns the number obtained
+int FE::nextBatch(double *X, int n, double *timestamps) {
+    int sz = getVectorSize();
+    int num = 0;
+    if (fileType == FeatureBIN) {
+        // The rows are contiguous in the mapping, so copy as many as possible at once
+        while (num < n) {
+            int got = 0;
+            const double *rows = binReader->nextBlock(n - num, got);
+            if (got == 0)break;
+            std::memcpy(X + (size_t) num * sz, rows, sizeof(double) * sz * got);
+            num += got;
+        }
+        if (timestamps != nullptr)
+            for (int i = 0; i < num; ++i)timestamps[i] = 0;
         return num;
-    } else { // Incremental statistics with netStat
-        std::string srcIP, dstIP;
-        if (tsvReader->hasValue(4)) {// Ipv4
-            srcIP = tsvReader->getString(4);
-            dstIP = tsvReader->getString(5);
-        } else { // Ipv6
-            srcIP = tsvReader->getString(17);
-            dstIP = tsvReader->getString(18);
+    }
+    if (fileType == FeatureTSV || fileType == FeatureCSV) {
+        for (; num < n; ++num) {
+            if (nextVector(X + (size_t) num * sz) == 0)break;
+            if (timestamps != nullptr)timestamps[num] = 0;
         }
-        std::string srcport, dstport;
-        if (tsvReader->hasValue(6)) {//tcp
-            srcport = tsvReader->getString(6);
-            dstport = tsvReader->getString(7);
-        } else if (tsvReader->hasValue(8)) { // udp
-            srcport = tsvReader->getString(8);
-            dstport = tsvReader->getString(9);
-        } else { // It is neither tcp nor udp, it may be a layer 1 or layer 2 packet such as arp or icmp
-            if (tsvReader->hasValue(10)) { // icmp
-                srcport = dstport = "icmp";
-            } else if (tsvReader->hasValue(12)) { // arp
-                srcport = dstport = "arp";
-                // Use the source ip and destination ip in the arp packet as ip information
-                srcIP = tsvReader->getString(14);
-                dstIP = tsvReader->getString(16);
-            } else { // For other protocols, use source and destination MAC assignments
-                srcIP = tsvReader->getString(2);
-                dstIP = tsvReader->getString(3);
-            }
+        return num;
+    }
+    // Decode the whole batch first, then netStat updates the streams with all of it
+    if (packets.size() < (size_t) n)packets.resize(n);
+    for (; num < n; ++num) {
+        if (!nextPacket(packets[num]))break;
+        if (timestamps != nullptr)timestamps[num] = timestamp;
+    }
+    netStat->updateAndGetBatch(packets.data(), num, X);
+    return num;
+}
+
+
+static inline uint64_t bigEndian64(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i)x = (x << 8) | p[i];
+    return x;
+}
+
+static inline uint64_t macValue(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 6; ++i)x = (x << 8) | p[i];
+    return x;
+}
+
+static inline void ipv4Value(const uint8_t *p, uint64_t ip[2]) {
+    ip[0] = 0;
+    ip[1] = (uint64_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Same selection of the stream keys as the tsv path above, the columns are replaced by the decoded fields
+bool FE::nextPcapPacket(PacketRecord &pkt) {
+    PcapPacket pcap;
+    if (!pcapReader->nextPacket(pcap)) return false;
+
+    pkt.srcMAC = pcap.hasEth ? macValue(pcap.ethSrc) : PacketRecord::NoMAC;
+    pkt.dstMAC = pcap.hasEth ? macValue(pcap.ethDst) : PacketRecord::NoMAC;
+    pkt.ipVersion = 0;
+    pkt.srcIP[0] = pkt.srcIP[1] = pkt.dstIP[0] = pkt.dstIP[1] = 0;
+    if (pcap.hasIPv4) {// Ipv4
+        pkt.ipVersion = 4;
+        ipv4Value(pcap.ipv4Src, pkt.srcIP);
+        ipv4Value(pcap.ipv4Dst, pkt.dstIP);
+    } else if (pcap.hasIPv6) { // Ipv6
+        pkt.ipVersion = 6;
+        pkt.srcIP[0] = bigEndian64(pcap.ipv6Src);
+        pkt.srcIP[1] = bigEndian64(pcap.ipv6Src + 8);
+        pkt.dstIP[0] = bigEndian64(pcap.ipv6Dst);
+        pkt.dstIP[1] = bigEndian64(pcap.ipv6Dst + 8);
+    }
+    pkt.srcPort = pkt.dstPort = 0;
+    if (pcap.hasTCP || pcap.hasUDP) {//tcp or udp
+        pkt.protocol = pcap.hasTCP ? ProtoTCP : ProtoUDP;
+        pkt.srcPort = pcap.srcPort;
+        pkt.dstPort = pcap.dstPort;
+    } else if (pcap.hasICMP) { // icmp
+        pkt.protocol = ProtoICMP;
+    } else if (pcap.hasARP) { // arp, use the source ip and destination ip in the arp packet as ip information
+        pkt.protocol = ProtoARP;
+        pkt.ipVersion = 0;
+        pkt.srcIP[0] = pkt.srcIP[1] = pkt.dstIP[0] = pkt.dstIP[1] = 0;
+        if (pcap.hasARPIPv4) {
+            pkt.ipVersion = 4;
+            ipv4Value(pcap.arpSrcIP, pkt.srcIP);
+            ipv4Value(pcap.arpDstIP, pkt.dstIP);
         }
-        return netStat->updateAndGetStats(tsvReader->getString(2), tsvReader->getString(3),
-                                          srcIP, srcport, dstIP, dstport, tsvReader->getDouble(1),
-                                          tsvReader->getDouble(0), result);
+    } else { // For other protocols, NetStat uses the source and destination MACs
+        pkt.protocol = ProtoOther;
+    }
+    pkt.datagramSize = pcap.frameLen;
+    pkt.timestamp = timestamp = pcap.timestamp;
+    return true;
+}
+
+
+// Write every remaining instance vector of fe into a FeatureBIN file, returns the number of vectors written
+long feature2bin(FE *fe, const char *filename) {
+    int sz = fe->getVectorSize();
+    FeatureBinWriter writer(filename, sz, fe->getLambdas());
+    auto *x = new double[sz];
+    long num = 0;
+    while (fe->nextVector(x)) {
+        writer.write(x, sz);
+        ++num;
     }
+    delete[] x;
+    return num;
 }
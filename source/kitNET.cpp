@@ -20,20 +20,19 @@ void KitNET::init() {
     }
 
     // Clustering to obtain feature maps to initialize autoencoders
-    ensembleLayer = new AE *[featureMap->size()];
-    for (int i = 0; i < featureMap->size(); ++i) {
-        ensembleLayer[i] = new AE(featureMap->at(i).size(),
-                                  std::ceil(featureMap->at(i).size() * kitNetParam->ensemble_vh_rate),
-                                  kitNetParam->ensemble_learning_rate);
+    std::vector<int> visibleSizes, hiddenSizes;
+    for (auto &i : *featureMap) {
+        visibleSizes.push_back(i.size());
+        hiddenSizes.push_back(std::ceil(i.size() * kitNetParam->ensemble_vh_rate));
     }
+    ensembleLayer = new AEEnsemble(visibleSizes, hiddenSizes, kitNetParam->ensemble_learning_rate);
+    if (threads > 1)ensembleLayer->setThreads(threads);
     outputLayer = new AE(featureMap->size(), std::ceil(featureMap->size() * kitNetParam->output_vh_rate),
                          kitNetParam->output_learning_rate);
 
-    // Initialize a buffer of autoencoder input parameters
-    ensembleInput = new double *[featureMap->size()];
-    for (int i = 0; i < featureMap->size(); ++i) {
-        ensembleInput[i] = new double[featureMap->at(i).size()];
-    }
+    // Initialize a buffer of autoencoder input parameters, and the plan of the copies into it
+    ensembleInput = new double[ensembleLayer->getInputSize()];
+    for (auto &i : *featureMap)featureOrder.insert(featureOrder.end(), i.begin(), i.end());
     outputInput = new double[featureMap->size()];
 
     for (auto &i : *featureMap) {
@@ -49,10 +48,8 @@ void KitNET::init() {
 
 KitNET::~KitNET() {
     delete kitNetParam; // If it is null, delete null has no effect, so delete it directly
-    for (int i = 0; i < featureMap->size(); ++i) {
-        delete ensembleLayer[i];
-        delete[] ensembleInput[i];
-    }
+    delete ensembleLayer;
+    delete[] ensembleInput;
     delete outputLayer;
     delete[] outputInput;
     delete featureMap;
@@ -67,16 +64,25 @@ double KitNET::train(const double *x) {
         if (kitNetParam->fm_train_num == 0)init();
         return 0;
     } else {// train the autoencoder
-        for (int i = 0; i < featureMap->size(); ++i) {
-            // Copy the corresponding eigenvectors to the buffer
-            for (int j = 0; j < featureMap->at(i).size(); ++j) {
-                ensembleInput[i][j] = x[featureMap->at(i).at(j)];
-            }
-            outputInput[i] = ensembleLayer[i]->train(ensembleInput[i]);
-        }
-        // Train the output layer, return the reconstruction error
-        return outputLayer->train(outputInput);
+        // Copy the corresponding eigenvectors to the buffer
+        const int *order = featureOrder.data();
+        for (size_t k = 0; k < featureOrder.size(); ++k)ensembleInput[k] = x[order[k]];
+        return trainEnsemble(ensembleInput);
+    }
+}
+
+double KitNET::trainOrdered(const double *x) {
+    if (featureMap == nullptr) {
+        fprintf(stderr, "KitNET: the feature map is not initialized!!\n");
+        throw -1;
     }
+    return trainEnsemble(x);
+}
+
+double KitNET::trainEnsemble(const double *input) {
+    ensembleLayer->train(input, outputInput);
+    // Train the output layer, return the reconstruction error
+    return outputLayer->train(outputInput);
 }
 
 double KitNET::execute(const double *x) {
@@ -84,13 +90,99 @@ double KitNET::execute(const double *x) {
         fprintf(stderr, "KitNET: the feature map is not initialized!!\n");
         throw -1;
     }
-    for (int i = 0; i < featureMap->size(); ++i) {
-        // Copy the corresponding eigenvectors to the buffer
-        for (int j = 0; j < featureMap->at(i).size(); ++j) {
-            ensembleInput[i][j] = x[featureMap->at(i).at(j)];
-        }
-        // Run this small autoencoder, saving the reconstruction error as input to the output layer
-        outputInput[i] = ensembleLayer[i]->reconstruct(ensembleInput[i]);
+    // Copy the corresponding eigenvectors to the buffer
+    const int *order = featureOrder.data();
+    for (size_t k = 0; k < featureOrder.size(); ++k)ensembleInput[k] = x[order[k]];
+    return executeEnsemble(ensembleInput);
+}
+
+double KitNET::executeOrdered(const double *x) {
+    if (featureMap == nullptr) {
+        fprintf(stderr, "KitNET: the feature map is not initialized!!\n");
+        throw -1;
     }
+    return executeEnsemble(x);
+}
+
+double KitNET::executeEnsemble(const double *input) {
+    // Run the small autoencoders, saving the reconstruction errors as input to the output layer
+    ensembleLayer->reconstruct(input, outputInput);
     return outputLayer->reconstruct(outputInput);
 }
+
+void KitNET::setThreads(int t) {
+    threads = t;
+    if (ensembleLayer != nullptr)ensembleLayer->setThreads(t);
+}
+
+void KitNET::setInputSize(int n) {
+    if (n < 1) {
+        fprintf(stderr, "KitNET: the size of the instance vectors must be positive!!\n");
+        throw -1;
+    }
+    if (featureMap != nullptr) {
+        for (auto &i : *featureMap)
+            for (int j : i)
+                if (j >= n) {
+                    fprintf(stderr, "KitNET: the feature map uses feature %d of vectors of size %d!!\n", j, n);
+                    throw -1;
+                }
+    }
+    inputSize = n;
+}
+
+void KitNET::checkInputSize() const {
+    if (inputSize == 0) {
+        fprintf(stderr, "KitNET: the size of the instance vectors is not set, see setInputSize!!\n");
+        throw -1;
+    }
+}
+
+// Gathers up to BatchRows rows of X into batchInput, returns the number of rows
+int KitNET::gatherBatch(const double *X, int n) {
+    int rows = std::min(n, BatchRows);
+    size_t size = featureOrder.size();
+    batchInput.resize(BatchRows * size);
+    batchErrors.resize(BatchRows * featureMap->size());
+    const int *order = featureOrder.data();
+    for (int r = 0; r < rows; ++r) {
+        const double *x = X + (size_t) r * inputSize;
+        double *input = &batchInput[r * size];
+        for (size_t k = 0; k < size; ++k)input[k] = x[order[k]];
+    }
+    return rows;
+}
+
+// The autoencoders of the integration layer only depend on their own inputs, so each can take all the rows before
+// the output layer trains on their errors row by row
+void KitNET::trainBatch(const double *X, int n, double *rmse, bool miniBatch) {
+    checkInputSize();
+    int i = 0;
+    // Until the feature map is trained, the instances go one at a time to the cluster
+    for (; i < n && featureMap == nullptr; ++i)rmse[i] = train(X + (size_t) i * inputSize);
+    while (i < n) {
+        int rows = gatherBatch(X + (size_t) i * inputSize, n - i);
+        if (miniBatch) {
+            ensembleLayer->trainMiniBatch(batchInput.data(), rows, batchErrors.data());
+            outputLayer->trainMiniBatch(batchErrors.data(), rows, rmse + i);
+        } else {
+            ensembleLayer->trainBatch(batchInput.data(), rows, batchErrors.data());
+            for (int r = 0; r < rows; ++r)rmse[i + r] = outputLayer->train(&batchErrors[r * featureMap->size()]);
+        }
+        i += rows;
+    }
+}
+
+void KitNET::executeBatch(const double *X, int n, double *rmse) {
+    if (featureMap == nullptr) {
+        fprintf(stderr, "KitNET: the feature map is not initialized!!\n");
+        throw -1;
+    }
+    checkInputSize();
+    for (int i = 0; i < n;) {
+        int rows = gatherBatch(X + (size_t) i * inputSize, n - i);
+        ensembleLayer->reconstructBatch(batchInput.data(), rows, batchErrors.data());
+        outputLayer->reconstructBatch(batchErrors.data(), rows, rmse + i);
+        i += rows;
+    }
+}
@@ -6,110 +6,96 @@
 
 #include "../include/netStat.h"
 
+#include <algorithm>
+#include <type_traits>
 
-// insert new element
-void QueueFixed::insert(double x) {
-    array[now_index++] = x;
-    if (now_index >= QueueCapacity)now_index = 0;
-    ++now_size;
-}
-
-// Expand the queue and return the number of array elements
-int QueueFixed::unroll(double *ans) {
-    if (now_size >= QueueCapacity) {// If it is full, now_index is the first one pointed to
-        for (int i = 0, j = now_index; i < QueueCapacity; ++i) {
-            ans[i] = array[j];
-            ++j;
-            if (j >= QueueCapacity)
-                j = 0;
-        }
-        return QueueCapacity;
-    } else {
-        for (int i = 0; i < now_index; ++i)
-            ans[i] = array[i];
-        return now_size;
-    }
-}
+#ifndef WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
-// Returns the last element entered into the queue
-double QueueFixed::getLast() {
-    if (now_index == 0)return array[QueueCapacity - 1];
-    return array[now_index - 1];
-}
 
 // Predict the next value using Lagrangian interpolation
-double Extrapolator::predict(double t) {
-    // expand the argument into an array
-    int sz = tQ.unroll(tArr);
+template<int Capacity>
+double Extrapolator<Capacity>::predict(double t) const {
+    int sz = tQ.size();
     if (sz < 2) { // less than 2, unpredictable
         if (sz == 0)return 0;
         else return vQ.getLast();
     }
 
     double diff_sum = 0;
-    for (int i = 1; i < sz; ++i)diff_sum += tArr[i] - tArr[i - 1];
+    for (int i = 1; i < sz; ++i)diff_sum += tQ.get(i) - tQ.get(i - 1);
     // If the time difference between the current time and the previous one is greater than ten times the average time difference,
     // it cannot be predicted, and the last result in the queue will be returned directly.
     if (diff_sum / (sz - 1) * 10 < (t - tQ.getLast()))
         return vQ.getLast();
 
-    // expand the function value
-    vQ.unroll(vArr);
+    // The times relative to the last point: the points are at d0 (, d1) and 0, the prediction at x.
+    // Called right after inserting a point at t, x is 0 and the result is exactly the last value
+    double x = t - tQ.getLast();
+    if (sz == 2) {
+        double d0 = tQ.get(0) - tQ.get(1);
+        if (d0 == 0)return lagrange(t, sz);
+        return vQ.get(1) + (vQ.get(0) - vQ.get(1)) * (x / d0);
+    }
+    if (sz == 3) {
+        double d0 = tQ.get(0) - tQ.get(2), d1 = tQ.get(1) - tQ.get(2), d01 = d0 - d1;
+        // The basis polynomials sum up to 1, so L(x) = v2 + (v0 - v2) l0 + (v1 - v2) l1 with
+        // l0 = x (x - d1) / (d0 d01) and l1 = -x (x - d0) / (d1 d01), over the common denominator d0 d1 d01
+        double denominator = d0 * d1 * d01;
+        if (denominator == 0)return lagrange(t, sz);
+        double v2 = vQ.get(2);
+        return v2 + x * ((vQ.get(0) - v2) * (x - d1) * d1 - (vQ.get(1) - v2) * (x - d0) * d0) / denominator;
+    }
+    return lagrange(t, sz);
+}
 
-    // Do Lagrangian interpolation
-    // Lagrange interpolation formula, L(tp) = sum_{i=1}^{n+1} { y_i * l_i(tp) }
-    // where l_i(tp) = \frac{ \prod_{j=1 and j!=i }(tp-x_j) } { \prod_{j=1 and j!=i}(x_i-x_j) }
+// Lagrange interpolation formula, L(tp) = sum_{i=1}^{n+1} { y_i * l_i(tp) }
+// where l_i(tp) = \frac{ \prod_{j=1 and j!=i }(tp-x_j) } { \prod_{j=1 and j!=i}(x_i-x_j) }
+template<int Capacity>
+double Extrapolator<Capacity>::lagrange(double t, int sz) const {
     double ans = 0;
     for (int i = 0; i < sz; ++i) {
-        double y = vArr[i];
+        double y = vQ.get(i);
         for (int j = 0; j < sz; ++j) {
             if (i == j)continue;
-            y *= (t - tArr[j]) / (tArr[i] - tArr[j] + 1e-20);
+            y *= (t - tQ.get(j)) / (tQ.get(i) - tQ.get(j) + 1e-20);
         }
         ans += y;
     }
     return ans;
 }
 
+template class Extrapolator<ExtrapolatorPoints>;
+
 // constructor of incStat
-IncStat::IncStat(const std::string &id, std::vector<double> *_lambdas, double init_time, bool isTypediff) {
-    ID = id;
+template<int N, class Real>
+IncStat<N, Real>::IncStat(std::vector<double> *_lambdas, double init_time, bool isTypediff) {
     lambdas = _lambdas;
     isTypeDiff = isTypediff;
     lastTimestamp = init_time;
-    mean_valid = var_valid = std_valid = false;
-    auto size = lambdas->size();
-    // Allocate memory
-    CF1 = new double[size];
-    CF2 = new double[size];
-    w = new double[size];
-    cur_std = new double[size];
-    cur_mean = new double[size];
-    cur_var = new double[size];
+    // Allocate memory (only with DynamicWindows, the arrays are members otherwise)
+    Windows *arrays[] = {&CF1, &CF2, &w, &residual, &residualValue};
+    WindowArray<N, Real>::allocate(arrays, 5, windows());
+    derived.allocate(windows());
     // initialization
-    for (int i = 0; i < size; ++i) CF1[i] = 0;
-    for (int i = 0; i < size; ++i) CF2[i] = 0;
-    for (int i = 0; i < size; ++i) w[i] = 1e-20;//prevent division by 0
+    for (int i = 0; i < windows(); ++i) CF1[i] = 0;
+    for (int i = 0; i < windows(); ++i) CF2[i] = 0;
+    for (int i = 0; i < windows(); ++i) w[i] = 1e-20;//prevent division by 0
+    for (int i = 0; i < windows(); ++i) residual[i] = residualValue[i] = 0;
 }
 
 // incStat's destructor
-IncStat::~IncStat() {
-    // Release the memory of the relationship class between the two streams maintained
-    for (auto v : covs) {
-        // 这个实例会有多个类的指针指向, 所以维护一个refNum, 当减为0的时候,就delete掉
-        if ((--v->refNum) == 0)
-            delete v;
-    }
-    delete[] CF1;
-    delete[] CF2;
-    delete[] w;
-    delete[] cur_std;
-    delete[] cur_mean;
-    delete[] cur_var;
-}
-
-// stream inserts new stats.
-void IncStat::insert(double v, double t) {
+template<int N, class Real>
+IncStat<N, Real>::~IncStat() {
+    WindowArray<N, Real>::release(CF1);
+    derived.release();
+}
+
+// stream inserts new stats, in the windows the IncStatDB keeps up to date
+template<int N, class Real>
+void IncStat<N, Real>::insert(double v, double t, DecayFactors<N> &decay, bool trackResiduals) {
     // If isTypeDiff is set, use the time difference as statistics
     if (isTypeDiff) {
         double dif = t - lastTimestamp;
@@ -117,97 +103,166 @@ void IncStat::insert(double v, double t) {
     }
 
     // Decay first
-    processDecay(t);
+    processDecay(t, decay);
 
     // update with v
-    for (size_t i = 0; i < lambdas->size(); ++i) CF1[i] += v;
-    for (size_t i = 0; i < lambdas->size(); ++i) CF2[i] += v * v;
-    for (size_t i = 0; i < lambdas->size(); ++i) ++w[i];
+    int begin = decay.begin(), end = decay.end();
+    for (int i = begin; i < end; ++i) CF1[i] += v;
+    for (int i = begin; i < end; ++i) CF2[i] += v * v;
+    for (int i = begin; i < end; ++i) ++w[i];
 
     // The mean, variance, and standard deviation will not be calculated yet. 
     // calculate later
-    mean_valid = var_valid = std_valid = false;
+    derived.invalidate();
+
+    // What the covariance of each lazy edge would have taken in from this value
+    if (trackResiduals) {
+        calMean(begin, end);
+        for (int i = begin; i < end; ++i) {
+            double r = v - mean(i);
+            residual[i] += r;
+            residualValue[i] += r * v;
+        }
+        ++inserts;
+    }
 
 }
 
 // Execute decay, the parameter is the current timestamp
-void IncStat::processDecay(double timestamp) {
+template<int N, class Real>
+void IncStat<N, Real>::processDecay(double timestamp, DecayFactors<N> &decay) {
     double diff = timestamp - lastTimestamp;
     if (diff > 0) {
-        for (size_t i = 0; i < lambdas->size(); ++i) {
-            // Calculate the decay factor
-            double factor = std::pow(2.0, -lambdas->at(i) * diff);
-            CF1[i] *= factor;
-            CF2[i] *= factor;
-            w[i] *= factor;
+        // The decay factors, shared with the other streams that decay by the same diff
+        const double *factor = decay.get(diff);
+        int begin = decay.begin(), end = decay.end();
+        for (int i = begin; i < end; ++i) {
+            CF1[i] *= factor[i];
+            CF2[i] *= factor[i];
+            w[i] *= factor[i];
+        }
+        // The residual sums stay 0 until a value is tracked, as in the streams of eager edges
+        if (inserts != 0) {
+            for (int i = begin; i < end; ++i) {
+                residual[i] *= factor[i];
+                residualValue[i] *= factor[i];
+            }
         }
         lastTimestamp = timestamp;
     }
 }
 
-void IncStat::calMean() {
-    if (!mean_valid) { // recalculate when needed
-        mean_valid = true;
-        for (size_t i = 0; i < lambdas->size(); ++i)
-            cur_mean[i] = CF1[i] / w[i];
+template<int N, class Real>
+void IncStat<N, Real>::copyState(const IncStat &other) {
+    for (int i = 0; i < windows(); ++i) {
+        CF1[i] = other.CF1[i];
+        CF2[i] = other.CF2[i];
+        w[i] = other.w[i];
     }
+    derived.copy(other.derived, windows());
+    for (int i = 0; i < windows(); ++i) {
+        residual[i] = other.residual[i];
+        residualValue[i] = other.residualValue[i];
+    }
+    inserts = other.inserts;
+    lastTimestamp = other.lastTimestamp;
 }
 
-void IncStat::calVar() {
-    if (!var_valid) {
-        var_valid = true;
-        calMean(); // The calculation requires the mean value, first update the mean value
-        for (size_t i = 0; i < lambdas->size(); ++i)
-            cur_var[i] = fabs(CF2[i] / w[i] - cur_mean[i] * cur_mean[i]);
-    }
+template<int N, class Real>
+void IncStat<N, Real>::saveArrays(SnapshotWriter &out) const {
+    if (N != DynamicWindows)return;
+    const Windows *arrays[] = {&CF1, &CF2, &w, &residual, &residualValue};
+    for (const Windows *array: arrays)out.write(&(*array)[0], sizeof(Real) * windows());
+    out.align();
 }
 
-void IncStat::calStd() {
-    if (!std_valid) {
-        std_valid = true;
-        calVar(); // Calculation requires variance, calculate it first
-        for (size_t i = 0; i < lambdas->size(); ++i)
-            cur_std[i] = std::sqrt(cur_var[i]);
-    }
+// The copied vector of edges and the arrays point into the memory of the process that saved the stream, they are
+// overwritten without being released. The valid flags are not trusted, the derived statistics are computed again
+template<int N, class Real>
+void IncStat<N, Real>::restoreImage(SnapshotReader &in, std::vector<double> *l) {
+    ::new(&covs) std::vector<IncStatCov<N, Real> *>();
+    lambdas = l;
+    lruPrev = lruNext = nullptr;
+    derived.allocate(windows());
+    derived.invalidate();
+    if (N != DynamicWindows)return;
+    Windows *arrays[] = {&CF1, &CF2, &w, &residual, &residualValue};
+    WindowArray<N, Real>::allocate(arrays, 5, windows());
+    for (Windows *array: arrays)std::memcpy(&(*array)[0], in.take(sizeof(Real) * windows()), sizeof(Real) * windows());
+    in.align();
 }
 
-// Get all one-dimensional statistical information, (weight, mean, variance)
-int IncStat::getAll1DStats(double *result) {
-    calMean();
-    calVar();
+// Get the selected one-dimensional statistical information, (weight, mean, variance)
+template<int N, class Real>
+int IncStat<N, Real>::get1DStats(const StatSelection &selection, double *result) {
+    if (selection.has(FeatureMask::Var))calVar(selection.begin, selection.end);
+    else if (selection.has(FeatureMask::Mean))calMean(selection.begin, selection.end);
     int offset = 0;
-    for (size_t i = 0; i < lambdas->size(); ++i)result[offset++] = (w[i]);
-    for (size_t i = 0; i < lambdas->size(); ++i)result[offset++] = (cur_mean[i]);
-    for (size_t i = 0; i < lambdas->size(); ++i)result[offset++] = (cur_var[i]);
+    for (int i: selection.windows[FeatureMask::Weight])result[offset++] = (w[i]);
+    for (int i: selection.windows[FeatureMask::Mean])result[offset++] = mean(i);
+    for (int i: selection.windows[FeatureMask::Var])result[offset++] = var(i);
     return offset;
 }
 
 
+// Same sums as IncStatCov::getRadius and getMagnitude, so the values are the same as with an edge
+template<int N, class Real>
+int IncStat<N, Real>::getPairStats(IncStat &other, const StatSelection &selection, double *result) {
+    int offset = 0;
+    if (selection.has(FeatureMask::Radius)) {
+        calVar(selection.begin, selection.end);
+        other.calVar(selection.begin, selection.end);
+        for (int i: selection.windows[FeatureMask::Radius])result[offset++] = std::sqrt(var(i) + other.var(i));
+    }
+    if (selection.has(FeatureMask::Magnitude)) {
+        calMean(selection.begin, selection.end);
+        other.calMean(selection.begin, selection.end);
+        for (int i: selection.windows[FeatureMask::Magnitude]) {
+            double mean1 = mean(i), mean2 = other.mean(i);
+            result[offset++] = std::sqrt(mean1 * mean1 + mean2 * mean2);
+        }
+    }
+    return offset;
+}
+
+template<int N, class Real>
+void IncStat<N, Real>::clearWindows(int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        CF1[i] = CF2[i] = 0;
+        w[i] = 1e-20;
+        residual[i] = residualValue[i] = 0;
+    }
+    derived.invalidate();
+}
+
+
 // Update statistics such as covariance of the two streams.
 // It can only be called after one of the two streams has been updated, and then 
 // That is, after one of the stream insert methods is updated, this method is called immediately to update the relevant statistical data
 /**
  * @brief Update statistics. the parameters are the ID of the updated stream, v and t used for updating the updated stream
  * 
- * @param ID ID of the updated stream
+ * @param updated the updated stream
  * @param v 
  * @param t 
  */
-void IncStatCov::updateCov(const std::string &ID, double v, double t) {
+template<int N, class Real>
+void IncStatCov<N, Real>::updateCov(const IncStat<N, Real> *updated, double v, double t, DecayFactors<N> &decay) {
     // Decay first
-    processDecay(t);
+    processDecay(t, decay);
 
     // update the mean of the two streams
-    incS1->calMean();
-    incS2->calMean();
+    int begin = decay.begin(), end = decay.end();
+    incS1->calMean(begin, end);
+    incS2->calMean(begin, end);
 
-    if (ID == incS1->ID) { // If it's the first update to stream
+    if (updated == incS1) { // If it's the first update to stream
         // Update the information maintained by the first flow extrapolation method
         ex1.insert(t, v);
         // Get the updated value of the second stream prediction
         double v_other = ex1.predict(t);
-        for (size_t i = 0; i < lambdas->size(); ++i) {
-            CF3[i] += (v - incS1->cur_mean[i]) * (v_other - incS2->cur_mean[i]);
+        for (int i = begin; i < end; ++i) {
+            CF3[i] += (v - incS1->mean(i)) * (v_other - incS2->mean(i));
         }
     } else {// The updated value from the second stream
         // Update the information maintained by the second flow extrapolation method
@@ -215,182 +270,1583 @@ void IncStatCov::updateCov(const std::string &ID, double v, double t) {
         // Get the predicted value of the first stream
         double v_other = ex2.predict(t);
         // Update the numerator part of the covariance (CF3)
-        for (size_t i = 0; i < lambdas->size(); ++i) {
-            CF3[i] += (v_other - incS1->cur_mean[i]) * (v - incS2->cur_mean[i]);
+        for (int i = begin; i < end; ++i) {
+            CF3[i] += (v_other - incS1->mean(i)) * (v - incS2->mean(i));
         }
     }
     // Update weights
-    for (size_t i = 0; i < lambdas->size(); ++i) ++w3[i];
+    for (int i = begin; i < end; ++i) ++w3[i];
 }
 
 // Execute the decay function
-void IncStatCov::processDecay(double t) {
+template<int N, class Real>
+void IncStatCov<N, Real>::processDecay(double t, DecayFactors<N> &decay) {
     double diff = t - lastTimestamp;
     if (diff > 0) {
-        for (size_t i = 0; i < lambdas->size(); ++i) {
-            double factor = std::pow(2.0, -lambdas->at(i) * diff);
-            CF3[i] *= factor;
-            w3[i] *= factor;
+        const double *factor = decay.get(diff);
+        for (int i = decay.begin(); i < decay.end(); ++i) {
+            CF3[i] *= factor[i];
+            w3[i] *= factor[i];
         }
         lastTimestamp = t;
     }
 }
 
+template<int N, class Real>
+void IncStatCov<N, Real>::makeLazy() {
+    if (snapshots != nullptr)return;
+    snapshots = new Snapshot[2];
+    Windows *arrays[] = {&snapshots[0].residual, &snapshots[0].residualValue, &snapshots[0].w,
+                         &snapshots[1].residual, &snapshots[1].residualValue, &snapshots[1].w};
+    WindowArray<N, Real>::allocate(arrays, 6, windows());
+    takeSnapshot(0);
+    takeSnapshot(1);
+}
+
+template<int N, class Real>
+void IncStatCov<N, Real>::dropLazy() {
+    if (snapshots == nullptr)return;
+    WindowArray<N, Real>::release(snapshots[0].residual);
+    delete[] snapshots;
+    snapshots = nullptr;
+}
+
+template<int N, class Real>
+void IncStatCov<N, Real>::takeSnapshot(int side) {
+    const IncStat<N, Real> *s = side == 0 ? incS1 : incS2;
+    Snapshot &snapshot = snapshots[side];
+    for (int i = 0; i < windows(); ++i) {
+        snapshot.residual[i] = s->residual[i];
+        snapshot.residualValue[i] = s->residualValue[i];
+        snapshot.w[i] = s->w[i];
+    }
+    snapshot.time = s->lastTimestamp;
+    snapshot.inserts = s->inserts;
+}
+
+// The extrapolators are plain arrays and numbers, the image of the pool holds them as they are
+static_assert(std::is_trivially_copyable<Extrapolator<ExtrapolatorPoints> >::value,
+              "Extrapolator is saved byte for byte");
+
+template<int N, class Real>
+void IncStatCov<N, Real>::saveArrays(SnapshotWriter &out) const {
+    out.put<uint64_t>(isLazy());
+    if (N == DynamicWindows) {
+        out.write(&CF3[0], sizeof(Real) * windows());
+        out.write(&w3[0], sizeof(Real) * windows());
+        out.align();
+    }
+    if (!isLazy())return;
+    for (int side = 0; side < 2; ++side) {
+        const Snapshot &snapshot = snapshots[side];
+        out.write(&snapshot.residual[0], sizeof(Real) * windows());
+        out.write(&snapshot.residualValue[0], sizeof(Real) * windows());
+        out.write(&snapshot.w[0], sizeof(Real) * windows());
+        out.align();
+        out.put(snapshot.time);
+        out.put<uint64_t>(snapshot.inserts);
+    }
+}
+
+// Both streams must be set up already, makeLazy looks at them before the saved snapshots replace what it took
+template<int N, class Real>
+void IncStatCov<N, Real>::restoreImage(SnapshotReader &in, std::vector<double> *l, IncStat<N, Real> *s1,
+                                       IncStat<N, Real> *s2) {
+    lambdas = l;
+    incS1 = s1;
+    incS2 = s2;
+    snapshots = nullptr;
+    bool lazy = in.get<uint64_t>() != 0;
+    if (N == DynamicWindows) {
+        Windows *arrays[] = {&CF3, &w3};
+        WindowArray<N, Real>::allocate(arrays, 2, windows());
+        for (Windows *array: arrays)
+            std::memcpy(&(*array)[0], in.take(sizeof(Real) * windows()), sizeof(Real) * windows());
+        in.align();
+    }
+    if (!lazy)return;
+    makeLazy();
+    for (int side = 0; side < 2; ++side) {
+        Snapshot &snapshot = snapshots[side];
+        std::memcpy(&snapshot.residual[0], in.take(sizeof(Real) * windows()), sizeof(Real) * windows());
+        std::memcpy(&snapshot.residualValue[0], in.take(sizeof(Real) * windows()), sizeof(Real) * windows());
+        std::memcpy(&snapshot.w[0], in.take(sizeof(Real) * windows()), sizeof(Real) * windows());
+        in.align();
+        snapshot.time = in.get<double>();
+        snapshot.inserts = in.get<uint64_t>();
+    }
+}
+
+// Every value v the stream inserted since the snapshot would have added (v - mean) * (v - other mean) to CF3
+// and 1 to w3, that is residualValue - other mean * residual, with the mean of the other stream as it is now
+template<int N, class Real>
+void IncStatCov<N, Real>::settleSide(int side, DecayFactors<N> &decay) {
+    IncStat<N, Real> *s = side == 0 ? incS1 : incS2, *other = side == 0 ? incS2 : incS1;
+    Snapshot &snapshot = snapshots[side];
+    if (s->inserts == snapshot.inserts)return; // nothing new, skip the subtraction and its rounding
+    // The sums inserted since the snapshot, at the time of the last insert of the stream
+    double diff = s->lastTimestamp - snapshot.time;
+    const double *factor = diff > 0 ? decay.get(diff) : nullptr;
+    int begin = decay.begin(), end = decay.end();
+    for (int i = begin; i < end; ++i) {
+        double f = factor != nullptr ? factor[i] : 1;
+        snapshot.residual[i] = s->residual[i] - snapshot.residual[i] * f;
+        snapshot.residualValue[i] = s->residualValue[i] - snapshot.residualValue[i] * f;
+        snapshot.w[i] = s->w[i] - snapshot.w[i] * f;
+    }
+    // Decayed to the time of the edge
+    other->calMean(begin, end);
+    diff = lastTimestamp - s->lastTimestamp;
+    factor = diff > 0 ? decay.get(diff) : nullptr;
+    for (int i = begin; i < end; ++i) {
+        double f = factor != nullptr ? factor[i] : 1;
+        CF3[i] += f * (snapshot.residualValue[i] - other->mean(i) * snapshot.residual[i]);
+        w3[i] += f * snapshot.w[i];
+    }
+    takeSnapshot(side);
+}
+
+template<int N, class Real>
+void IncStatCov<N, Real>::settle(double t, DecayFactors<N> &decay) {
+    processDecay(t, decay);
+    settleSide(0, decay);
+    if (incS2 != incS1)settleSide(1, decay);
+}
+
+template<int N, class Real>
+void IncStatCov<N, Real>::addFirst(double v, double t, DecayFactors<N> &decay) {
+    processDecay(t, decay);
+    int begin = decay.begin(), end = decay.end();
+    incS1->calMean(begin, end);
+    incS2->calMean(begin, end);
+    for (int i = begin; i < end; ++i)
+        CF3[i] += (v - incS1->mean(i)) * (v - incS2->mean(i));
+    for (int i = begin; i < end; ++i) ++w3[i];
+    // The value is already in the sums of the updated stream, the snapshots start after it
+    takeSnapshot(0);
+    takeSnapshot(1);
+}
+
 // Computes the radius (square root of sum of variance) of two streams
-int IncStatCov::getRadius(double *result) {
-    incS1->calVar();
-    incS2->calVar();
-    for (size_t i = 0; i < lambdas->size(); ++i) {
-        result[i] = (std::sqrt(incS1->cur_var[i] + incS2->cur_var[i]));
+template<int N, class Real>
+int IncStatCov<N, Real>::getRadius(const StatSelection &selection, double *result) {
+    const std::vector<int> &selected = selection.windows[FeatureMask::Radius];
+    if (selected.empty())return 0;
+    incS1->calVar(selection.begin, selection.end);
+    incS2->calVar(selection.begin, selection.end);
+    for (size_t k = 0; k < selected.size(); ++k) {
+        int i = selected[k];
+        result[k] = (std::sqrt(incS1->var(i) + incS2->var(i)));
     }
-    return lambdas->size();
+    return selected.size();
 }
 
 // Computes the square root of the sum of squares of the means of two streams
-int IncStatCov::getMagnitude(double *result) {
-    incS1->calMean();
-    incS2->calMean();
-    for (size_t i = 0; i < lambdas->size(); ++i) {
-        double mean1 = incS1->cur_mean[i];
-        double mean2 = incS2->cur_mean[i];
-        result[i] = (std::sqrt(mean1 * mean1 + mean2 * mean2));
+template<int N, class Real>
+int IncStatCov<N, Real>::getMagnitude(const StatSelection &selection, double *result) {
+    const std::vector<int> &selected = selection.windows[FeatureMask::Magnitude];
+    if (selected.empty())return 0;
+    incS1->calMean(selection.begin, selection.end);
+    incS2->calMean(selection.begin, selection.end);
+    for (size_t k = 0; k < selected.size(); ++k) {
+        double mean1 = incS1->mean(selected[k]);
+        double mean2 = incS2->mean(selected[k]);
+        result[k] = (std::sqrt(mean1 * mean1 + mean2 * mean2));
     }
-    return lambdas->size();
+    return selected.size();
 }
 
 // Calculate the covariance of two streams
-int IncStatCov::getCov(double *result) {
-    for (size_t i = 0; i < lambdas->size(); ++i)
-        result[i] = (CF3[i] / w3[i]);
-    return lambdas->size();
+template<int N, class Real>
+int IncStatCov<N, Real>::getCov(const StatSelection &selection, double *result) {
+    const std::vector<int> &selected = selection.windows[FeatureMask::Cov];
+    for (size_t k = 0; k < selected.size(); ++k)
+        result[k] = (CF3[selected[k]] / w3[selected[k]]);
+    return selected.size();
 }
 
 // Calculates the correlation coefficient of two streams
-int IncStatCov::getPcc(double *result) {
-    incS1->calStd();
-    incS2->calStd();
-    for (size_t i = 0; i < lambdas->size(); ++i) {
-        double ss = incS1->cur_std[i] * incS2->cur_std[i];
-        if (ss < 1e-20) result[i] = 0;
-        else result[i] = (CF3[i] / (w3[i] * ss));
+template<int N, class Real>
+int IncStatCov<N, Real>::getPcc(const StatSelection &selection, double *result) {
+    const std::vector<int> &selected = selection.windows[FeatureMask::Pcc];
+    if (selected.empty())return 0;
+    incS1->calStd(selection.begin, selection.end);
+    incS2->calStd(selection.begin, selection.end);
+    for (size_t k = 0; k < selected.size(); ++k) {
+        int i = selected[k];
+        double ss = incS1->stdev(i) * incS2->stdev(i);
+        // 0 for a stream that does not vary; with the compact state that includes a variance under the noise floor
+        // (see DerivedStats), which float cannot tell from rounding
+        if (ss < 1e-20) result[k] = 0;
+        else result[k] = (CF3[i] / (w3[i] * ss));
     }
-    return lambdas->size();
+    return selected.size();
 }
 
-//Get all two-dimensional statistical information [ radius,magnitude,cov,pcc ], return the number added to the array
-int IncStatCov::getAll2DStats(double *result) {
-    int offset = getRadius(result);
-    offset += getMagnitude(result + offset);
-    offset += getCov(result + offset);
-    return offset + getPcc(result + offset);
+//Get the selected two-dimensional statistical information [ radius,magnitude,cov,pcc ], return the number added to the array
+template<int N, class Real>
+int IncStatCov<N, Real>::get2DStats(const StatSelection &selection, double *result) {
+    int offset = getRadius(selection, result);
+    offset += getMagnitude(selection, result + offset);
+    offset += getCov(selection, result + offset);
+    return offset + getPcc(selection, result + offset);
+}
+
+// The snapshots of a lazy edge take the cleared state of the two streams
+template<int N, class Real>
+void IncStatCov<N, Real>::clearWindows(int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        CF3[i] = 0;
+        w3[i] = 1e-20;
+    }
+    if (!isLazy())return;
+    for (int side = 0; side < 2; ++side) {
+        for (int i = begin; i < end; ++i) {
+            snapshots[side].residual[i] = snapshots[side].residualValue[i] = 0;
+            snapshots[side].w[i] = 1e-20;
+        }
+    }
 }
 
 
 // Update the one-dimensional and two-dimensional information of the specified stream, and return the one-dimensional [weight, mean, std] and two-dimensional [radius, magnitude, cov, pcc]
 // The parameters are: stream ID, timestamp, statistical data, reference to the returned result.  if the last one is set to true, the timestamp will be used as statistical data
 
-int IncStatDB::updateGet1DStats(const std::string &ID, double t, double v, double *result, bool isTypeDiff) {
-    auto it = stats.find(ID);
-    if (it == stats.end()) { // If not found, generate a new stream
-        auto *incStat = new IncStat(ID, lambdas, t, isTypeDiff);
-        auto ret = stats.insert(std::make_pair(ID, incStat));
-        it = ret.first;
+// Find the stream of the key, create it if it does not exist
+template<int N, class Real>
+IncStat<N, Real> *IncStatDB<N, Real>::getStream(const StreamKey &ID, double t, bool isTypeDiff) {
+    uint64_t h = ID.hash();
+    IncStat<N, Real> *incStat = stats.find(ID, h);
+    if (incStat == nullptr) { // If not found, generate a new stream
+        incStat = ::new(streamPool.allocate()) IncStat<N, Real>(lambdas, t, isTypeDiff);
+        incStat->key = ID;
+        stats.insert(ID, h, incStat);
+        if (policy.maxStreams > 0) {
+            touch(incStat);
+            // The least recently used streams make room for the new one
+            while (stats.size() > policy.maxStreams)evict(lruTail);
+        }
+    } else if (policy.maxStreams > 0) touch(incStat);
+    return incStat;
+}
+
+template<int N, class Real>
+int IncStatDB<N, Real>::update1D(IncStat<N, Real> *incStat, double t, double v, double *result) {
+    // The statistics of the stream
+    // A stream without edges has nothing to keep the residuals for, its first edge takes the value in by addFirst
+    incStat->insert(v, t, decay, lazyEdges && (mirrored || !incStat->covs.empty()));
+    return incStat->get1DStats(selection, result);
+}
+
+template<int N, class Real>
+int IncStatDB<N, Real>::updateGet1DStats(const StreamKey &ID, double t, double v, double *result, bool isTypeDiff) {
+    sweep(t);
+    return update1D(getStream(ID, t, isTypeDiff), t, v, result);
+}
+
+
+// The weight of the i-th time window as it would be after decaying to time t
+template<int N, class Real>
+double IncStat<N, Real>::decayedWeight(int i, double t) const {
+    double diff = t - lastTimestamp;
+    return diff > 0 ? w[i] * std::exp2(-(*lambdas)[i] * diff) : w[i];
+}
+
+template<int N, class Real>
+double IncStatCov<N, Real>::decayedWeight(int i, double t) const {
+    double diff = t - lastTimestamp;
+    return diff > 0 ? w3[i] * std::exp2(-(*lambdas)[i] * diff) : w3[i];
+}
+
+
+template<int N, class Real>
+void IncStatDB<N, Real>::setEvictionPolicy(const EvictionPolicy &p) {
+    policy = p;
+    if (policy.maxStreams == 1)policy.maxStreams = 2; // the two streams of an edge must fit
+    // Build the LRU list from the existing streams (in no particular order)
+    lruHead = lruTail = nullptr;
+    if (policy.maxStreams > 0) {
+        stats.forEach([this](const StreamKey &, IncStat<N, Real> *incStat) {
+            incStat->lruPrev = incStat->lruNext = nullptr;
+            touch(incStat);
+        });
+        while (stats.size() > policy.maxStreams)evict(lruTail);
+    }
+}
+
+// The windows that come into the range were not decayed with the others (see StatSelection)
+template<int N, class Real>
+void IncStatDB<N, Real>::setSelection(const StatSelection &s) {
+    int begin = selection.begin, end = selection.end;
+    selection = s;
+    decay.setRange(s.begin, s.end);
+    if (s.begin >= begin && s.end <= end)return;
+    // The windows of the new range below and above the old one
+    int clears[2][2] = {{s.begin, std::min(begin, s.end)}, {std::max(end, s.begin), s.end}};
+    stats.forEach([&clears](const StreamKey &, IncStat<N, Real> *incStat) {
+        for (auto &clear: clears)incStat->clearWindows(clear[0], clear[1]);
+        for (auto incStatCov : incStat->covs)
+            if (incStatCov->incS1 == incStat)
+                for (auto &clear: clears)incStatCov->clearWindows(clear[0], clear[1]);
+    });
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::setLazyEdges(bool lazy) {
+    if (lazy == lazyEdges)return;
+    lazyEdges = lazy;
+    // Every edge is in the list of both of its streams, the state tells whether it is done already
+    stats.forEach([this, lazy](const StreamKey &, IncStat<N, Real> *incStat) {
+        for (auto incStatCov : incStat->covs) {
+            if (lazy && !incStatCov->isLazy()) {
+                incStatCov->makeLazy();
+                StreamKey key = edgeKey(incStatCov->incS1, incStatCov->incS2);
+                edges.insert(key, key.hash(), incStatCov);
+            } else if (!lazy && incStatCov->isLazy()) {
+                incStatCov->settle(now, decay);
+                incStatCov->dropLazy();
+            }
+        }
+    });
+    if (!lazy)edges.clear();
+}
+
+// Nothing is allocated here, a child process forked for a background snapshot runs it too
+template<int N, class Real>
+void IncStatDB<N, Real>::save(SnapshotWriter &out) {
+    // The streams and edges are numbered by their place in the pools, which the images keep
+    streamPool.findLive();
+    edgePool.findLive();
+    size_t usedStreams = streamPool.used(), usedEdges = edgePool.used();
+    for (size_t i = 0; i < usedStreams; ++i)
+        if (streamPool.isLive(i))stream(i)->snapshotIndex = i;
+    for (size_t i = 0; i < usedEdges; ++i)
+        if (edgePool.isLive(i))edge(i)->snapshotIndex = i;
+    out.put<uint64_t>(stats.size());
+    out.put<uint64_t>(stats.getCapacity());
+    out.put<uint64_t>(edgePool.getStats().live);
+    out.put<uint64_t>(counters.evictedStreams);
+    out.put<uint64_t>(counters.evictedEdges);
+    out.put(now);
+    out.put(policy.epsilon);
+    out.put<uint64_t>(policy.maxStreams);
+    out.put<int64_t>(policy.sweepPerUpdate);
+    out.put<uint64_t>(sweepCursor);
+    out.put<uint64_t>((lazyEdges ? 1 : 0) | (mirrored ? 2 : 0));
+    out.put<uint32_t>(selection.begin);
+    out.put<uint32_t>(selection.end);
+    streamPool.save(out);
+    edgePool.save(out);
+
+    for (size_t i = 0; i < usedStreams; ++i) {
+        if (!streamPool.isLive(i))continue;
+        IncStat<N, Real> *incStat = stream(i);
+        uint64_t h = incStat->key.hash();
+        out.put<uint64_t>(stats.slotOf(incStat->key, h));
+        out.put(h);
+        out.put<uint64_t>(incStat->covs.size());
+        incStat->saveArrays(out);
+    }
+    for (size_t i = 0; i < usedEdges; ++i) {
+        if (!edgePool.isLive(i))continue;
+        IncStatCov<N, Real> *incStatCov = edge(i);
+        out.put<uint32_t>(incStatCov->incS1->snapshotIndex);
+        out.put<uint32_t>(incStatCov->incS2->snapshotIndex);
+        incStatCov->saveArrays(out);
+    }
+    // The lists of edges in their own order, the edges of a stream are visited in this order when it is updated
+    for (size_t i = 0; i < usedStreams; ++i) {
+        if (!streamPool.isLive(i))continue;
+        for (IncStatCov<N, Real> *incStatCov: stream(i)->covs)out.put<uint32_t>(incStatCov->snapshotIndex);
+    }
+    out.align();
+    if (policy.maxStreams > 0) {
+        for (IncStat<N, Real> *incStat = lruHead; incStat != nullptr; incStat = incStat->lruNext)
+            out.put<uint32_t>(incStat->snapshotIndex);
+        out.align();
+    }
+}
+
+template<int N>
+static void corruptSnapshot() {
+    std::fprintf(stderr, "\nIncStatDB<%d>: the snapshot is corrupt!\n", N);
+    throw -1;
+}
+
+// The images of the pools are copied slab by slab, then one pass over the records, in the order of the pools,
+// turns the indexes into pointers
+template<int N, class Real>
+void IncStatDB<N, Real>::restore(SnapshotReader &in) {
+    size_t streamCount = in.get<uint64_t>(), capacity = in.get<uint64_t>(), edgeCount = in.get<uint64_t>();
+    counters.evictedStreams = in.get<uint64_t>();
+    counters.evictedEdges = in.get<uint64_t>();
+    now = in.get<double>();
+    policy.epsilon = in.get<double>();
+    policy.maxStreams = in.get<uint64_t>();
+    policy.sweepPerUpdate = (int) in.get<int64_t>();
+    sweepCursor = in.get<uint64_t>();
+    uint64_t flags = in.get<uint64_t>();
+    lazyEdges = (flags & 1) != 0;
+    mirrored = (flags & 2) != 0;
+    int begin = in.get<uint32_t>(), end = in.get<uint32_t>();
+    if ((capacity & (capacity - 1)) != 0 || streamCount > capacity || (capacity > 0 && sweepCursor >= capacity) ||
+        begin >= end || end > (int) lambdas->size())
+        corruptSnapshot<N>();
+    streamPool.restore(in);
+    edgePool.restore(in);
+    if (streamPool.getStats().live != streamCount || edgePool.getStats().live != edgeCount)corruptSnapshot<N>();
+    size_t usedStreams = streamPool.used(), usedEdges = edgePool.used();
+
+    stats.reset(capacity);
+    std::vector<size_t> covCounts;
+    covCounts.reserve(streamCount);
+    for (size_t i = 0; i < usedStreams; ++i) {
+        if (!streamPool.isLive(i))continue;
+        size_t slot = in.get<uint64_t>();
+        uint64_t h = in.get<uint64_t>();
+        covCounts.push_back(in.get<uint64_t>());
+        if (slot >= capacity || h == 0 || stats.slot(slot) != nullptr)corruptSnapshot<N>();
+        IncStat<N, Real> *incStat = stream(i);
+        incStat->restoreImage(in, lambdas);
+        stats.restoreSlot(slot, incStat->key, h, incStat);
+    }
+
+    for (size_t i = 0; i < usedEdges; ++i) {
+        if (!edgePool.isLive(i))continue;
+        size_t s1 = in.get<uint32_t>(), s2 = in.get<uint32_t>();
+        if (s1 >= usedStreams || !streamPool.isLive(s1) || s2 >= usedStreams || !streamPool.isLive(s2))
+            corruptSnapshot<N>();
+        IncStatCov<N, Real> *incStatCov = edge(i);
+        incStatCov->restoreImage(in, lambdas, stream(s1), stream(s2));
+        if (lazyEdges) { // the index is keyed by the new pointers
+            StreamKey key = edgeKey(stream(s1), stream(s2));
+            edges.insert(key, key.hash(), incStatCov);
+        }
+    }
+    counters.edges = edgeCount;
+
+    for (size_t i = 0, k = 0; i < usedStreams; ++i) {
+        if (!streamPool.isLive(i))continue;
+        std::vector<IncStatCov<N, Real> *> &covs = stream(i)->covs;
+        covs.reserve(covCounts[k]);
+        for (size_t j = 0; j < covCounts[k]; ++j) {
+            size_t e = in.get<uint32_t>();
+            if (e >= usedEdges || !edgePool.isLive(e))corruptSnapshot<N>();
+            covs.push_back(edge(e));
+        }
+        ++k;
+    }
+    in.align();
+    if (policy.maxStreams > 0) {
+        for (size_t k = 0; k < streamCount; ++k) {
+            size_t s = in.get<uint32_t>();
+            if (s >= usedStreams || !streamPool.isLive(s))corruptSnapshot<N>();
+            IncStat<N, Real> *incStat = stream(s);
+            incStat->lruPrev = lruTail;
+            if (lruTail != nullptr) lruTail->lruNext = incStat;
+            else lruHead = incStat;
+            lruTail = incStat;
+        }
+        in.align();
+    }
+    // The selection of the new IncStatDB, with the range it was saved with as the windows that are up to date
+    StatSelection s = selection;
+    selection.begin = begin;
+    selection.end = end;
+    setSelection(s);
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::unlink(IncStat<N, Real> *incStat) {
+    if (incStat->lruPrev != nullptr) incStat->lruPrev->lruNext = incStat->lruNext;
+    else if (lruHead == incStat) lruHead = incStat->lruNext;
+    if (incStat->lruNext != nullptr) incStat->lruNext->lruPrev = incStat->lruPrev;
+    else if (lruTail == incStat) lruTail = incStat->lruPrev;
+    incStat->lruPrev = incStat->lruNext = nullptr;
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::touch(IncStat<N, Real> *incStat) {
+    if (lruHead == incStat)return;
+    unlink(incStat);
+    incStat->lruNext = lruHead;
+    if (lruHead != nullptr) lruHead->lruPrev = incStat;
+    lruHead = incStat;
+    if (lruTail == nullptr) lruTail = incStat;
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::removeEdge(IncStatCov<N, Real> *incStatCov) {
+    // A stream paired with itself holds the edge twice, all the references are removed
+    IncStat<N, Real> *ends[2] = {incStatCov->incS1, incStatCov->incS2};
+    for (int k = 0; k < (ends[0] == ends[1] ? 1 : 2); ++k) {
+        std::vector<IncStatCov<N, Real> *> &covs = ends[k]->covs;
+        for (size_t i = 0; i < covs.size();) {
+            if (covs[i] == incStatCov) {
+                covs[i] = covs.back();
+                covs.pop_back();
+            } else ++i;
+        }
+    }
+    if (lazyEdges) {
+        StreamKey key = edgeKey(incStatCov->incS1, incStatCov->incS2);
+        edges.erase(key, key.hash());
+    }
+    destroy(incStatCov);
+    --counters.edges;
+    ++counters.evictedEdges;
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::evict(IncStat<N, Real> *incStat) {
+    while (!incStat->covs.empty())removeEdge(incStat->covs.back());
+    stats.erase(incStat->key, incStat->key.hash());
+    unlink(incStat);
+    destroy(incStat);
+    ++counters.evictedStreams;
+}
+
+template<int N, class Real>
+void IncStatDB<N, Real>::sweep(double t) {
+    if (t > now)now = t;
+    if (policy.epsilon <= 0 || stats.size() == 0)return;
+    for (int n = 0; n < policy.sweepPerUpdate; ++n) {
+        if (sweepCursor >= stats.getCapacity())sweepCursor = 0;
+        IncStat<N, Real> *incStat = stats.slot(sweepCursor);
+        if (incStat == nullptr) {
+            ++sweepCursor;
+            continue;
+        }
+        // Edges that both streams have stopped updating
+        for (size_t i = 0; i < incStat->covs.size();) {
+            IncStatCov<N, Real> *incStatCov = incStat->covs[i];
+            if (incStatCov->isLazy())incStatCov->settle(now, decay);
+            if (incStatCov->decayedWeight(longestWindow, now) < policy.epsilon) removeEdge(incStatCov);
+            else ++i;
+        }
+        // A stream is only dropped once it has no edges left, so streams that only receive
+        // (their own weight stays 0) live as long as someone keeps sending to them.
+        // A jitter stream is never dropped by weight: its next value is the gap since its last
+        // packet, which a recreated stream would report as 0. Only maxStreams bounds those.
+        if (!incStat->getIsTypeDiff() && incStat->covs.empty() &&
+            incStat->decayedWeight(longestWindow, now) < policy.epsilon) {
+            evict(incStat); // the slot now holds the entry shifted back into it, so it is checked next
+        } else ++sweepCursor;
     }
-    // The statistics of the stream pointed to by it->second
-    it->second->insert(v, t);
-    return it->second->getAll1DStats(result);
 }
 
 
 // Update the two-dimensional information of the specified stream, and add [radius, magnitude, cov, pcc] to the result
 // The parameters are: ID of the first stream, ID of the second stream, statistical information of the first stream, timestamp, pointer to the result array,
 // Return the number of data added to the result array
-int IncStatDB::updateGet2DStats(const std::string &ID1, const std::string &ID2, double t1, double v1,
+template<int N, class Real>
+int IncStatDB<N, Real>::updateGet2DStats(const StreamKey &ID1, const StreamKey &ID2, double t1, double v1,
                                 double *result, bool isTypediff) {
+    sweep(t1);
     // Get two streams, generate a new one if not found
-    auto it1 = stats.find(ID1);
-    if (it1 == stats.end()) { // If not found, generate a new stream
-        auto *incStat1 = new IncStat(ID1, lambdas, t1, isTypediff);
-        auto ret1 = stats.insert(std::make_pair(ID1, incStat1));
-        it1 = ret1.first;
+    IncStat<N, Real> *incStat1 = getStream(ID1, t1, isTypediff);
+    IncStat<N, Real> *incStat2 = getStream(ID2, t1, isTypediff);
+    return update2D(incStat1, incStat2, t1, v1, result);
+}
+
+template<int N, class Real>
+IncStatCov<N, Real> *IncStatDB<N, Real>::newEdge(IncStat<N, Real> *incStat1, IncStat<N, Real> *incStat2, double t) {
+    IncStatCov<N, Real> *incStatCov = ::new(edgePool.allocate()) IncStatCov<N, Real>(incStat1, incStat2, lambdas, t);
+    incStatCov->refNum = 2;
+    ++counters.edges;
+    // Save this reference in both streams. When destructing, the number of references will be judged, and it will be deleted only when it is 0.
+    incStat1->covs.push_back(incStatCov);
+    incStat2->covs.push_back(incStatCov);
+    if (lazyEdges) {
+        StreamKey key = edgeKey(incStat1, incStat2);
+        edges.insert(key, key.hash(), incStatCov);
+        incStatCov->makeLazy();
     }
-    auto it2 = stats.find(ID2);
-    if (it2 == stats.end()) { // If not found, generate a new stream
-        auto *incStat2 = new IncStat(ID2, lambdas, t1, isTypediff);
-        auto ret2 = stats.insert(std::make_pair(ID2, incStat2));
-        it2 = ret2.first;
+    return incStatCov;
+}
+
+template<int N, class Real>
+int IncStatDB<N, Real>::update2D(IncStat<N, Real> *incStat1, IncStat<N, Real> *incStat2, double t1, double v1, double *result) {
+    if (lazyEdges) {
+        if (incStat2 == nullptr)return 0;
+        // Only the queried edge is brought up to date, found through the index instead of the list of the stream
+        StreamKey key = edgeKey(incStat1, incStat2);
+        uint64_t h = key.hash();
+        IncStatCov<N, Real> *incStatCov = edges.find(key, h);
+        if (incStatCov == nullptr) {
+            incStatCov = newEdge(incStat1, incStat2, t1);
+            incStatCov->addFirst(v1, t1, decay);
+        } else incStatCov->settle(t1, decay);
+        return incStatCov->get2DStats(selection, result);
     }
 
     // Get the relationship between two streams, and update all other stream relationships related to ID1 at the same time
-    IncStatCov *incStatCov = nullptr;
-    for (auto v:it1->second->covs) {
-        v->updateCov(ID1, v1, t1);
+    IncStatCov<N, Real> *incStatCov = nullptr;
+    for (auto v:incStat1->covs) {
+        v->updateCov(incStat1, v1, t1, decay);
         // While updating, look for streams related to ID2
-        if (incStatCov == nullptr && (v->incS1->ID == ID2 || v->incS2->ID == ID2))
+        if (incStatCov == nullptr && (v->incS1 == incStat2 || v->incS2 == incStat2))
             incStatCov = v;
     }
+    if (incStat2 == nullptr)return 0;
 
     // If not found, generate a new relationship between streams
     if (incStatCov == nullptr) {
-        incStatCov = new IncStatCov(it1->second, it2->second, lambdas, t1);
-        incStatCov->refNum = 2;
-        // Save this reference in both streams. When destructing, the number of references will be judged, and it will be deleted only when it is 0.
-        it1->second->covs.push_back(incStatCov);
-        it2->second->covs.push_back(incStatCov);
-        incStatCov->updateCov(ID1, v1, t1);
+        incStatCov = newEdge(incStat1, incStat2, t1);
+        incStatCov->updateCov(incStat1, v1, t1, decay);
     }
 
     // Get statistics between two streams
-    return incStatCov->getAll2DStats(result);
+    return incStatCov->get2DStats(selection, result);
+}
+
+// The mirror of the first stream takes its state after the insert, then its edges here are updated as in update2D.
+// The mirror of the second stream is up to date already, unless it is new: every packet of a stream passes here
+template<int N, class Real>
+int IncStatDB<N, Real>::updateMirrored2D(const StreamKey &ID1, const IncStat<N, Real> &state1, const StreamKey &ID2,
+                                   const IncStat<N, Real> *state2, double t1, double v1, double *result) {
+    // Nothing to do for a stream without a mirror here, unless the queried edge is here
+    if (state2 == nullptr && stats.find(ID1, ID1.hash()) == nullptr)return 0;
+    sweep(t1);
+    IncStat<N, Real> *incStat1 = getStream(ID1, t1, false);
+    incStat1->copyState(state1);
+    IncStat<N, Real> *incStat2 = nullptr;
+    if (state2 != nullptr) {
+        uint64_t h = ID2.hash();
+        incStat2 = stats.find(ID2, h);
+        if (incStat2 == nullptr) {
+            incStat2 = getStream(ID2, t1, false);
+            incStat2->copyState(*state2);
+        } else if (policy.maxStreams > 0) touch(incStat2);
+    }
+    return update2D(incStat1, incStat2, t1, v1, result);
 }
 
 
 // Constructor, parameters are lambdas
-NetStat::NetStat(const std::vector<double> &l) {
+template<int N, class Real>
+NetStat<N, Real>::NetStat(const std::vector<double> &l) : NetStatBase(l) {
+    if (lambdas.empty() || (N > 0 && lambdas.size() != N)) {
+        std::fprintf(stderr, "\nNetStat<%d>: %d time windows are given!\n", N, (int) lambdas.size());
+        throw -1;
+    }
     //Initialize the four maintained flow information, and pass the pointer of the time window list to it.
-    lambdas = std::vector<double>(l);
-    HT_jit = new IncStatDB(&lambdas);
-    HT_Hp = new IncStatDB(&lambdas);
-    HT_MI = new IncStatDB(&lambdas);
-    HT_H = new IncStatDB(&lambdas);
+    HT_jit = new IncStatDB<N, Real>(&lambdas);
+    HT_Hp = new IncStatDB<N, Real>(&lambdas);
+    HT_MI = new IncStatDB<N, Real>(&lambdas);
+    HT_H = new IncStatDB<N, Real>(&lambdas);
 }
 
 // No-argument constructor, using default lambdas
-NetStat::NetStat() {
-    lambdas = std::vector<double>({5, 3, 1, 0.1, 0.01});
-    HT_jit = new IncStatDB(&lambdas);
-    HT_Hp = new IncStatDB(&lambdas);
-    HT_MI = new IncStatDB(&lambdas);
-    HT_H = new IncStatDB(&lambdas);
+template<int N, class Real>
+NetStat<N, Real>::NetStat() : NetStat(defaultLambdas()) {}
+
+const std::vector<double> &defaultLambdas() {
+    static const std::vector<double> lambdas({5, 3, 1, 0.1, 0.01});
+    return lambdas;
 }
 
-// The main call function, pass in a package information, and return the corresponding statistical vector
-// The parameters are: source MAC, destination MCA, source IP, IP protocol type, destination IP, destination IP protocol type, packet size, packet timestamp
-int NetStat::updateAndGetStats(const std::string &srcMAC, const std::string &dstMAC,
-                               const std::string &srcIP, const std::string &srcProtocol,
-                               const std::string &dstIP, const std::string &dstProtocol,
-                               double datagramSize, double timestamp, double *result) {
+// The windows are fixed at compile time for the common small counts
+NetStatBase *newNetStat(const std::vector<double> &lambdas) {
+    switch (lambdas.size()) {
+        case 1: return new NetStat<1>(lambdas);
+        case 2: return new NetStat<2>(lambdas);
+        case 3: return new NetStat<3>(lambdas);
+        case 4: return new NetStat<4>(lambdas);
+        case 5: return new NetStat<5>(lambdas);
+        case 6: return new NetStat<6>(lambdas);
+        case 7: return new NetStat<7>(lambdas);
+        case 8: return new NetStat<8>(lambdas);
+        default: return new NetStat<DynamicWindows>(lambdas);
+    }
+}
+
+NetStatBase *newShardedNetStat(int shards, const std::vector<double> &lambdas) {
+    switch (lambdas.size()) {
+        case 1: return new ShardedNetStat<1>(shards, lambdas);
+        case 2: return new ShardedNetStat<2>(shards, lambdas);
+        case 3: return new ShardedNetStat<3>(shards, lambdas);
+        case 4: return new ShardedNetStat<4>(shards, lambdas);
+        case 5: return new ShardedNetStat<5>(shards, lambdas);
+        case 6: return new ShardedNetStat<6>(shards, lambdas);
+        case 7: return new ShardedNetStat<7>(shards, lambdas);
+        case 8: return new ShardedNetStat<8>(shards, lambdas);
+        default: return new ShardedNetStat<DynamicWindows>(shards, lambdas);
+    }
+}
+
+NetStatBase *newCompactNetStat(const std::vector<double> &lambdas) {
+    switch (lambdas.size()) {
+        case 1: return new NetStat<1, float>(lambdas);
+        case 2: return new NetStat<2, float>(lambdas);
+        case 3: return new NetStat<3, float>(lambdas);
+        case 4: return new NetStat<4, float>(lambdas);
+        case 5: return new NetStat<5, float>(lambdas);
+        case 6: return new NetStat<6, float>(lambdas);
+        case 7: return new NetStat<7, float>(lambdas);
+        case 8: return new NetStat<8, float>(lambdas);
+        default: return new NetStat<DynamicWindows, float>(lambdas);
+    }
+}
+
+void NetStatBase::writeSnapshotHeader(SnapshotWriter &out, uint32_t shards, uint32_t dbCount,
+                                      uint32_t valueBytes) const {
+    SnapshotHeader header;
+    std::memcpy(header.magic, SnapshotHeader::Magic, sizeof(header.magic));
+    header.version = SnapshotHeader::Version;
+    header.windows = lambdas.size();
+    header.shards = shards;
+    header.dbCount = dbCount;
+    header.valueBytes = valueBytes;
+    header.reserved = 0;
+    out.put(header);
+    out.write(lambdas.data(), sizeof(double) * lambdas.size());
+}
 
-    int offset = 0; // The offset of the array (the number currently placed)
+void NetStatBase::saveSnapshot(const char *filename) {
+    SnapshotWriter out(filename);
+    writeSnapshot(out);
+    if (!out.finish()) {
+        std::fprintf(stderr, "\nNetStat: cannot write the snapshot %s!\n", filename);
+        throw -1;
+    }
+}
 
-    // MAC.IP: Statistical source host MAC and IP relationship and bandwidth
-    offset += HT_MI->updateGet1DStats(srcMAC + srcIP, timestamp, datagramSize, result);
+bool NetStatBase::saveSnapshotInBackground(const char *filename) {
+#ifdef WIN32
+    saveSnapshot(filename);
+    return true;
+#else
+    if (snapshotChild > 0) {
+        int status;
+        if (waitpid((pid_t) snapshotChild, &status, WNOHANG) == 0)return false;
+        snapshotSucceeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        snapshotChild = 0;
+    }
+    // The file and the buffer are ready before fork, the child only copies memory and writes
+    SnapshotWriter out(filename);
+    pid_t pid = fork();
+    if (pid == 0) {
+        writeSnapshot(out);
+        _exit(out.finish() ? 0 : 1);
+    }
+    if (pid < 0) { // no child, the snapshot is written here
+        writeSnapshot(out);
+        snapshotSucceeded = out.finish();
+        return true;
+    }
+    out.detach();
+    snapshotChild = pid;
+    return true;
+#endif
+}
 
-    // Host-Host BW: Statistics of the sending flow of the source IP host (one-dimensional relationship)
-    // two-dimensional relationship between the sending behavior of the source IP host and the destination IP host
-    offset += HT_H->updateGet1D2DStats(srcIP, dstIP, timestamp, datagramSize, result + offset);
+bool NetStatBase::waitSnapshot() {
+#ifndef WIN32
+    if (snapshotChild > 0) {
+        int status;
+        snapshotSucceeded = waitpid((pid_t) snapshotChild, &status, 0) == snapshotChild && WIFEXITED(status) &&
+                            WEXITSTATUS(status) == 0;
+        snapshotChild = 0;
+    }
+#endif
+    return snapshotSucceeded;
+}
 
-    // Host-Host Jitter: Jitter between hosts and hosts
-    offset += HT_jit->updateGet1DStats(srcIP + dstIP, timestamp, 0, result + offset, true);
+NetStatBase *loadNetStat(const char *filename) {
+    SnapshotReader in(filename);
+    SnapshotHeader header = in.get<SnapshotHeader>();
+    if (std::memcmp(header.magic, SnapshotHeader::Magic, sizeof(header.magic)) != 0 ||
+        header.version != SnapshotHeader::Version || header.windows == 0 ||
+        (header.valueBytes != sizeof(double) && (header.valueBytes != sizeof(float) || header.shards != 0))) {
+        std::fprintf(stderr, "\nloadNetStat: %s is not a NetStat snapshot!\n", filename);
+        throw -1;
+    }
+    const double *l = in.doubles(header.windows);
+    std::vector<double> lambdas(l, l + header.windows);
+    NetStatBase *netStat;
+    if (header.shards != 0) netStat = newShardedNetStat(header.shards, lambdas);
+    else if (header.valueBytes == sizeof(float)) netStat = newCompactNetStat(lambdas);
+    else netStat = newNetStat(lambdas);
+    try {
+        netStat->readSnapshot(in, header.dbCount);
+        if (!in.atEnd()) {
+            std::fprintf(stderr, "\nloadNetStat: %s has extra data!\n", filename);
+            throw -1;
+        }
+    } catch (...) {
+        delete netStat;
+        throw;
+    }
+    return netStat;
+}
+
+// Kinds of addresses in a StreamKey, MACs stand in for the IPs of ProtoOther packets
+static const uint64_t KeyMAC = 1;
+
+// Tags of the "port" part of the HT_Hp keys: none (MAC streams), a tcp/udp port number, icmp
+static const uint64_t PortNone = 0, PortNumber = 1, PortICMP = 2;
+
+// The address a packet is keyed by on one side: its IP, or its MAC if it is neither tcp/udp, icmp nor arp
+struct KeyAddress {
+    uint64_t hi, lo, kind;
+};
+
+static inline KeyAddress keyAddress(const PacketRecord &pkt, bool src) {
+    if (pkt.protocol == ProtoOther) return KeyAddress{0, src ? pkt.srcMAC : pkt.dstMAC, KeyMAC};
+    const uint64_t *ip = src ? pkt.srcIP : pkt.dstIP;
+    return KeyAddress{ip[0], ip[1], pkt.ipVersion};
+}
+
+// MAC.IP: Statistical source host MAC and IP relationship and bandwidth
+static inline StreamKey keyMI(const PacketRecord &pkt) {
+    KeyAddress src = keyAddress(pkt, true);
+    return StreamKey{{pkt.srcMAC, src.hi, src.lo, src.kind, 0}};
+}
 
-    // Host-Host BW: Statistics of the sending flow of the source IP port (one-dimensional relationship) The sending behavior relationship between the source IP port and the destination IP port (two-dimensional relationship)
-    // If it is not a tcp/udp package, let the mac address be the key value of the stream
-    if (srcProtocol == "arp") {
-        offset += HT_Hp->updateGet1D2DStats(srcMAC, dstMAC, timestamp, datagramSize, result + offset);
+// Host-Host BW: Statistics of the sending flow of the source IP host (one-dimensional relationship)
+// two-dimensional relationship between the sending behavior of the source IP host and the destination IP host
+static inline void keysH(const PacketRecord &pkt, StreamKey &key1, StreamKey &key2) {
+    KeyAddress src = keyAddress(pkt, true), dst = keyAddress(pkt, false);
+    key1 = {{src.hi, src.lo, src.kind, 0, 0}};
+    key2 = {{dst.hi, dst.lo, dst.kind, 0, 0}};
+}
+
+// Host-Host Jitter: Jitter between hosts and hosts
+static inline StreamKey keyJit(const PacketRecord &pkt) {
+    KeyAddress src = keyAddress(pkt, true), dst = keyAddress(pkt, false);
+    return StreamKey{{src.hi, src.lo, dst.hi, dst.lo, src.kind | dst.kind << 8}};
+}
+
+// Host-Host BW: Statistics of the sending flow of the source IP port (one-dimensional relationship) The sending behavior relationship between the source IP port and the destination IP port (two-dimensional relationship)
+// If it is not a tcp/udp package, let the mac address be the key value of the stream
+static inline void keysHp(const PacketRecord &pkt, StreamKey &key1, StreamKey &key2) {
+    if (pkt.protocol == ProtoARP) {
+        // Same keys as the MAC streams of ProtoOther packets
+        key1 = {{0, pkt.srcMAC, KeyMAC | PortNone << 8, 0, 0}};
+        key2 = {{0, pkt.dstMAC, KeyMAC | PortNone << 8, 0, 0}};
     } else {
-        offset += HT_Hp->updateGet1D2DStats(srcIP + srcProtocol, dstIP + dstProtocol, timestamp,
-                                            datagramSize, result + offset);
+        KeyAddress src = keyAddress(pkt, true), dst = keyAddress(pkt, false);
+        uint64_t tag = pkt.protocol == ProtoOther ? PortNone : (pkt.protocol == ProtoICMP ? PortICMP : PortNumber);
+        key1 = {{src.hi, src.lo, src.kind | tag << 8 | (uint64_t) pkt.srcPort << 16, 0, 0}};
+        key2 = {{dst.hi, dst.lo, dst.kind | tag << 8 | (uint64_t) pkt.dstPort << 16, 0, 0}};
+    }
+}
+
+// The H and Hp streams do the work the statistics selected of them need (see FeatureMask)
+template<int N, class Real>
+static int updateGetStats(IncStatDB<N, Real> *db, FeatureMask::Work work, const StreamKey &key1,
+                          const StreamKey &key2, const PacketRecord &pkt, double *result) {
+    switch (work) {
+        case FeatureMask::Work1D:
+            return db->updateGet1DStats(key1, pkt.timestamp, pkt.datagramSize, result);
+        case FeatureMask::WorkPairs:
+            return db->updateGet1DPairStats(key1, key2, pkt.timestamp, pkt.datagramSize, result);
+        default:
+            return db->updateGet1D2DStats(key1, key2, pkt.timestamp, pkt.datagramSize, result);
+    }
+}
+
+// Update one family of streams and write its selected statistics at the family's place in result (a masked vector)
+template<int N, class Real>
+int NetStat<N, Real>::updateFamily(int family, const PacketRecord &pkt, double *result) {
+    StreamKey key1, key2;
+    result += columns[family];
+    switch (family) {
+        case FamilyMI:
+            return HT_MI->updateGet1DStats(keyMI(pkt), pkt.timestamp, pkt.datagramSize, result);
+        case FamilyH:
+            keysH(pkt, key1, key2);
+            return updateGetStats(HT_H, work[FamilyH], key1, key2, pkt, result);
+        case FamilyJit:
+            return HT_jit->updateGet1DStats(keyJit(pkt), pkt.timestamp, 0, result, true);
+        default:
+            keysHp(pkt, key1, key2);
+            return updateGetStats(HT_Hp, work[FamilyHp], key1, key2, pkt, result);
+    }
+}
+
+// The main call function, pass in a decoded packet, and return the corresponding statistical vector.
+// The families without a selected feature are not updated at all
+template<int N, class Real>
+int NetStat<N, Real>::updateAndGetStats(const PacketRecord &pkt, double *result) {
+    double *masked = maskedRowsFor(result, 1);
+    for (int family = 0; family < FamilyCount; ++family)
+        if (work[family] != FeatureMask::WorkNone)updateFamily(family, pkt, masked);
+    orderFeatures(masked, 1, result);
+    return getVectorSize();
+}
+
+// One family over a whole batch, the packets of a family are still updated in order
+template<int N, class Real>
+void NetStat<N, Real>::runFamily(void *job) {
+    FamilyJob *j = static_cast<FamilyJob *>(job);
+    if (j->netStat->work[j->family] == FeatureMask::WorkNone)return;
+    int size = j->netStat->maskedSize;
+    for (int i = 0; i < j->n; ++i)
+        j->netStat->updateFamily(j->family, j->pkts[i], j->result + (size_t) i * size);
+}
+
+// Batch form: in parallel mode every family runs over the batch on its own thread and writes its own columns
+template<int N, class Real>
+int NetStat<N, Real>::updateAndGetBatch(const PacketRecord *pkts, int n, double *result) {
+    if (!isParallel()) {
+        int size = getVectorSize();
+        for (int i = 0; i < n; ++i)
+            updateAndGetStats(pkts[i], result + (size_t) i * size);
+        return n;
+    }
+    double *masked = maskedRowsFor(result, n);
+    FamilyJob jobs[FamilyCount];
+    for (int family = 0; family < FamilyCount; ++family)
+        jobs[family] = FamilyJob{this, family, pkts, n, masked};
+    workers[0]->submit(runFamily, &jobs[FamilyMI]);
+    workers[1]->submit(runFamily, &jobs[FamilyJit]);
+    workers[2]->submit(runFamily, &jobs[FamilyHp]);
+    runFamily(&jobs[FamilyH]);
+    for (WorkerThread *worker: workers)
+        worker->wait();
+    orderFeatures(masked, n, result);
+    return n;
+}
+
+template<int N, class Real>
+void NetStat<N, Real>::setParallel(bool parallel) {
+    if (parallel == isParallel())return;
+    for (WorkerThread *&worker: workers) {
+        if (parallel) worker = new WorkerThread();
+        else {
+            delete worker;
+            worker = nullptr;
+        }
+    }
+}
+
+template<int N, class Real>
+void NetStat<N, Real>::applySelections() {
+    HT_jit->setSelection(selection[FamilyJit]);
+    HT_MI->setSelection(selection[FamilyMI]);
+    HT_H->setSelection(selection[FamilyH]);
+    HT_Hp->setSelection(selection[FamilyHp]);
+}
+
+template<int N, class Real>
+void NetStat<N, Real>::writeSnapshot(SnapshotWriter &out) {
+    writeSnapshotHeader(out, 0, FamilyCount, sizeof(Real));
+    HT_jit->save(out);
+    HT_MI->save(out);
+    HT_H->save(out);
+    HT_Hp->save(out);
+}
+
+template<int N, class Real>
+void NetStat<N, Real>::readSnapshot(SnapshotReader &in, uint32_t dbCount) {
+    if (dbCount != FamilyCount) {
+        std::fprintf(stderr, "\nNetStat<%d>: the snapshot has %u IncStatDBs!\n", N, dbCount);
+        throw -1;
+    }
+    HT_jit->restore(in);
+    HT_MI->restore(in);
+    HT_H->restore(in);
+    HT_Hp->restore(in);
+}
+
+template<int N>
+ShardedNetStat<N>::ShardedNetStat(int shardCount, const std::vector<double> &l) : NetStatBase(l) {
+    if (lambdas.empty() || (N > 0 && lambdas.size() != N) || shardCount < 1) {
+        std::fprintf(stderr, "\nShardedNetStat<%d>: %d time windows and %d shards are given!\n", N,
+                     (int) lambdas.size(), shardCount);
+        throw -1;
+    }
+    shards.resize(shardCount);
+    for (Shard &shard: shards) {
+        shard.HT_jit = new IncStatDB<N>(&lambdas);
+        shard.HT_MI = new IncStatDB<N>(&lambdas);
+        shard.HT_H = new IncStatDB<N>(&lambdas);
+        shard.HT_Hp = new IncStatDB<N>(&lambdas);
+        shard.edges_H = new IncStatDB<N>(&lambdas);
+        shard.edges_Hp = new IncStatDB<N>(&lambdas);
+        shard.HT_H->setMirrored(true);
+        shard.HT_Hp->setMirrored(true);
+    }
+    directoryH = new MirrorDirectory[shardCount];
+    directoryHp = new MirrorDirectory[shardCount];
+    keys.resize(BatchCapacity);
+    jobs.resize(shardCount);
+    // The states are copied into whole streams, so that the mirrors copy them like any other stream
+    states = static_cast<IncStat<N> *>(alignedAlloc(sizeof(IncStat<N>) * 4 * BatchCapacity, alignof(IncStat<N>)));
+    for (int i = 0; i < 4 * BatchCapacity; ++i)::new(states + i) IncStat<N>(&lambdas);
+    setParallel(true);
+}
+
+template<int N>
+ShardedNetStat<N>::~ShardedNetStat() {
+    setParallel(false);
+    for (int i = 0; i < 4 * BatchCapacity; ++i)states[i].~IncStat<N>();
+    alignedFree(states);
+    delete[] directoryH;
+    delete[] directoryHp;
+    for (Shard &shard: shards) {
+        delete shard.edges_H;
+        delete shard.edges_Hp;
+        delete shard.HT_H;
+        delete shard.HT_Hp;
+        delete shard.HT_MI;
+        delete shard.HT_jit;
+    }
+}
+
+// Every shard computes the keys of its part of the batch
+template<int N>
+void ShardedNetStat<N>::computeKeys(int shard, const PacketRecord *pkts, int n) {
+    int count = shards.size();
+    for (int i = n * shard / count; i < n * (shard + 1) / count; ++i) {
+        PacketKeys &k = keys[i];
+        k.MI = keyMI(pkts[i]);
+        k.jit = keyJit(pkts[i]);
+        keysH(pkts[i], k.H1, k.H2);
+        keysHp(pkts[i], k.Hp1, k.Hp2);
+        k.hashH1 = k.H1.hash();
+        k.hashH2 = k.H2.hash();
+        k.hashHp1 = k.Hp1.hash();
+        k.hashHp2 = k.Hp2.hash();
+        k.shardMI = shardOf(k.MI.hash());
+        k.shardJit = shardOf(k.jit.hash());
+        k.shardH1 = shardOf(k.hashH1);
+        k.shardH2 = shardOf(k.hashH2);
+        k.shardHp1 = shardOf(k.hashHp1);
+        k.shardHp2 = shardOf(k.hashHp2);
+        // The same shard for both directions between two streams
+        k.shardEdgeH = shardOf(k.hashH1 + k.hashH2);
+        k.shardEdgeHp = shardOf(k.hashHp1 + k.hashHp2);
     }
-    return offset;
 }
 
+// The streams of the shard, in the order of the packets; the states of the H and Hp streams are kept for the edges
+// (or for the radius and magnitude without edges), the families without a selected feature are skipped.
+// With edges, the shard also records where the mirrors of its streams are, before the edge of the packet adds one
+template<int N>
+void ShardedNetStat<N>::update1D(int shard, const PacketRecord *pkts, int n, double *result) {
+    Shard &sh = shards[shard];
+    int size = maskedSize;
+    bool doMI = work[FeatureMask::MI] != FeatureMask::WorkNone;
+    bool doJit = work[FeatureMask::Jit] != FeatureMask::WorkNone;
+    bool doH = work[FeatureMask::H] != FeatureMask::WorkNone;
+    bool doHp = work[FeatureMask::Hp] != FeatureMask::WorkNone;
+    bool pairsH = work[FeatureMask::H] >= FeatureMask::WorkPairs;
+    bool pairsHp = work[FeatureMask::Hp] >= FeatureMask::WorkPairs;
+    bool edgesH = work[FeatureMask::H] == FeatureMask::WorkEdges;
+    bool edgesHp = work[FeatureMask::Hp] == FeatureMask::WorkEdges;
+    MirrorDirectory &dirH = directoryH[shard], &dirHp = directoryHp[shard];
+    for (int i = 0; i < n; ++i) {
+        PacketKeys &k = keys[i];
+        double t = pkts[i].timestamp, v = pkts[i].datagramSize, *row = result + (size_t) i * size;
+        if (doMI && k.shardMI == shard)sh.HT_MI->updateGet1DStats(k.MI, t, v, row + columns[FeatureMask::MI]);
+        if (doH && k.shardH1 == shard) {
+            if (!pairsH)sh.HT_H->updateGet1DStats(k.H1, t, v, row + columns[FeatureMask::H]);
+            else state(0, i).copyState(*sh.HT_H->updateGet1DStream(k.H1, t, v, row + columns[FeatureMask::H]));
+            if (edgesH) {
+                uint64_t &mask = dirH.get(k.H1, k.hashH1);
+                k.visitH = mask | shardBit(k.shardEdgeH);
+                mask = k.visitH;
+            }
+        }
+        if (pairsH && k.shardH2 == shard) {
+            state(1, i).copyState(*sh.HT_H->getStreamState(k.H2, t));
+            if (edgesH)dirH.get(k.H2, k.hashH2) |= shardBit(k.shardEdgeH);
+        }
+        if (doJit && k.shardJit == shard)sh.HT_jit->updateGet1DStats(k.jit, t, 0, row + columns[FeatureMask::Jit], true);
+        if (doHp && k.shardHp1 == shard) {
+            if (!pairsHp)sh.HT_Hp->updateGet1DStats(k.Hp1, t, v, row + columns[FeatureMask::Hp]);
+            else state(2, i).copyState(*sh.HT_Hp->updateGet1DStream(k.Hp1, t, v, row + columns[FeatureMask::Hp]));
+            if (edgesHp) {
+                uint64_t &mask = dirHp.get(k.Hp1, k.hashHp1);
+                k.visitHp = mask | shardBit(k.shardEdgeHp);
+                mask = k.visitHp;
+            }
+        }
+        if (pairsHp && k.shardHp2 == shard) {
+            state(3, i).copyState(*sh.HT_Hp->getStreamState(k.Hp2, t));
+            if (edgesHp)dirHp.get(k.Hp2, k.hashHp2) |= shardBit(k.shardEdgeHp);
+        }
+    }
+}
+
+// The shard goes through the packets whose first stream may have a mirror here (see update1D), in order, so the
+// mirrors of the shard follow their streams packet by packet.
+// Without edges (see FeatureMask) the shard of the edge only computes the radius and magnitude of the two states
+template<int N>
+void ShardedNetStat<N>::update2D(int shard, const PacketRecord *pkts, int n, double *result) {
+    Shard &sh = shards[shard];
+    int size = maskedSize;
+    FeatureMask::Work workH = work[FeatureMask::H], workHp = work[FeatureMask::Hp];
+    const StatSelection &selectionH = selection[FeatureMask::H], &selectionHp = selection[FeatureMask::Hp];
+    // The 2D statistics follow the 1D ones of the family
+    int columnH = columns[FeatureMask::H] + selectionH.size1D(), columnHp = columns[FeatureMask::Hp] + selectionHp.size1D();
+    uint64_t bit = shardBit(shard);
+    for (int i = 0; i < n; ++i) {
+        const PacketKeys &k = keys[i];
+        double t = pkts[i].timestamp, v = pkts[i].datagramSize, *row = result + (size_t) i * size;
+        if (workH == FeatureMask::WorkEdges) {
+            if (k.visitH & bit)
+                sh.edges_H->updateMirrored2D(k.H1, state(0, i), k.H2, k.shardEdgeH == shard ? &state(1, i) : nullptr,
+                                             t, v, row + columnH);
+        } else if (workH == FeatureMask::WorkPairs && k.shardEdgeH == shard)
+            state(0, i).getPairStats(state(1, i), selectionH, row + columnH);
+        if (workHp == FeatureMask::WorkEdges) {
+            if (k.visitHp & bit)
+                sh.edges_Hp->updateMirrored2D(k.Hp1, state(2, i), k.Hp2,
+                                              k.shardEdgeHp == shard ? &state(3, i) : nullptr, t, v, row + columnHp);
+        }
+        else if (workHp == FeatureMask::WorkPairs && k.shardEdgeHp == shard)
+            state(2, i).getPairStats(state(3, i), selectionHp, row + columnHp);
+    }
+}
+
+template<int N>
+size_t ShardedNetStat<N>::directorySize() const {
+    size_t size = 0;
+    for (size_t shard = 0; shard < shards.size(); ++shard)
+        size += directoryH[shard].table.size() + directoryHp[shard].table.size();
+    return size;
+}
+
+template<int N>
+void ShardedNetStat<N>::rebuildDirectories() {
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        directoryH[shard].clear();
+        directoryHp[shard].clear();
+    }
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        uint64_t bit = shardBit(shard);
+        shards[shard].edges_H->forEachStreamKey([&](const StreamKey &key) {
+            uint64_t h = key.hash();
+            directoryH[shardOf(h)].get(key, h) |= bit;
+        });
+        shards[shard].edges_Hp->forEachStreamKey([&](const StreamKey &key) {
+            uint64_t h = key.hash();
+            directoryHp[shardOf(h)].get(key, h) |= bit;
+        });
+    }
+    directoryLive = directorySize();
+}
+
+template<int N>
+void ShardedNetStat<N>::runShard(void *job) {
+    ShardJob *j = static_cast<ShardJob *>(job);
+    switch (j->step) {
+        case StepKeys:
+            j->netStat->computeKeys(j->shard, j->pkts, j->n);
+            break;
+        case Step1D:
+            j->netStat->update1D(j->shard, j->pkts, j->n, j->result);
+            break;
+        default:
+            j->netStat->update2D(j->shard, j->pkts, j->n, j->result);
+    }
+}
+
+template<int N>
+void ShardedNetStat<N>::processBatch(const PacketRecord *pkts, int n, double *result, bool parallel) {
+    // The directories keep the evicted mirrors, rebuilt once they are more than twice the size after the last rebuild
+    if (directorySize() > 2 * directoryLive + 1024 * shards.size())rebuildDirectories();
+    for (int step = StepKeys; step <= Step2D; ++step) {
+        for (size_t shard = 0; shard < shards.size(); ++shard)
+            jobs[shard] = ShardJob{this, (int) shard, step, pkts, n, result};
+        if (!parallel) {
+            for (ShardJob &job: jobs)runShard(&job);
+            continue;
+        }
+        for (size_t shard = 1; shard < shards.size(); ++shard)
+            workers[shard - 1]->submit(runShard, &jobs[shard]);
+        runShard(&jobs[0]);
+        for (WorkerThread *worker: workers)
+            worker->wait();
+    }
+}
+
+template<int N>
+int ShardedNetStat<N>::updateAndGetStats(const PacketRecord &pkt, double *result) {
+    double *masked = maskedRowsFor(result, 1);
+    processBatch(&pkt, 1, masked, false);
+    orderFeatures(masked, 1, result);
+    return getVectorSize();
+}
+
+template<int N>
+int ShardedNetStat<N>::updateAndGetBatch(const PacketRecord *pkts, int n, double *result) {
+    int size = getVectorSize();
+    for (int i = 0; i < n; i += BatchCapacity) {
+        int m = n - i < BatchCapacity ? n - i : BatchCapacity;
+        double *masked = maskedRowsFor(result + (size_t) i * size, m);
+        processBatch(pkts + i, m, masked, isParallel());
+        orderFeatures(masked, m, result + (size_t) i * size);
+    }
+    return n;
+}
+
+template<int N>
+void ShardedNetStat<N>::setParallel(bool parallel) {
+    if (parallel == isParallel())return;
+    if (parallel) {
+        for (size_t shard = 1; shard < shards.size(); ++shard)workers.push_back(new WorkerThread());
+    } else {
+        for (WorkerThread *worker: workers)delete worker;
+        workers.clear();
+    }
+}
+
+template<int N>
+void ShardedNetStat<N>::applySelections() {
+    for (Shard &shard: shards) {
+        shard.HT_jit->setSelection(selection[FeatureMask::Jit]);
+        shard.HT_MI->setSelection(selection[FeatureMask::MI]);
+        shard.HT_H->setSelection(selection[FeatureMask::H]);
+        shard.HT_Hp->setSelection(selection[FeatureMask::Hp]);
+        shard.edges_H->setSelection(selection[FeatureMask::H]);
+        shard.edges_Hp->setSelection(selection[FeatureMask::Hp]);
+    }
+}
+
+template<int N>
+void ShardedNetStat<N>::setEvictionPolicy(const EvictionPolicy &p) {
+    for (Shard &shard: shards) {
+        shard.HT_jit->setEvictionPolicy(p);
+        shard.HT_MI->setEvictionPolicy(p);
+        shard.HT_H->setEvictionPolicy(p);
+        shard.HT_Hp->setEvictionPolicy(p);
+        shard.edges_H->setEvictionPolicy(p);
+        shard.edges_Hp->setEvictionPolicy(p);
+    }
+}
+
+// The streams keep the residual sums for the lazy edges of their mirrors
+template<int N>
+void ShardedNetStat<N>::setLazyEdges(bool lazy) {
+    for (Shard &shard: shards) {
+        shard.HT_H->setLazyEdges(lazy);
+        shard.HT_Hp->setLazyEdges(lazy);
+        shard.edges_H->setLazyEdges(lazy);
+        shard.edges_Hp->setLazyEdges(lazy);
+    }
+}
+
+template<int N>
+PoolStats ShardedNetStat<N>::getStreamPoolStats() const {
+    PoolStats p;
+    for (const Shard &shard: shards) {
+        p += shard.HT_jit->getStreamPoolStats();
+        p += shard.HT_MI->getStreamPoolStats();
+        p += shard.HT_H->getStreamPoolStats();
+        p += shard.HT_Hp->getStreamPoolStats();
+        p += shard.edges_H->getStreamPoolStats();
+        p += shard.edges_Hp->getStreamPoolStats();
+    }
+    return p;
+}
+
+template<int N>
+PoolStats ShardedNetStat<N>::getEdgePoolStats() const {
+    PoolStats p;
+    for (const Shard &shard: shards) {
+        p += shard.edges_H->getEdgePoolStats();
+        p += shard.edges_Hp->getEdgePoolStats();
+    }
+    return p;
+}
+
+template<int N>
+EvictionCounters ShardedNetStat<N>::getCounters() const {
+    EvictionCounters c;
+    for (const Shard &shard: shards) {
+        c += shard.HT_jit->getCounters();
+        c += shard.HT_MI->getCounters();
+        c += shard.HT_H->getCounters();
+        c += shard.HT_Hp->getCounters();
+        EvictionCounters e = shard.edges_H->getCounters();
+        e += shard.edges_Hp->getCounters();
+        c.edges += e.edges;
+        c.evictedEdges += e.evictedEdges;
+    }
+    return c;
+}
+
+template<int N>
+void ShardedNetStat<N>::writeSnapshot(SnapshotWriter &out) {
+    writeSnapshotHeader(out, shards.size(), 6 * shards.size(), sizeof(double));
+    for (Shard &shard: shards) {
+        shard.HT_jit->save(out);
+        shard.HT_MI->save(out);
+        shard.HT_H->save(out);
+        shard.HT_Hp->save(out);
+        shard.edges_H->save(out);
+        shard.edges_Hp->save(out);
+    }
+}
+
+template<int N>
+void ShardedNetStat<N>::readSnapshot(SnapshotReader &in, uint32_t dbCount) {
+    if (dbCount != 6 * shards.size()) {
+        std::fprintf(stderr, "\nShardedNetStat<%d>: the snapshot has %u IncStatDBs!\n", N, dbCount);
+        throw -1;
+    }
+    for (Shard &shard: shards) {
+        shard.HT_jit->restore(in);
+        shard.HT_MI->restore(in);
+        shard.HT_H->restore(in);
+        shard.HT_Hp->restore(in);
+        shard.edges_H->restore(in);
+        shard.edges_Hp->restore(in);
+    }
+    // The directories of the mirrors are not saved
+    rebuildDirectories();
+}
+
+static inline StrView view(const std::string &s) {
+    return StrView{s.data(), s.size()};
+}
+
+// The text form of the main call function, the text is parsed into a PacketRecord
+// The parameters are: source MAC, destination MCA, source IP, IP protocol type, destination IP, destination IP protocol type, packet size, packet timestamp
+int NetStatBase::updateAndGetStats(const std::string &srcMAC, const std::string &dstMAC,
+                                   const std::string &srcIP, const std::string &srcProtocol,
+                                   const std::string &dstIP, const std::string &dstProtocol,
+                                   double datagramSize, double timestamp, double *result) {
+    PacketRecord pkt = makePacketRecord(view(srcMAC), view(dstMAC), view(srcIP), view(srcProtocol), view(dstIP),
+                                        view(dstProtocol), datagramSize, timestamp);
+    return updateAndGetStats(pkt, result);
+}
+
+int FeatureMask::count() const {
+    int n = 0;
+    for (bool on: enabled)n += on;
+    return n;
+}
+
+int FeatureMask::index(Family f, Stat s, int window) const {
+    if (f < MI || f >= FamilyCount || s < Weight || s >= StatCount || (s >= Radius && !has2D(f)) ||
+        window < 0 || window >= windows) {
+        std::fprintf(stderr, "\nFeatureMask: there is no statistic %d of family %d in time window %d!\n", s, f,
+                     window);
+        throw -1;
+    }
+    return (familyOffset(f) + s) * windows + window;
+}
+
+FeatureMask &FeatureMask::set(Family f, Stat s, bool on, int window) {
+    if (window >= 0) enabled[index(f, s, window)] = on;
+    else for (int i = 0; i < windows; ++i)enabled[index(f, s, i)] = on;
+    return *this;
+}
+
+FeatureMask &FeatureMask::setFamily(Family f, bool on, int window) {
+    for (int s = Weight; s < (has2D(f) ? StatCount : Radius); ++s)set(f, (Stat) s, on, window);
+    return *this;
+}
+
+FeatureMask &FeatureMask::set(int feature, bool on) {
+    if (feature < 0 || feature >= size()) {
+        std::fprintf(stderr, "\nFeatureMask: there is no feature %d in %d features!\n", feature, size());
+        throw -1;
+    }
+    enabled[feature] = on;
+    return *this;
+}
+
+// The work is decided by the most demanding statistic selected in any time window
+FeatureMask::Work FeatureMask::work(Family f) const {
+    Work w = WorkNone;
+    for (int s = Weight; s < (has2D(f) ? StatCount : Radius); ++s) {
+        for (int i = 0; i < windows; ++i) {
+            if (!get(f, (Stat) s, i))continue;
+            Work need = s >= Cov ? WorkEdges : s >= Radius ? WorkPairs : Work1D;
+            if (need > w)w = need;
+        }
+    }
+    return w;
+}
+
+// The windows of a family are the selected ones and the longest one, in which IncStatDB checks the weights to evict
+StatSelection FeatureMask::selection(Family f, int keep) const {
+    StatSelection s;
+    s.begin = keep;
+    s.end = keep + 1;
+    for (int stat = Weight; stat < (has2D(f) ? StatCount : Radius); ++stat) {
+        for (int i = 0; i < windows; ++i) {
+            if (!get(f, (Stat) stat, i))continue;
+            s.windows[stat].push_back(i);
+            if (i < s.begin)s.begin = i;
+            if (i >= s.end)s.end = i + 1;
+        }
+    }
+    return s;
+}
+
+// A family that is not updated keeps its windows as they are, so that it does not lose them when it is selected again
+void NetStatBase::selectStats() {
+    int longest = 0;
+    for (size_t i = 1; i < lambdas.size(); ++i)
+        if (lambdas[i] < lambdas[longest])longest = i;
+    maskedSize = 0;
+    for (int f = 0; f < FeatureMask::FamilyCount; ++f) {
+        work[f] = mask.work((FeatureMask::Family) f);
+        StatSelection s = mask.selection((FeatureMask::Family) f, longest);
+        if (work[f] == FeatureMask::WorkNone && selection[f].end > 0) {
+            s.begin = selection[f].begin;
+            s.end = selection[f].end;
+        }
+        selection[f] = s;
+        columns[f] = maskedSize;
+        maskedSize += s.size();
+    }
+}
+
+void NetStatBase::setFeatureMask(const FeatureMask &m) {
+    if (m.getWindows() != (int) lambdas.size() || m.count() == 0) {
+        std::fprintf(stderr, "\nNetStatBase: a feature mask of %d time windows with %d features is given!\n",
+                     m.getWindows(), m.count());
+        throw -1;
+    }
+    mask = m;
+    selectStats();
+    applySelections();
+    selected.clear();
+    order.clear();
+    if (mask.count() == mask.size())return;
+    for (int i = 0; i < mask.size(); ++i)
+        if (mask.get(i))selected.push_back(i);
+}
+
+// selected is rebuilt from the mask, then composed with the order
+void NetStatBase::setFeatureOrder(const std::vector<int> &o) {
+    for (int i: o) {
+        if (i < 0 || i >= mask.count()) {
+            std::fprintf(stderr, "\nNetStatBase: the feature %d of the order is not one of the %d features!\n", i,
+                         mask.count());
+            throw -1;
+        }
+    }
+    setFeatureMask(mask);
+    if (o.empty())return;
+    std::vector<int> composed;
+    for (int i: o)composed.push_back(getFeatureIndex(i));
+    selected = composed;
+    order = o;
+}
+
+double *NetStatBase::maskedRowsFor(double *result, int n) {
+    if (order.empty())return result;
+    size_t size = (size_t) n * maskedSize;
+    if (maskedRows.size() < size)maskedRows.resize(size);
+    return maskedRows.data();
+}
+
+void NetStatBase::orderFeatures(const double *masked, int n, double *result) const {
+    if (masked == result)return;
+    int size = order.size();
+    for (int row = 0; row < n; ++row) {
+        const double *in = masked + (size_t) row * maskedSize;
+        double *out = result + (size_t) row * size;
+        for (int i = 0; i < size; ++i)out[i] = in[order[i]];
+    }
+}
+
+// A MAC that does not parse is kept apart from every real MAC by its hash (with the top bit set)
+static uint64_t textMAC(StrView s) {
+    uint64_t mac;
+    if (s.empty())return PacketRecord::NoMAC;
+    if (parseMAC(s, mac))return mac;
+    uint64_t h[2];
+    hashText(s, h);
+    return h[0] | 1ull << 63;
+}
+
+// Parse an address, returns its version (4, 6, 0 for an empty one, TextAddress if it is not an IP)
+static uint8_t textIP(StrView s, uint64_t ip[2]) {
+    uint32_t v4;
+    ip[0] = ip[1] = 0;
+    if (s.empty())return 0;
+    if (parseIPv4(s, v4)) {
+        ip[1] = v4;
+        return 4;
+    }
+    if (parseIPv6(s, ip))return 6;
+    hashText(s, ip);
+    return PacketRecord::TextAddress;
+}
+
+static inline bool equals(StrView s, const char *text) {
+    return s.size == std::strlen(text) && std::memcmp(s.data, text, s.size) == 0;
+}
+
+static inline uint16_t textPort(StrView s) {
+    uint32_t port = 0;
+    for (size_t i = 0; i < s.size && s.data[i] >= '0' && s.data[i] <= '9'; ++i)port = port * 10 + s.data[i] - '0';
+    return (uint16_t) port;
+}
+
+// Build a PacketRecord from the text forms accepted by NetStat::updateAndGetStats
+PacketRecord makePacketRecord(StrView srcMAC, StrView dstMAC, StrView srcIP, StrView srcProtocol,
+                              StrView dstIP, StrView dstProtocol, double datagramSize, double timestamp) {
+    PacketRecord pkt;
+    pkt.srcMAC = textMAC(srcMAC);
+    pkt.dstMAC = textMAC(dstMAC);
+    pkt.datagramSize = datagramSize;
+    pkt.timestamp = timestamp;
+    pkt.srcPort = pkt.dstPort = 0;
+    pkt.ipVersion = 0;
+    pkt.srcIP[0] = pkt.srcIP[1] = pkt.dstIP[0] = pkt.dstIP[1] = 0;
+    if (srcProtocol.empty()) {
+        // Neither tcp/udp, icmp nor arp: the IPs are the MACs
+        pkt.protocol = ProtoOther;
+        return pkt;
+    }
+    if (equals(srcProtocol, "icmp")) {
+        pkt.protocol = ProtoICMP;
+    } else if (equals(srcProtocol, "arp")) {
+        pkt.protocol = ProtoARP;
+    } else { // tcp and udp ports share the same streams
+        pkt.protocol = ProtoTCP;
+        pkt.srcPort = textPort(srcProtocol);
+        pkt.dstPort = textPort(dstProtocol);
+    }
+    uint8_t srcVersion = textIP(srcIP, pkt.srcIP);
+    uint8_t dstVersion = textIP(dstIP, pkt.dstIP);
+    if (srcVersion != dstVersion) { // mixed kinds of addresses, tell them apart by their text
+        hashText(srcIP, pkt.srcIP);
+        hashText(dstIP, pkt.dstIP);
+        srcVersion = PacketRecord::TextAddress;
+    }
+    pkt.ipVersion = srcVersion;
+    return pkt;
+}
+
+
+// Every window count newNetStat can pick, N = 0 .. MaxFixedWindows
+template class NetStat<0>;
+template class NetStat<1>;
+template class NetStat<2>;
+template class NetStat<3>;
+template class NetStat<4>;
+template class NetStat<5>;
+template class NetStat<6>;
+template class NetStat<7>;
+template class NetStat<8>;
+template class NetStat<0, float>;
+template class NetStat<1, float>;
+template class NetStat<2, float>;
+template class NetStat<3, float>;
+template class NetStat<4, float>;
+template class NetStat<5, float>;
+template class NetStat<6, float>;
+template class NetStat<7, float>;
+template class NetStat<8, float>;
+template class ShardedNetStat<0>;
+template class ShardedNetStat<1>;
+template class ShardedNetStat<2>;
+template class ShardedNetStat<3>;
+template class ShardedNetStat<4>;
+template class ShardedNetStat<5>;
+template class ShardedNetStat<6>;
+template class ShardedNetStat<7>;
+template class ShardedNetStat<8>;
@@ -5,86 +5,556 @@
  */
 
 #include "../include/neuralnet.h"
+#include "../include/workerThread.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KITSUNE_X86_KERNELS
+#include <immintrin.h>
+#endif
 
-Dense::Dense(int inSize, int outSize, double (*activationFunc)(double), double (*activationDerivativeFunc)(double),
-             double lr) {
+
+// The kernels of one vector instruction set. sum, bias, the rows of W and delta are stride doubles,
+// aligned to a cache line. They work on whole vectors, the outputs past nOut in the last vector are the padding
+struct DenseKernels {
+    // sum = bias + the rows of W weighted by the inputs, added in the order of the inputs
+    void (*forward)(const double *W, const double *bias, const double *in, double *sum, int nIn, int nOut, int stride);
+
+    // g[i] = row i of W times delta, added in the order of the outputs
+    void (*backward)(const double *W, const double *delta, double *g, int nIn, int nOut, int stride);
+
+    // bias += delta, row i of W += in[i] * delta
+    void (*update)(double *W, double *bias, const double *in, const double *delta, int nIn, int nOut, int stride);
+
+    // forward of rows (at most DenseBatchRows) rows of inputs ldIn apart into rows of sum stride apart
+    void (*forwardRows)(const double *W, const double *bias, const double *in, int ldIn, double *sum, int nIn,
+                        int nOut, int stride, int rows);
+
+    // update with rows rows of inputs ldIn apart and of delta stride apart, added to W in the order of the rows
+    void (*updateRows)(double *W, double *bias, const double *in, int ldIn, const double *delta, int nIn, int nOut,
+                       int stride, int rows);
+};
+
+static void backwardScalar(const double *W, const double *delta, double *g, int nIn, int nOut, int stride) {
+    for (int i = 0; i < nIn; ++i) {
+        const double *row = W + (size_t) i * stride;
+        double s = 0;
+        for (int j = 0; j < nOut; ++j)s += row[j] * delta[j];
+        g[i] = s;
+    }
+}
+
+static void updateScalar(double *W, double *bias, const double *in, const double *delta, int nIn, int nOut,
+                         int stride) {
+    for (int j = 0; j < nOut; ++j)bias[j] += delta[j];
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        for (int j = 0; j < nOut; ++j)row[j] += in[i] * delta[j];
+    }
+}
+
+// Every output of the rows is summed up in a register, in the order of the inputs
+static void forwardRowsScalar(const double *W, const double *bias, const double *in, int ldIn, double *sum, int nIn,
+                              int nOut, int stride, int rows) {
+    for (int j = 0; j < nOut; ++j) {
+        double s[DenseBatchRows];
+        for (int r = 0; r < rows; ++r)s[r] = bias[j];
+        for (int i = 0; i < nIn; ++i) {
+            double w = W[(size_t) i * stride + j];
+            for (int r = 0; r < rows; ++r)s[r] += w * in[r * ldIn + i];
+        }
+        for (int r = 0; r < rows; ++r)sum[r * stride + j] = s[r];
+    }
+}
+
+static void updateRowsScalar(double *W, double *bias, const double *in, int ldIn, const double *delta, int nIn,
+                             int nOut, int stride, int rows) {
+    for (int j = 0; j < nOut; ++j)
+        for (int r = 0; r < rows; ++r)bias[j] += delta[r * stride + j];
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        for (int j = 0; j < nOut; ++j)
+            for (int r = 0; r < rows; ++r)row[j] += in[r * ldIn + i] * delta[r * stride + j];
+    }
+}
+
+#ifdef KITSUNE_X86_KERNELS
+
+// The lanes are outputs in forward and update, rows (inputs) in backward, so every lane adds up its terms
+// in the same order as the scalar kernels. Multiplies and adds stay separate, a fused multiply-add rounds once less
+
+__attribute__((target("avx2")))
+static void forwardAVX2(const double *W, const double *bias, const double *in, double *sum, int nIn, int nOut,
+                        int stride) {
+    for (int j = 0; j < nOut; j += 4) {
+        __m256d s = _mm256_load_pd(bias + j);
+        for (int i = 0; i < nIn; ++i) {
+            __m256d w = _mm256_load_pd(W + (size_t) i * stride + j);
+            s = _mm256_add_pd(s, _mm256_mul_pd(w, _mm256_set1_pd(in[i])));
+        }
+        _mm256_store_pd(sum + j, s);
+    }
+}
+
+// Four rows at a time, column j of them is gathered
+__attribute__((target("avx2")))
+static void backwardAVX2(const double *W, const double *delta, double *g, int nIn, int nOut, int stride) {
+    const __m128i rows = _mm_setr_epi32(0, stride, 2 * stride, 3 * stride);
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    int i = 0;
+    for (; i + 4 <= nIn; i += 4) {
+        const double *base = W + (size_t) i * stride;
+        __m256d s = _mm256_setzero_pd();
+        for (int j = 0; j < nOut; ++j) {
+            __m256d column = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base + j, rows, all, 8);
+            s = _mm256_add_pd(s, _mm256_mul_pd(column, _mm256_set1_pd(delta[j])));
+        }
+        _mm256_storeu_pd(g + i, s);
+    }
+    backwardScalar(W + (size_t) i * stride, delta, g + i, nIn - i, nOut, stride);
+}
+
+__attribute__((target("avx2")))
+static void updateAVX2(double *W, double *bias, const double *in, const double *delta, int nIn, int nOut,
+                       int stride) {
+    for (int j = 0; j < nOut; j += 4)
+        _mm256_store_pd(bias + j, _mm256_add_pd(_mm256_load_pd(bias + j), _mm256_load_pd(delta + j)));
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        __m256d x = _mm256_set1_pd(in[i]);
+        for (int j = 0; j < nOut; j += 4)
+            _mm256_store_pd(row + j, _mm256_add_pd(_mm256_load_pd(row + j),
+                                                   _mm256_mul_pd(x, _mm256_load_pd(delta + j))));
+    }
+}
+
+// AVX-512F implies FMA, so plain vector multiplies would be contracted with the adds: the products are taken with
+// the builtin of the explicit rounding form, which is never fused
+__attribute__((target("avx512f")))
+static inline __m512d mul512(__m512d a, __m512d b) {
+    return _mm512_maskz_mul_round_pd(0xff, a, b, _MM_FROUND_CUR_DIRECTION);
+}
+
+__attribute__((target("avx512f")))
+static void forwardAVX512(const double *W, const double *bias, const double *in, double *sum, int nIn, int nOut,
+                          int stride) {
+    for (int j = 0; j < nOut; j += 8) {
+        __m512d s = _mm512_load_pd(bias + j);
+        for (int i = 0; i < nIn; ++i) {
+            __m512d w = _mm512_load_pd(W + (size_t) i * stride + j);
+            s = _mm512_add_pd(s, mul512(w, _mm512_set1_pd(in[i])));
+        }
+        _mm512_store_pd(sum + j, s);
+    }
+}
+
+// Eight rows at a time, the last rows are masked
+__attribute__((target("avx512f")))
+static void backwardAVX512(const double *W, const double *delta, double *g, int nIn, int nOut, int stride) {
+    const __m256i rows = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    for (int i = 0; i < nIn; i += 8) {
+        __mmask8 mask = nIn - i >= 8 ? 0xff : (__mmask8) ((1u << (nIn - i)) - 1);
+        const double *base = W + (size_t) i * stride;
+        __m512d s = _mm512_setzero_pd();
+        for (int j = 0; j < nOut; ++j) {
+            __m512d column = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, rows, base + j, 8);
+            s = _mm512_add_pd(s, mul512(column, _mm512_set1_pd(delta[j])));
+        }
+        _mm512_mask_storeu_pd(g + i, mask, s);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void updateAVX512(double *W, double *bias, const double *in, const double *delta, int nIn, int nOut,
+                         int stride) {
+    for (int j = 0; j < nOut; j += 8)
+        _mm512_store_pd(bias + j, _mm512_add_pd(_mm512_load_pd(bias + j), _mm512_load_pd(delta + j)));
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        __m512d x = _mm512_set1_pd(in[i]);
+        for (int j = 0; j < nOut; j += 8)
+            _mm512_store_pd(row + j, _mm512_add_pd(_mm512_load_pd(row + j), mul512(x, _mm512_load_pd(delta + j))));
+    }
+}
+
+// Every vector of W that is loaded is weighted by the inputs of all the rows, one register of sums for each row
+__attribute__((target("avx2")))
+static void forwardRowsAVX2(const double *W, const double *bias, const double *in, int ldIn, double *sum, int nIn,
+                            int nOut, int stride, int rows) {
+    if (rows < DenseBatchRows) {
+        for (int r = 0; r < rows; ++r)forwardAVX2(W, bias, in + r * ldIn, sum + r * stride, nIn, nOut, stride);
+        return;
+    }
+    const double *in1 = in + ldIn, *in2 = in1 + ldIn, *in3 = in2 + ldIn;
+    for (int j = 0; j < nOut; j += 4) {
+        __m256d s0 = _mm256_load_pd(bias + j), s1 = s0, s2 = s0, s3 = s0;
+        for (int i = 0; i < nIn; ++i) {
+            __m256d w = _mm256_load_pd(W + (size_t) i * stride + j);
+            s0 = _mm256_add_pd(s0, _mm256_mul_pd(w, _mm256_set1_pd(in[i])));
+            s1 = _mm256_add_pd(s1, _mm256_mul_pd(w, _mm256_set1_pd(in1[i])));
+            s2 = _mm256_add_pd(s2, _mm256_mul_pd(w, _mm256_set1_pd(in2[i])));
+            s3 = _mm256_add_pd(s3, _mm256_mul_pd(w, _mm256_set1_pd(in3[i])));
+        }
+        _mm256_store_pd(sum + j, s0);
+        _mm256_store_pd(sum + stride + j, s1);
+        _mm256_store_pd(sum + 2 * stride + j, s2);
+        _mm256_store_pd(sum + 3 * stride + j, s3);
+    }
+}
+
+// Every vector of W is loaded and stored once for all the rows
+__attribute__((target("avx2")))
+static void updateRowsAVX2(double *W, double *bias, const double *in, int ldIn, const double *delta, int nIn, int nOut,
+                           int stride, int rows) {
+    for (int j = 0; j < nOut; j += 4) {
+        __m256d b = _mm256_load_pd(bias + j);
+        for (int r = 0; r < rows; ++r)b = _mm256_add_pd(b, _mm256_load_pd(delta + r * stride + j));
+        _mm256_store_pd(bias + j, b);
+    }
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        for (int j = 0; j < nOut; j += 4) {
+            __m256d w = _mm256_load_pd(row + j);
+            for (int r = 0; r < rows; ++r)
+                w = _mm256_add_pd(w, _mm256_mul_pd(_mm256_set1_pd(in[r * ldIn + i]),
+                                                   _mm256_load_pd(delta + r * stride + j)));
+            _mm256_store_pd(row + j, w);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void forwardRowsAVX512(const double *W, const double *bias, const double *in, int ldIn, double *sum, int nIn,
+                              int nOut, int stride, int rows) {
+    if (rows < DenseBatchRows) {
+        for (int r = 0; r < rows; ++r)forwardAVX512(W, bias, in + r * ldIn, sum + r * stride, nIn, nOut, stride);
+        return;
+    }
+    const double *in1 = in + ldIn, *in2 = in1 + ldIn, *in3 = in2 + ldIn;
+    for (int j = 0; j < nOut; j += 8) {
+        __m512d s0 = _mm512_load_pd(bias + j), s1 = s0, s2 = s0, s3 = s0;
+        for (int i = 0; i < nIn; ++i) {
+            __m512d w = _mm512_load_pd(W + (size_t) i * stride + j);
+            s0 = _mm512_add_pd(s0, mul512(w, _mm512_set1_pd(in[i])));
+            s1 = _mm512_add_pd(s1, mul512(w, _mm512_set1_pd(in1[i])));
+            s2 = _mm512_add_pd(s2, mul512(w, _mm512_set1_pd(in2[i])));
+            s3 = _mm512_add_pd(s3, mul512(w, _mm512_set1_pd(in3[i])));
+        }
+        _mm512_store_pd(sum + j, s0);
+        _mm512_store_pd(sum + stride + j, s1);
+        _mm512_store_pd(sum + 2 * stride + j, s2);
+        _mm512_store_pd(sum + 3 * stride + j, s3);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void updateRowsAVX512(double *W, double *bias, const double *in, int ldIn, const double *delta, int nIn,
+                             int nOut, int stride, int rows) {
+    for (int j = 0; j < nOut; j += 8) {
+        __m512d b = _mm512_load_pd(bias + j);
+        for (int r = 0; r < rows; ++r)b = _mm512_add_pd(b, _mm512_load_pd(delta + r * stride + j));
+        _mm512_store_pd(bias + j, b);
+    }
+    for (int i = 0; i < nIn; ++i) {
+        double *row = W + (size_t) i * stride;
+        for (int j = 0; j < nOut; j += 8) {
+            __m512d w = _mm512_load_pd(row + j);
+            for (int r = 0; r < rows; ++r)
+                w = _mm512_add_pd(w, mul512(_mm512_set1_pd(in[r * ldIn + i]), _mm512_load_pd(delta + r * stride + j)));
+            _mm512_store_pd(row + j, w);
+        }
+    }
+}
+
+static const DenseKernels avx2Kernels = {forwardAVX2, backwardAVX2, updateAVX2, forwardRowsAVX2, updateRowsAVX2};
+static const DenseKernels avx512Kernels = {forwardAVX512, backwardAVX512, updateAVX512, forwardRowsAVX512,
+                                           updateRowsAVX512};
+
+#endif
+
+SimdLevel detectSimdLevel() {
+#ifdef KITSUNE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))return SimdAVX512;
+    if (__builtin_cpu_supports("avx2"))return SimdAVX2;
+#endif
+    return SimdScalar;
+}
+
+// The level of the kernels of the Dense layers created from now on
+static SimdLevel denseLevel = detectSimdLevel();
+
+void setDenseSimdLevel(SimdLevel level) {
+    SimdLevel available = detectSimdLevel();
+    denseLevel = level < available ? level : available;
+}
+
+SimdLevel getDenseSimdLevel() { return denseLevel; }
+
+// A layer narrower than a vector gains nothing from it, it runs the scalar code (nullptr) which is inlined
+static const DenseKernels *kernelsFor(int nOut) {
+#ifdef KITSUNE_X86_KERNELS
+    if (denseLevel == SimdAVX512 && nOut >= 8)return &avx512Kernels;
+    if (denseLevel >= SimdAVX2 && nOut >= 4)return &avx2Kernels;
+#endif
+    return nullptr;
+}
+
+
+// Buffers of the kernels: aligned to a cache line and zeroed, so the padding is 0
+static double *newPadded(size_t count) {
+    double *p = static_cast<double *>(alignedAlloc(sizeof(double) * count, DenseLanes * sizeof(double)));
+    for (size_t i = 0; i < count; ++i)p[i] = 0;
+    return p;
+}
+
+template<class Activation>
+BasicDense<Activation>::BasicDense(int inSize, int outSize, const Activation &act, double lr) : activation(act) {
     n_in = inSize;
     n_out = outSize;
-    activation = activationFunc;
-    activationDerivative = activationDerivativeFunc;
+    stride = (n_out + DenseLanes - 1) / DenseLanes * DenseLanes;
     learning_rate = lr;
     inputValue = new double[n_in];
-    outputValue = new double[n_out];
-    bias = new double[n_out];
-    W = new double *[n_in];// n_in rows, n_out columns
-    for (int i = 0; i < n_in; ++i)W[i] = new double[n_out];
+    outputValue = newPadded(stride);
+    sum = newPadded((size_t) DenseBatchRows * stride);
+    bias = newPadded(stride);
+    W = newPadded((size_t) n_in * stride); // n_in rows, n_out columns (and the padding)
+    kernels = kernelsFor(n_out);
 
     double val = 1.0 / n_out;
     // Evenly distributed initialization weights
     for (int i = 0; i < n_in; ++i) {
-        for (int j = 0; j < n_out; ++j)W[i][j] = rand_uniform(-val, val);
+        for (int j = 0; j < n_out; ++j)W[(size_t) i * stride + j] = rand_uniform(-val, val);
     }
-    for (int i = 0; i < n_out; ++i)bias[i] = 0;
 }
 
-Dense::~Dense() {
-    delete[] bias;
+template<class Activation>
+BasicDense<Activation>::~BasicDense() {
+    alignedFree(bias);
     delete[] inputValue;
-    delete[] outputValue;
-    for (int i = 0; i < n_in; ++i) delete[] W[i];
-    delete[] W;
+    alignedFree(outputValue);
+    alignedFree(sum);
+    alignedFree(W);
+}
+
+// The forward pass of a layer into output, sum is the buffer of the kernels (stride doubles)
+template<class Activation>
+static inline void denseForward(const Activation &activation, const DenseKernels *kernels, const double *W,
+                                const double *bias, const double *input, double *output, double *sum, int n_in,
+                                int n_out, int stride) {
+    if (kernels == nullptr) {
+        // Scalar: every output is summed up in a register, in the order of the inputs, and activated right away
+        for (int j = 0; j < n_out; ++j) {
+            double s = bias[j];
+            for (int i = 0; i < n_in; ++i)s += W[(size_t) i * stride + j] * input[i];
+            output[j] = activation.value(s);
+        }
+    } else {
+        kernels->forward(W, bias, input, sum, n_in, n_out, stride);
+        for (int i = 0; i < n_out; ++i)output[i] = activation.value(sum[i]);
+    }
+}
+
+// SGD of a layer from its saved input and output with the error g: output becomes the deltas, g the error
+// propagated to the previous layer unless propagate is false
+template<class Activation>
+static inline void denseBackPropagation(const Activation &activation, const DenseKernels *kernels, double *W,
+                                        double *bias, const double *input, double *output, double *g, int n_in,
+                                        int n_out, int stride, double learning_rate, bool propagate = true) {
+    for (int i = 0; i < n_out; ++i)output[i] = g[i] * activation.derivative(output[i]);
+
+    // Calculate the error propagated to the previous layer
+    if (propagate) {
+        if (kernels == nullptr)backwardScalar(W, output, g, n_in, n_out, stride);
+        else kernels->backward(W, output, g, n_in, n_out, stride);
+    }
+
+    // Multiply by the learning_rate once, no need to calculate when updating the threshold and the weights
+    for (int i = 0; i < n_out; ++i)output[i] *= learning_rate;
+
+    // Update the threshold and the weights
+    if (kernels == nullptr)updateScalar(W, bias, input, output, n_in, n_out, stride);
+    else kernels->update(W, bias, input, output, n_in, n_out, stride);
+}
+
+// denseForward of rows (at most DenseBatchRows) rows of input ldIn apart into rows of output ldOut apart,
+// sum is the buffer of the kernels (rows of stride doubles)
+template<class Activation>
+static inline void denseForwardRows(const Activation &activation, const DenseKernels *kernels, const double *W,
+                                    const double *bias, const double *input, int ldIn, double *output, int ldOut,
+                                    double *sum, int n_in, int n_out, int stride, int rows) {
+    if (kernels == nullptr)forwardRowsScalar(W, bias, input, ldIn, sum, n_in, n_out, stride, rows);
+    else kernels->forwardRows(W, bias, input, ldIn, sum, n_in, n_out, stride, rows);
+    for (int r = 0; r < rows; ++r)
+        for (int i = 0; i < n_out; ++i)output[r * ldOut + i] = activation.value(sum[r * stride + i]);
 }
 
-void Dense::feedForward(const double *input, double *output, bool saveValue) {
-    for (int i = 0; i < n_out; ++i) {
-        output[i] = bias[i];
-        for (int j = 0; j < n_in; ++j) {
-            output[i] += W[j][i] * input[j];
+// denseBackPropagation of rows rows with the weights before the step, then one step with the updates of all of them.
+// The outputs (deltas) are rows stride apart, the inputs ldIn apart and g ldG apart
+template<class Activation>
+static inline void denseBackPropagationRows(const Activation &activation, const DenseKernels *kernels, double *W,
+                                            double *bias, const double *input, int ldIn, double *output, double *g,
+                                            int ldG, int n_in, int n_out, int stride, double learning_rate, int rows,
+                                            bool propagate = true) {
+    for (int r = 0; r < rows; ++r) {
+        double *delta = output + r * stride, *gr = g + r * ldG;
+        for (int i = 0; i < n_out; ++i)delta[i] = gr[i] * activation.derivative(delta[i]);
+        if (propagate) {
+            if (kernels == nullptr)backwardScalar(W, delta, gr, n_in, n_out, stride);
+            else kernels->backward(W, delta, gr, n_in, n_out, stride);
         }
-        output[i] = activation(output[i]);
+        for (int i = 0; i < n_out; ++i)delta[i] *= learning_rate;
     }
+    if (kernels == nullptr)updateRowsScalar(W, bias, input, ldIn, output, n_in, n_out, stride, rows);
+    else kernels->updateRows(W, bias, input, ldIn, output, n_in, n_out, stride, rows);
+}
+
+template<class Activation>
+void BasicDense<Activation>::feedForward(const double *input, double *output, bool saveValue) {
+    denseForward(activation, kernels, W, bias, input, output, sum, n_in, n_out, stride);
     if (saveValue) {
         std::memcpy(inputValue, input, sizeof(double) * n_in);
         std::memcpy(outputValue, output, sizeof(double) * n_out);
     }
 }
 
+template<class Activation>
+void BasicDense<Activation>::feedForwardBatch(const double *input, double *output, int n) {
+    for (int r = 0; r < n; r += DenseBatchRows) {
+        int rows = std::min(DenseBatchRows, n - r);
+        denseForwardRows(activation, kernels, W, bias, input + (size_t) r * n_in, n_in, output + (size_t) r * n_out,
+                         n_out, sum, n_in, n_out, stride, rows);
+    }
+}
+
 // SGD
-void Dense::BackPropagation(double *g) {
-    for (int i = 0; i < n_out; ++i)outputValue[i] = g[i] * activationDerivative(outputValue[i]);
+template<class Activation>
+void BasicDense<Activation>::BackPropagation(double *g) {
+    denseBackPropagation(activation, kernels, W, bias, inputValue, outputValue, g, n_in, n_out, stride,
+                         learning_rate);
+}
 
-    // Calculate the error propagated to the previous layer
-    for (int i = 0; i < n_in; ++i) {
-        g[i] = 0;
-        for (int j = 0; j < n_out; ++j) {
-            g[i] += W[i][j] * outputValue[j];
+
+// 0-1 normalization of x into out, with the bounds updated
+static inline void normalize(const double *x, double *min_v, double *max_v, double *out, int n) {
+    for (int i = 0; i < n; ++i) {
+        min_v[i] = std::min(x[i], min_v[i]);
+        max_v[i] = std::max(x[i], max_v[i]);
+        out[i] = (x[i] - min_v[i]) / (max_v[i] - min_v[i] + 1e-13);
+    }
+}
+
+
+// Whether the autoencoders created from now on use the fused kernels
+static bool fusedAE = true;
+
+// reconstruct in one pass for each visible size V: normalization, encoding, decoding and the error, with the
+// inputs and the sums in registers. Every sum gets its terms in the order of feedForward, so the errors are the same
+template<class Activation>
+struct FusedAEKernels {
+    typedef double (*Kernel)(AEArrays &ae, const double *x);
+
+    // Every hidden and visible value is summed up in a register and activated right away
+    template<int V>
+    static double scalar(AEArrays &ae, const double *x) {
+        const int h = ae.hidden, es = ae.hiddenStride, ds = ae.visibleStride;
+        double in[V], y[FusedAEMaxSize], z[V];
+        normalize(x, ae.min_v, ae.max_v, in, V);
+        for (int j = 0; j < h; ++j) {
+            double s = ae.encoderBias[j];
+            for (int i = 0; i < V; ++i)s += ae.encoderW[i * es + j] * in[i];
+            y[j] = Activation().value(s);
+        }
+        for (int k = 0; k < V; ++k) {
+            z[k] = ae.decoderBias[k];
+            for (int j = 0; j < h; ++j)z[k] += ae.decoderW[j * ds + k] * y[j];
         }
+        return error<V>(in, z);
     }
 
-    // Update the threshold, and save by multiplying the learning_rate by the way, no need to calculate when updating the weight
-    for (int i = 0; i < n_out; ++i) {
-        outputValue[i] *= learning_rate;
-        bias[i] += outputValue[i];
+    // The error of the normalized input in and of the sums z of the decoder, like RMSE
+    template<int V>
+    static double error(const double *in, const double *z) {
+        double sum = 0;
+        for (int k = 0; k < V; ++k) {
+            double tmp = in[k] - Activation().value(z[k]);
+            sum += tmp * tmp;
+        }
+        return std::sqrt(sum / V);
     }
 
-    // Update weights
-    for (int i = 0; i < n_in; ++i) {
-        for (int j = 0; j < n_out; ++j) {
-            W[i][j] += inputValue[i] * outputValue[j];
+#ifdef KITSUNE_X86_KERNELS
+
+    // The hidden and the visible layer fit in four AVX2 registers each, the lanes are the outputs of the layer
+    // like in forwardAVX2. The activations and the error stay out of the code of the target
+    template<int V>
+    static double avx2(AEArrays &ae, const double *x) {
+        alignas(64) double in[V], y[FusedAEMaxSize], z[FusedAEMaxSize];
+        normalize(x, ae.min_v, ae.max_v, in, V);
+        sumsAVX2(ae.encoderW, ae.encoderBias, in, y, V, ae.hidden, ae.hiddenStride);
+        for (int j = 0; j < ae.hidden; ++j)y[j] = Activation().value(y[j]);
+        sumsAVX2(ae.decoderW, ae.decoderBias, y, z, ae.hidden, V, ae.visibleStride);
+        return error<V>(in, z);
+    }
+
+    // out = bias + the rows of W weighted by the nIn inputs, for the nOut (at most 16) outputs
+    __attribute__((target("avx2")))
+    static void sumsAVX2(const double *W, const double *bias, const double *in, double *out, int nIn, int nOut,
+                         int stride) {
+        __m256d s0 = _mm256_load_pd(bias), s1 = _mm256_load_pd(bias + 4);
+        __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+        if (nOut > 8) {
+            s2 = _mm256_load_pd(bias + 8);
+            s3 = _mm256_load_pd(bias + 12);
         }
+        for (int i = 0; i < nIn; ++i) {
+            const double *row = W + i * stride;
+            __m256d v = _mm256_set1_pd(in[i]);
+            s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_load_pd(row), v));
+            if (nOut > 4)s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_load_pd(row + 4), v));
+            if (nOut > 8) {
+                s2 = _mm256_add_pd(s2, _mm256_mul_pd(_mm256_load_pd(row + 8), v));
+                if (nOut > 12)s3 = _mm256_add_pd(s3, _mm256_mul_pd(_mm256_load_pd(row + 12), v));
+            }
+        }
+        _mm256_store_pd(out, s0);
+        _mm256_store_pd(out + 4, s1);
+        _mm256_store_pd(out + 8, s2);
+        _mm256_store_pd(out + 12, s3);
     }
-}
 
+#endif
+
+    // The kernel of the sizes at the level of the Dense layers, nullptr when there is none. The AVX2 kernels are also
+    // the ones of AVX-512: the wide units wake up slowly for a few vectors per sample. Below 4 inputs they lose to
+    // the scalar kernels
+    static Kernel get(int v, int h, SimdLevel level) {
+        if (v < 1 || v > FusedAEMaxSize || h < 1 || h > FusedAEMaxSize)return nullptr;
+#ifdef KITSUNE_X86_KERNELS
+        static const Kernel wide[FusedAEMaxSize] = {
+                avx2<1>, avx2<2>, avx2<3>, avx2<4>, avx2<5>, avx2<6>, avx2<7>, avx2<8>,
+                avx2<9>, avx2<10>, avx2<11>, avx2<12>, avx2<13>, avx2<14>, avx2<15>, avx2<16>};
+        if (level >= SimdAVX2 && v >= 4)return wide[v - 1];
+#endif
+        static const Kernel narrow[FusedAEMaxSize] = {
+                scalar<1>, scalar<2>, scalar<3>, scalar<4>, scalar<5>, scalar<6>, scalar<7>, scalar<8>,
+                scalar<9>, scalar<10>, scalar<11>, scalar<12>, scalar<13>, scalar<14>, scalar<15>, scalar<16>};
+        return narrow[v - 1];
+    }
+};
+
+void setFusedAE(bool on) { fusedAE = on; }
+
+bool getFusedAE() { return fusedAE; }
 
 // Constructor, the parameter is the number of visible layer and hidden layer
-AE::AE(int v_sz, int h_sz, double _learning_rate) {
+template<class Activation>
+BasicAE<Activation>::BasicAE(int v_sz, int h_sz, double _learning_rate) {
     visible_size = v_sz;
     hidden_size = h_sz;
 
-    // Initialize the two-layer neural network, using the sigmoid activation function
-    encoder = new Dense(visible_size, hidden_size, sigmoid, sigmoidDerivative, _learning_rate);
-    decoder = new Dense(hidden_size, visible_size, sigmoid, sigmoidDerivative, _learning_rate);
+    // Initialize the two-layer neural network, using the activation function of the policy
+    encoder = new BasicDense<Activation>(visible_size, hidden_size, Activation(), _learning_rate);
+    decoder = new BasicDense<Activation>(hidden_size, visible_size, Activation(), _learning_rate);
 
     // Initialize an array of temporary variables
     tmp_x = new double[visible_size];
@@ -92,6 +562,11 @@ AE::AE(int v_sz, int h_sz, double _learning_rate) {
     tmp_y = new double[hidden_size];
     // tmp_g is the buffer used to propagate the gradient, so the size is the maximum value of each layer
     tmp_g = new double[std::max(hidden_size, visible_size)];
+    int gStride = std::max(encoder->stride, decoder->stride);
+    batch_x = newPadded((size_t) DenseBatchRows * visible_size);
+    batch_y = newPadded((size_t) DenseBatchRows * encoder->stride);
+    batch_z = newPadded((size_t) DenseBatchRows * decoder->stride);
+    batch_g = newPadded((size_t) DenseBatchRows * gStride);
 
     // Initialize the array needed for normalization
     max_v = new double[visible_size];
@@ -100,21 +575,33 @@ AE::AE(int v_sz, int h_sz, double _learning_rate) {
         min_v[i] = 1e20;
         max_v[i] = -1e20;
     }
+
+    arrays = {visible_size, hidden_size, encoder->stride, decoder->stride, encoder->W, encoder->bias, decoder->W,
+              decoder->bias, min_v, max_v};
+    if (fusedAE)fusedReconstruct = FusedAEKernels<Activation>::get(visible_size, hidden_size, denseLevel);
 }
 
-AE::~AE() {
+template<class Activation>
+BasicAE<Activation>::~BasicAE() {
     delete encoder;
     delete decoder;
     delete[] tmp_x;
     delete[] tmp_y;
     delete[] tmp_z;
+    alignedFree(batch_x);
+    alignedFree(batch_y);
+    alignedFree(batch_z);
+    alignedFree(batch_g);
     delete[] max_v;
     delete[] min_v;
 }
 
 
 // rebuild, returns the reconstructed value
-double AE::reconstruct(const double *x) {
+template<class Activation>
+double BasicAE<Activation>::reconstruct(const double *x) {
+    if (fusedReconstruct != nullptr)return fusedReconstruct(arrays, x);
+
     normalize(x); // First normalize and save in tmp_x
 
     encoder->feedForward(tmp_x, tmp_y); // Encoding, stored in tmp_y
@@ -125,7 +612,8 @@ double AE::reconstruct(const double *x) {
 }
 
 // train
-double AE::train(const double *x) {
+template<class Activation>
+double BasicAE<Activation>::train(const double *x) {
     normalize(x); // 0-1 regularization, stored in tmp_x
     // Run forward again, set the saveValue parameter to true, and prepare for back propagation error
     encoder->feedForward(tmp_x, tmp_y, true);
@@ -140,11 +628,303 @@ double AE::train(const double *x) {
     return RMSE(tmp_x, tmp_z, visible_size);
 }
 
+// The rows are normalized in their order, as the bounds change with each of them
+template<class Activation>
+void BasicAE<Activation>::reconstructBatch(const double *X, int n, double *errors) {
+    const int v = visible_size, ys = encoder->stride, zs = decoder->stride;
+    for (int r = 0; r < n; r += DenseBatchRows) {
+        int rows = std::min(DenseBatchRows, n - r);
+        for (int k = 0; k < rows; ++k)::normalize(X + (size_t) (r + k) * v, min_v, max_v, batch_x + k * v, v);
+        denseForwardRows(encoder->activation, encoder->kernels, encoder->W, encoder->bias, batch_x, v, batch_y, ys,
+                         encoder->sum, v, hidden_size, ys, rows);
+        denseForwardRows(decoder->activation, decoder->kernels, decoder->W, decoder->bias, batch_y, ys, batch_z, zs,
+                         decoder->sum, hidden_size, v, zs, rows);
+        for (int k = 0; k < rows; ++k)errors[r + k] = RMSE(batch_x + k * v, batch_z + k * zs, v);
+    }
+}
+
+template<class Activation>
+void BasicAE<Activation>::trainMiniBatch(const double *X, int n, double *errors) {
+    const int v = visible_size, ys = encoder->stride, zs = decoder->stride, gs = std::max(ys, zs);
+    for (int r = 0; r < n; r += DenseBatchRows) {
+        int rows = std::min(DenseBatchRows, n - r);
+        for (int k = 0; k < rows; ++k)::normalize(X + (size_t) (r + k) * v, min_v, max_v, batch_x + k * v, v);
+        denseForwardRows(encoder->activation, encoder->kernels, encoder->W, encoder->bias, batch_x, v, batch_y, ys,
+                         encoder->sum, v, hidden_size, ys, rows);
+        denseForwardRows(decoder->activation, decoder->kernels, decoder->W, decoder->bias, batch_y, ys, batch_z, zs,
+                         decoder->sum, hidden_size, v, zs, rows);
+        for (int k = 0; k < rows; ++k) {
+            errors[r + k] = RMSE(batch_x + k * v, batch_z + k * zs, v);
+            for (int i = 0; i < v; ++i)batch_g[k * gs + i] = batch_x[k * v + i] - batch_z[k * zs + i];
+        }
+        denseBackPropagationRows(decoder->activation, decoder->kernels, decoder->W, decoder->bias, batch_y, ys,
+                                 batch_z, batch_g, gs, hidden_size, v, zs, decoder->learning_rate, rows);
+        denseBackPropagationRows(encoder->activation, encoder->kernels, encoder->W, encoder->bias, batch_x, v,
+                                 batch_y, batch_g, gs, v, hidden_size, ys, encoder->learning_rate, rows, false);
+    }
+}
+
 // 0-1 normalization, the result is saved in tmp_x
-void AE::normalize(const double *x) {
-    for (int i = 0; i < visible_size; ++i) {
-        min_v[i] = std::min(x[i], min_v[i]);
-        max_v[i] = std::max(x[i], max_v[i]);
-        tmp_x[i] = (x[i] - min_v[i]) / (max_v[i] - min_v[i] + 1e-13);
+template<class Activation>
+void BasicAE<Activation>::normalize(const double *x) {
+    ::normalize(x, min_v, max_v, tmp_x, visible_size);
+}
+
+
+// The arena holds the blocks of each autoencoder one after the other, every block from a cache line
+template<class Activation>
+BasicAEEnsemble<Activation>::BasicAEEnsemble(const std::vector<int> &visibleSizes, const std::vector<int> &hiddenSizes,
+                                             double _learning_rate) {
+    learning_rate = _learning_rate;
+    members.resize(visibleSizes.size());
+    std::vector<size_t> offsets;
+    size_t size = 0;
+    auto block = [&](size_t count) {
+        offsets.push_back(size);
+        size += (count + DenseLanes - 1) / DenseLanes * DenseLanes;
+    };
+    for (size_t m = 0; m < members.size(); ++m) {
+        int v = visibleSizes[m], h = hiddenSizes[m];
+        int vs = (v + DenseLanes - 1) / DenseLanes * DenseLanes, hs = (h + DenseLanes - 1) / DenseLanes * DenseLanes;
+        inputOffsets.push_back(inputSize);
+        inputSize += v;
+        // In the order of a pass: normalization, encoder, decoder, then the buffers
+        block(v);
+        block(v);
+        block((size_t) v * hs);
+        block(hs);
+        block((size_t) h * vs);
+        block(vs);
+        block((size_t) DenseBatchRows * vs);
+        block((size_t) DenseBatchRows * hs);
+        block((size_t) DenseBatchRows * vs);
+        block((size_t) DenseBatchRows * std::max(hs, vs));
+        block((size_t) DenseBatchRows * std::max(hs, vs));
+    }
+    arena = newPadded(size);
+    groupStarts = {0, (int) members.size()};
+
+    size_t next = 0;
+    auto at = [&]() { return arena + offsets[next++]; };
+    for (size_t m = 0; m < members.size(); ++m) {
+        Member &p = members[m];
+        AEArrays &a = p.arrays;
+        a.visible = visibleSizes[m];
+        a.hidden = hiddenSizes[m];
+        a.visibleStride = (a.visible + DenseLanes - 1) / DenseLanes * DenseLanes;
+        a.hiddenStride = (a.hidden + DenseLanes - 1) / DenseLanes * DenseLanes;
+        a.min_v = at();
+        a.max_v = at();
+        a.encoderW = at();
+        a.encoderBias = at();
+        a.decoderW = at();
+        a.decoderBias = at();
+        p.x = at();
+        p.y = at();
+        p.z = at();
+        p.sum = at();
+        p.g = at();
+        p.encoderKernels = kernelsFor(a.hidden);
+        p.decoderKernels = kernelsFor(a.visible);
+        p.fusedReconstruct = fusedAE ? FusedAEKernels<Activation>::get(a.visible, a.hidden, denseLevel) : nullptr;
+
+        for (int i = 0; i < a.visible; ++i) {
+            a.min_v[i] = 1e20;
+            a.max_v[i] = -1e20;
+        }
+        // Like the encoder and then the decoder of a BasicAE
+        double val = 1.0 / a.hidden;
+        for (int i = 0; i < a.visible; ++i)
+            for (int j = 0; j < a.hidden; ++j)a.encoderW[(size_t) i * a.hiddenStride + j] = rand_uniform(-val, val);
+        val = 1.0 / a.visible;
+        for (int i = 0; i < a.hidden; ++i)
+            for (int j = 0; j < a.visible; ++j)a.decoderW[(size_t) i * a.visibleStride + j] = rand_uniform(-val, val);
     }
 }
+
+template<class Activation>
+BasicAEEnsemble<Activation>::~BasicAEEnsemble() {
+    for (WorkerThread *worker: workers)delete worker;
+    alignedFree(arena);
+}
+
+// Like BasicAE::reconstruct
+template<class Activation>
+double BasicAEEnsemble<Activation>::reconstructMember(Member &m, const double *x) {
+    if (m.fusedReconstruct != nullptr)return m.fusedReconstruct(m.arrays, x);
+    AEArrays &a = m.arrays;
+    ::normalize(x, a.min_v, a.max_v, m.x, a.visible);
+    denseForward(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, m.y, m.sum, a.visible, a.hidden,
+                 a.hiddenStride);
+    denseForward(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, m.z, m.sum, a.hidden, a.visible,
+                 a.visibleStride);
+    return RMSE(m.x, m.z, a.visible);
+}
+
+// Like BasicAE::train, the outputs of the layers are their saved values. The encoder has no previous layer
+template<class Activation>
+double BasicAEEnsemble<Activation>::trainMember(Member &m, const double *x) {
+    AEArrays &a = m.arrays;
+    ::normalize(x, a.min_v, a.max_v, m.x, a.visible);
+    denseForward(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, m.y, m.sum, a.visible, a.hidden,
+                 a.hiddenStride);
+    denseForward(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, m.z, m.sum, a.hidden, a.visible,
+                 a.visibleStride);
+    double error = RMSE(m.x, m.z, a.visible);
+
+    for (int i = 0; i < a.visible; ++i)m.g[i] = m.x[i] - m.z[i];
+    denseBackPropagation(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, m.z, m.g, a.hidden,
+                         a.visible, a.visibleStride, learning_rate);
+    denseBackPropagation(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, m.y, m.g, a.visible,
+                         a.hidden, a.hiddenStride, learning_rate, false);
+    return error;
+}
+
+// Like BasicAE::reconstructBatch
+template<class Activation>
+void BasicAEEnsemble<Activation>::reconstructRows(Member &m, const double *X, int rows, double *errors) {
+    AEArrays &a = m.arrays;
+    const int hs = a.hiddenStride, vs = a.visibleStride;
+    for (int k = 0; k < rows; ++k)::normalize(X + (size_t) k * inputSize, a.min_v, a.max_v, m.x + k * vs, a.visible);
+    denseForwardRows(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, vs, m.y, hs, m.sum, a.visible,
+                     a.hidden, hs, rows);
+    denseForwardRows(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, hs, m.z, vs, m.sum, a.hidden,
+                     a.visible, vs, rows);
+    for (int k = 0; k < rows; ++k)errors[k * members.size()] = RMSE(m.x + k * vs, m.z + k * vs, a.visible);
+}
+
+// Like BasicAE::trainMiniBatch
+template<class Activation>
+void BasicAEEnsemble<Activation>::trainRows(Member &m, const double *X, int rows, double *errors) {
+    AEArrays &a = m.arrays;
+    const int hs = a.hiddenStride, vs = a.visibleStride, gs = std::max(hs, vs);
+    for (int k = 0; k < rows; ++k)::normalize(X + (size_t) k * inputSize, a.min_v, a.max_v, m.x + k * vs, a.visible);
+    denseForwardRows(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, vs, m.y, hs, m.sum, a.visible,
+                     a.hidden, hs, rows);
+    denseForwardRows(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, hs, m.z, vs, m.sum, a.hidden,
+                     a.visible, vs, rows);
+    for (int k = 0; k < rows; ++k) {
+        const double *x = m.x + k * vs, *z = m.z + k * vs;
+        errors[k * members.size()] = RMSE(x, z, a.visible);
+        for (int i = 0; i < a.visible; ++i)m.g[k * gs + i] = x[i] - z[i];
+    }
+    denseBackPropagationRows(Activation(), m.decoderKernels, a.decoderW, a.decoderBias, m.y, hs, m.z, m.g, gs,
+                             a.hidden, a.visible, vs, learning_rate, rows);
+    denseBackPropagationRows(Activation(), m.encoderKernels, a.encoderW, a.encoderBias, m.x, vs, m.y, m.g, gs,
+                             a.visible, a.hidden, hs, learning_rate, rows, false);
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::reconstruct(const double *x, double *errors) {
+    runBatch(x, 1, errors, Reconstruct);
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::train(const double *x, double *errors) {
+    runBatch(x, 1, errors, Train);
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::reconstructBatch(const double *X, int n, double *errors) {
+    runBatch(X, n, errors, Reconstruct);
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::trainBatch(const double *X, int n, double *errors) {
+    runBatch(X, n, errors, Train);
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::trainMiniBatch(const double *X, int n, double *errors) {
+    runBatch(X, n, errors, TrainMiniBatch);
+}
+
+// A single row is reconstructed with the fused kernel, more rows DenseBatchRows at a time
+template<class Activation>
+void BasicAEEnsemble<Activation>::runMembers(int first, int last, const double *X, int n, double *errors,
+                                             Pass pass) {
+    int count = members.size();
+    for (int m = first; m < last; ++m) {
+        Member &member = members[m];
+        const double *x = X + inputOffsets[m];
+        if (pass == Train) {
+            for (int i = 0; i < n; ++i, x += inputSize)errors[(size_t) i * count + m] = trainMember(member, x);
+            continue;
+        }
+        for (int i = 0; i < n; i += DenseBatchRows) {
+            int rows = std::min(DenseBatchRows, n - i);
+            const double *rowsX = x + (size_t) i * inputSize;
+            double *rowsErrors = errors + (size_t) i * count + m;
+            if (pass == TrainMiniBatch)trainRows(member, rowsX, rows, rowsErrors);
+            else if (rows == 1)*rowsErrors = reconstructMember(member, rowsX);
+            else reconstructRows(member, rowsX, rows, rowsErrors);
+        }
+    }
+}
+
+template<class Activation>
+void BasicAEEnsemble<Activation>::runGroup(void *job) {
+    GroupJob *j = static_cast<GroupJob *>(job);
+    j->ensemble->runMembers(j->first, j->last, j->X, j->n, j->errors, j->pass);
+}
+
+// The groups after the first go to the workers, the caller runs the first one
+template<class Activation>
+void BasicAEEnsemble<Activation>::runBatch(const double *X, int n, double *errors, Pass pass) {
+    if (workers.empty()) {
+        runMembers(0, members.size(), X, n, errors, pass);
+        return;
+    }
+    for (size_t g = 0; g < jobs.size(); ++g)
+        jobs[g] = GroupJob{this, groupStarts[g], groupStarts[g + 1], X, n, errors, pass};
+    for (size_t g = 1; g < jobs.size(); ++g)workers[g - 1]->submit(runGroup, &jobs[g]);
+    runGroup(&jobs[0]);
+    for (WorkerThread *worker: workers)worker->wait();
+}
+
+// The work of an autoencoder is about the size of its weights, the groups are cut where the work so far
+// passes the next share of the total
+template<class Activation>
+void BasicAEEnsemble<Activation>::setThreads(int threads) {
+    int count = members.size();
+    threads = std::max(1, std::min(threads, count));
+    for (WorkerThread *worker: workers)delete worker;
+    workers.clear();
+    for (int t = 1; t < threads; ++t)workers.push_back(new WorkerThread());
+    jobs.resize(threads);
+
+    std::vector<double> work(count);
+    double total = 0;
+    for (int m = 0; m < count; ++m) {
+        const AEArrays &a = members[m].arrays;
+        work[m] = 2.0 * a.visible * a.hidden + a.visible + a.hidden;
+        total += work[m];
+    }
+    groupStarts.assign(1, 0);
+    double done = 0;
+    for (int m = 0; m < count; ++m) {
+        done += work[m];
+        // Every group keeps at least one autoencoder
+        int groups = groupStarts.size();
+        if (groups < threads && done >= total * groups / threads && count - (m + 1) >= threads - groups)
+            groupStarts.push_back(m + 1);
+    }
+    while ((int) groupStarts.size() < threads)groupStarts.push_back(count - (threads - (int) groupStarts.size()));
+    groupStarts.push_back(count);
+}
+
+template class BasicDense<PointerActivation>;
+template class BasicDense<SigmoidActivation>;
+template class BasicDense<ReLUActivation>;
+template class BasicDense<PReLUActivation>;
+template class BasicDense<ELUActivation>;
+
+template class BasicAE<SigmoidActivation>;
+template class BasicAE<ReLUActivation>;
+template class BasicAE<PReLUActivation>;
+template class BasicAE<ELUActivation>;
+
+template class BasicAEEnsemble<SigmoidActivation>;
+template class BasicAEEnsemble<ReLUActivation>;
+template class BasicAEEnsemble<PReLUActivation>;
+template class BasicAEEnsemble<ELUActivation>;
@@ -0,0 +1,448 @@
+/**
+ * @brief Native reader for libpcap and pcapng capture files.
+ */
+#include "../include/pcapReader.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+
+// Magic numbers of the two file formats
+static const uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+static const uint32_t PCAPNG_SHB = 0x0A0D0D0A;
+static const uint32_t PCAPNG_BYTE_ORDER = 0x1A2B3C4D;
+
+// pcapng block types
+static const uint32_t PCAPNG_IDB = 1;
+static const uint32_t PCAPNG_PB = 2;
+static const uint32_t PCAPNG_SPB = 3;
+static const uint32_t PCAPNG_EPB = 6;
+
+// Link types
+static const uint32_t LINK_NULL = 0;
+static const uint32_t LINK_ETHERNET = 1;
+static const uint32_t LINK_RAW = 101;
+static const uint32_t LINK_LOOP = 108;
+static const uint32_t LINK_SLL = 113;
+static const uint32_t LINK_IPV4 = 228;
+static const uint32_t LINK_IPV6 = 229;
+static const uint32_t LINK_SLL2 = 276;
+
+// The largest frame libpcap captures (MAXIMUM_SNAPLEN), a longer record or block is corrupt
+static const uint32_t MAX_CAPTURE_LENGTH = 262144;
+
+static inline uint32_t byteSwap32(uint32_t x) {
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+// Big-endian (network order) reads for the protocol headers
+static inline uint16_t net16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+// Convert "sec.frac" into a double exactly as strtod would parse tshark's frame.time_epoch,
+// so that the timestamps (and thus all the decay factors) are bit-identical to the tshark path
+static double toEpoch(uint64_t sec, uint64_t frac, int decimals) {
+    char buf[20 + 1 + 19 + 1]; // the largest uint64_t, the point, 19 decimals at most and the NUL
+    decimals = std::min(std::max(decimals, 0), 19); // the resolutions give 0-19, the bound is for the compiler
+    std::snprintf(buf, sizeof(buf), "%llu.%0*llu", (unsigned long long) sec, decimals, (unsigned long long) frac);
+    return std::strtod(buf, nullptr);
+}
+
+
+void PcapPacket::clear() {
+    hasEth = hasIPv4 = hasIPv6 = hasTCP = hasUDP = hasICMP = hasARP = hasARPIPv4 = false;
+}
+
+int formatMAC(const uint8_t *mac, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < 6; ++i) {
+        out[i * 3] = hex[mac[i] >> 4];
+        out[i * 3 + 1] = hex[mac[i] & 15];
+        out[i * 3 + 2] = ':';
+    }
+    out[17] = '\0';
+    return 17;
+}
+
+int formatIPv4(const uint8_t *ip, char *out) {
+    return std::sprintf(out, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+int formatIPv6(const uint8_t *ip, char *out) {
+    uint16_t words[8];
+    for (int i = 0; i < 8; ++i)words[i] = net16(ip + i * 2);
+    // Find the longest run of zero words (at least two long), it is replaced by "::"
+    int bestBase = -1, bestLen = 0;
+    for (int i = 0; i < 8;) {
+        if (words[i] != 0) {
+            ++i;
+            continue;
+        }
+        int j = i;
+        while (j < 8 && words[j] == 0)++j;
+        if (j - i > bestLen) {
+            bestBase = i;
+            bestLen = j - i;
+        }
+        i = j;
+    }
+    if (bestLen < 2)bestBase = -1;
+
+    int len = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (i == bestBase) {
+            out[len++] = ':';
+            if (i == 0)out[len++] = ':';
+            i += bestLen - 1;
+            continue;
+        }
+        len += std::sprintf(out + len, "%x", words[i]);
+        if (i != 7)out[len++] = ':';
+    }
+    out[len] = '\0';
+    return len;
+}
+
+
+PcapReader::PcapReader(const char *filename) {
+    fp = std::fopen(filename, "rb");
+    if (fp == nullptr) {
+        std::fprintf(stderr, "\nPcapReader: File name is invalid!\n");
+        throw -1;
+    }
+    swapped = nanosecond = false;
+    linkType = 0;
+
+    // 12 bytes are enough to tell the formats apart and to read a pcapng section header
+    if (!readBytes(12)) {
+        std::fprintf(stderr, "\nPcapReader: File is too short!\n");
+        throw -1;
+    }
+    uint32_t magic;
+    std::memcpy(&magic, buffer.data(), 4);
+    if (magic == PCAPNG_SHB) {
+        isNg = true;
+        readSectionHeader();
+        return;
+    }
+
+    isNg = false;
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        swapped = false;
+    } else if (byteSwap32(magic) == PCAP_MAGIC_USEC || byteSwap32(magic) == PCAP_MAGIC_NSEC) {
+        swapped = true;
+        magic = byteSwap32(magic);
+    } else {
+        std::fprintf(stderr, "\nPcapReader: Not a pcap or pcapng file!\n");
+        throw -1;
+    }
+    nanosecond = magic == PCAP_MAGIC_NSEC;
+    // The rest of the global header: sigfigs(4), snaplen(4), network(4)
+    if (!readBytes(12)) {
+        std::fprintf(stderr, "\nPcapReader: Truncated file header!\n");
+        throw -1;
+    }
+    linkType = read32(buffer.data() + 8) & 0x0fffffff; // the upper bits may carry the FCS length
+}
+
+uint16_t PcapReader::read16(const uint8_t *p) const {
+    uint16_t x;
+    std::memcpy(&x, p, 2);
+    return swapped ? (uint16_t) ((x >> 8) | (x << 8)) : x;
+}
+
+uint32_t PcapReader::read32(const uint8_t *p) const {
+    uint32_t x;
+    std::memcpy(&x, p, 4);
+    return swapped ? byteSwap32(x) : x;
+}
+
+bool PcapReader::readBytes(size_t n) {
+    if (buffer.size() < n)buffer.resize(n);
+    return std::fread(buffer.data(), 1, n, fp) == n;
+}
+
+void PcapReader::readSectionHeader() {
+    // buffer: block type(4), block length(4), byte-order magic(4)
+    uint32_t order;
+    std::memcpy(&order, buffer.data() + 8, 4);
+    if (order == PCAPNG_BYTE_ORDER) swapped = false;
+    else if (byteSwap32(order) == PCAPNG_BYTE_ORDER) swapped = true;
+    else {
+        std::fprintf(stderr, "\nPcapReader: Bad pcapng byte-order magic!\n");
+        throw -1;
+    }
+    uint32_t length = read32(buffer.data() + 4);
+    // Skip the rest of the block, a new section starts with no interfaces
+    if (length < 12 || std::fseek(fp, length - 12, SEEK_CUR) != 0) {
+        std::fprintf(stderr, "\nPcapReader: Truncated section header!\n");
+        throw -1;
+    }
+    interfaces.clear();
+}
+
+uint32_t PcapReader::readBlock(uint32_t &length) {
+    while (true) {
+        if (!readBytes(8))return 0;
+        uint32_t type;
+        std::memcpy(&type, buffer.data(), 4);
+        if (type == PCAPNG_SHB) {
+            if (std::fread(buffer.data() + 8, 1, 4, fp) != 4)return 0;
+            readSectionHeader();
+            continue;
+        }
+        type = read32(buffer.data());
+        length = read32(buffer.data() + 4);
+        // corrupt block (the longest valid ones hold a frame of the largest capture and the options)
+        if (length < 12 || (length & 3) != 0 || length > MAX_CAPTURE_LENGTH * 16)return 0;
+        // Read the body and the trailing length, keeping the 8-byte header in front
+        if (buffer.size() < length)buffer.resize(length);
+        if (std::fread(buffer.data() + 8, 1, length - 8, fp) != length - 8)return 0;
+        return type;
+    }
+}
+
+void PcapReader::readInterface(uint32_t length) {
+    Interface itf;
+    itf.linkType = read16(buffer.data() + 8);
+    itf.units = 1000000; // default if_tsresol is microseconds
+    itf.decimals = 6;
+    // Options start after linktype(2), reserved(2), snaplen(4)
+    uint32_t pos = 16, end = length - 4;
+    while (pos + 4 <= end) {
+        uint16_t code = read16(buffer.data() + pos);
+        uint16_t len = read16(buffer.data() + pos + 2);
+        if (code == 0)break; // opt_endofopt
+        if (code == 9 && len >= 1 && pos + 5 <= end) { // if_tsresol
+            uint8_t v = buffer[pos + 4];
+            itf.units = 1;
+            if (v & 0x80) {
+                for (int i = 0; i < (v & 0x7f) && i < 63; ++i)itf.units <<= 1;
+                itf.decimals = -1;
+            } else {
+                for (int i = 0; i < v && i < 19; ++i)itf.units *= 10;
+                itf.decimals = v < 19 ? v : 19;
+            }
+        }
+        pos += 4 + ((len + 3u) & ~3u);
+    }
+    interfaces.push_back(itf);
+}
+
+bool PcapReader::nextPacket(PcapPacket &pkt) {
+    pkt.clear();
+    if (!isNg) {
+        // Record header: ts_sec(4), ts_usec(4), incl_len(4), orig_len(4)
+        if (!readBytes(16))return false;
+        uint32_t sec = read32(buffer.data());
+        uint32_t frac = read32(buffer.data() + 4);
+        uint32_t capLen = read32(buffer.data() + 8);
+        pkt.frameLen = read32(buffer.data() + 12);
+        pkt.timestamp = toEpoch(sec, frac, nanosecond ? 9 : 6);
+        // Like libpcap, a record longer than any capture is corrupt, and nothing after it can be found
+        if (capLen > MAX_CAPTURE_LENGTH) {
+            std::fprintf(stderr, "\nPcapReader: Corrupt record length %u, the rest of the file is skipped!\n", capLen);
+            return false;
+        }
+        if (!readBytes(capLen))return false;
+        decodeLink(linkType, buffer.data(), capLen, pkt);
+        return true;
+    }
+
+    uint32_t length = 0;
+    while (true) {
+        uint32_t type = readBlock(length);
+        if (type == 0)return false;
+        const uint8_t *body = buffer.data() + 8;
+        if (type == PCAPNG_IDB) {
+            readInterface(length);
+        } else if (type == PCAPNG_EPB || type == PCAPNG_PB) {
+            // EPB: interface(4), ts high(4), ts low(4), captured(4), original(4), data
+            // PB:  interface(2), drops(2), ts high(4), ts low(4), captured(4), original(4), data
+            if (length < 32)continue; // too short for the fields, corrupt
+            uint32_t itfId = type == PCAPNG_EPB ? read32(body) : read16(body);
+            if (itfId >= interfaces.size())continue;
+            const Interface &itf = interfaces[itfId];
+            uint64_t ts = ((uint64_t) read32(body + 4) << 32) | read32(body + 8);
+            uint32_t capLen = read32(body + 12);
+            if (capLen > length - 32)capLen = length - 32;
+            pkt.frameLen = read32(body + 16);
+            if (itf.decimals >= 0) pkt.timestamp = toEpoch(ts / itf.units, ts % itf.units, itf.decimals);
+            else pkt.timestamp = (double) (ts / itf.units) + (double) (ts % itf.units) / (double) itf.units;
+            decodeLink(itf.linkType, body + 20, capLen, pkt);
+            return true;
+        } else if (type == PCAPNG_SPB) {
+            // SPB: original(4), data; it has no timestamp and always belongs to interface 0
+            if (interfaces.empty() || length < 16)continue;
+            uint32_t capLen = read32(body);
+            pkt.frameLen = capLen;
+            if (capLen > length - 16)capLen = length - 16;
+            pkt.timestamp = 0;
+            decodeLink(interfaces[0].linkType, body + 4, capLen, pkt);
+            return true;
+        }
+        // Other blocks (name resolution, statistics, ...) are skipped
+    }
+}
+
+void PcapReader::decodeLink(uint32_t link, const uint8_t *p, uint32_t len, PcapPacket &pkt) {
+    switch (link) {
+        case LINK_ETHERNET:
+            if (len < 14)return;
+            pkt.hasEth = true;
+            std::memcpy(pkt.ethDst, p, 6);
+            std::memcpy(pkt.ethSrc, p + 6, 6);
+            // A value below 0x600 is an 802.3 length field (LLC frame), not an EtherType
+            if (net16(p + 12) >= 0x600)decodeEtherType(net16(p + 12), p + 14, len - 14, pkt);
+            return;
+        case LINK_RAW:
+        case LINK_IPV4:
+        case LINK_IPV6:
+            if (len < 1)return;
+            if ((p[0] >> 4) == 4)decodeIPv4(p, len, pkt);
+            else if ((p[0] >> 4) == 6)decodeIPv6(p, len, pkt);
+            return;
+        case LINK_SLL:
+            if (len < 16)return;
+            decodeEtherType(net16(p + 14), p + 16, len - 16, pkt);
+            return;
+        case LINK_SLL2:
+            if (len < 20)return;
+            decodeEtherType(net16(p), p + 20, len - 20, pkt);
+            return;
+        case LINK_NULL:
+        case LINK_LOOP: {
+            if (len < 4)return;
+            // The address family is in the byte order of the capturing host (LOOP: network order)
+            uint32_t family;
+            std::memcpy(&family, p, 4);
+            if (family > 0xffff)family = byteSwap32(family);
+            if (family == 2)decodeIPv4(p + 4, len - 4, pkt);
+            else if (family == 24 || family == 28 || family == 30)decodeIPv6(p + 4, len - 4, pkt);
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+void PcapReader::decodeEtherType(uint16_t type, const uint8_t *p, uint32_t len, PcapPacket &pkt) {
+    // Skip any number of 802.1Q / 802.1ad / QinQ tags
+    while ((type == 0x8100 || type == 0x88a8 || type == 0x9100) && len >= 4) {
+        type = net16(p + 2);
+        p += 4;
+        len -= 4;
+    }
+    if (type == 0x0800) {
+        decodeIPv4(p, len, pkt);
+    } else if (type == 0x86DD) {
+        decodeIPv6(p, len, pkt);
+    } else if (type == 0x0806) {
+        // htype(2), ptype(2), hlen(1), plen(1), opcode(2), addresses
+        if (len < 8 || pkt.hasARP)return;
+        pkt.hasARP = true;
+        pkt.arpOpcode = net16(p + 6);
+        if (net16(p + 2) == 0x0800 && p[4] == 6 && p[5] == 4 && len >= 28) {
+            pkt.hasARPIPv4 = true;
+            std::memcpy(pkt.arpSrcMAC, p + 8, 6);
+            std::memcpy(pkt.arpSrcIP, p + 14, 4);
+            std::memcpy(pkt.arpDstMAC, p + 18, 6);
+            std::memcpy(pkt.arpDstIP, p + 24, 4);
+        }
+    }
+}
+
+// Only the first occurrence of each field is kept (tshark -E occurrence=f), so for tunnels and ICMP errors
+// the outer addresses are reported while the ports come from the first transport header that is present
+void PcapReader::decodeIPv4(const uint8_t *p, uint32_t len, PcapPacket &pkt) {
+    if (len < 20 || (p[0] >> 4) != 4)return;
+    uint32_t ihl = (p[0] & 15u) * 4;
+    if (ihl < 20 || ihl > len)return;
+    if (!pkt.hasIPv4) {
+        pkt.hasIPv4 = true;
+        std::memcpy(pkt.ipv4Src, p + 12, 4);
+        std::memcpy(pkt.ipv4Dst, p + 16, 4);
+    }
+    // Non-first fragments carry no transport header (no IP reassembly is done)
+    if ((net16(p + 6) & 0x1fff) != 0)return;
+    uint32_t total = net16(p + 2);
+    if (total >= ihl && total < len)len = total; // drop the Ethernet padding
+    decodeTransport(p[9], p + ihl, len - ihl, pkt);
+}
+
+void PcapReader::decodeIPv6(const uint8_t *p, uint32_t len, PcapPacket &pkt) {
+    if (len < 40 || (p[0] >> 4) != 6)return;
+    if (!pkt.hasIPv6) {
+        pkt.hasIPv6 = true;
+        std::memcpy(pkt.ipv6Src, p + 8, 16);
+        std::memcpy(pkt.ipv6Dst, p + 24, 16);
+    }
+    uint32_t payload = net16(p + 4);
+    uint8_t next = p[6];
+    p += 40;
+    len -= 40;
+    if (payload < len)len = payload;
+    // Walk the extension headers
+    while (true) {
+        if (next == 0 || next == 43 || next == 60) { // hop-by-hop, routing, destination options
+            if (len < 8)return;
+            uint32_t extLen = (p[1] + 1u) * 8;
+            if (extLen > len)return;
+            next = p[0];
+            p += extLen;
+            len -= extLen;
+        } else if (next == 44) { // fragment
+            if (len < 8 || (net16(p + 2) & 0xfff8) != 0)return;
+            next = p[0];
+            p += 8;
+            len -= 8;
+        } else if (next == 51) { // authentication header
+            if (len < 8)return;
+            uint32_t extLen = (p[1] + 2u) * 4;
+            if (extLen > len)return;
+            next = p[0];
+            p += extLen;
+            len -= extLen;
+        } else break;
+    }
+    decodeTransport(next, p, len, pkt);
+}
+
+void PcapReader::decodeTransport(uint8_t proto, const uint8_t *p, uint32_t len, PcapPacket &pkt) {
+    switch (proto) {
+        case 6:  // tcp
+        case 17: // udp
+            if (len < 4 || pkt.hasTCP || pkt.hasUDP)return;
+            if (proto == 6) pkt.hasTCP = true;
+            else pkt.hasUDP = true;
+            pkt.srcPort = net16(p);
+            pkt.dstPort = net16(p + 2);
+            return;
+        case 1: // icmp
+            if (len < 4)return;
+            if (!pkt.hasICMP) {
+                pkt.hasICMP = true;
+                pkt.icmpType = p[0];
+                pkt.icmpCode = p[1];
+            }
+            // Error messages (unreachable, source quench, redirect, time exceeded, parameter problem)
+            // quote the offending IP header and the start of its transport header
+            if (len >= 8 && (p[0] == 3 || p[0] == 4 || p[0] == 5 || p[0] == 11 || p[0] == 12))
+                decodeIPv4(p + 8, len - 8, pkt);
+            return;
+        case 58: // icmpv6, only the errors are looked into (icmp.type is ICMPv4 only)
+            if (len >= 8 && p[0] < 128)decodeIPv6(p + 8, len - 8, pkt);
+            return;
+        case 4:  // IPv4 in IP
+            decodeIPv4(p, len, pkt);
+            return;
+        case 41: // IPv6 in IP
+            decodeIPv6(p, len, pkt);
+            return;
+        default:
+            return;
+    }
+}
@@ -5,11 +5,15 @@
 #include "../include/utils.h"
 
 #include <string>
+#include <cstring>
 #include <sstream>
 #include <iostream>
+#include <new>
+#include <algorithm>
 
 
-FILE *pcap2tcv(const char *filename) {
+// 生成调用tshark提取字段的命令 (不包含输出重定向)
+static std::string tsharkCommand(const char *filename, bool lineBuffered) {
 #ifdef WIN32
     const std::string tshark_path = "E:\\wireshark\\tshark.exe";
 #else
@@ -18,7 +22,14 @@ FILE *pcap2tcv(const char *filename) {
     const std::string field = "-e frame.time_epoch -e frame.len -e eth.src -e eth.dst -e ip.src -e ip.dst -e tcp.srcport -e tcp.dstport -e udp.srcport -e udp.dstport -e icmp.type -e icmp.code -e arp.opcode -e arp.src.hw_mac -e arp.src.proto_ipv4 -e arp.dst.hw_mac -e arp.dst.proto_ipv4 -e ipv6.src -e ipv6.dst";
 
     std::ostringstream out;
-    out << tshark_path << " -r \"" << filename << "\" -T fields " << field << " -E header=y -E occurrence=f > \"" << filename << ".tsv\"";
+    out << tshark_path << (lineBuffered ? " -l" : "") << " -r \"" << filename << "\" -T fields " << field
+        << " -E header=y -E occurrence=f";
+    return out.str();
+}
+
+FILE *pcap2tcv(const char *filename) {
+    std::ostringstream out;
+    out << tsharkCommand(filename, false) << " > \"" << filename << ".tsv\"";
     const std::string buf = out.str();
     std::cout << buf << std::endl;
 
@@ -30,15 +41,301 @@ FILE *pcap2tcv(const char *filename) {
     return fopen(tsv.c_str(), "r");
 }
 
+FILE *pcap2tcvPipe(const char *filename) {
+    // -l: tshark flushes every packet, otherwise its output sits in a 4KB stdio buffer before we see it
+    const std::string buf = tsharkCommand(filename, true);
+    std::cout << buf << std::endl;
+#ifdef WIN32
+    return _popen(buf.c_str(), "r");
+#else
+    return popen(buf.c_str(), "r");
+#endif
+}
+
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <malloc.h>
+#endif
+
+
+static inline int hexValue(char c) {
+    if (c >= '0' && c <= '9')return c - '0';
+    if (c >= 'a' && c <= 'f')return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')return c - 'A' + 10;
+    return -1;
+}
+
+bool parseMAC(StrView s, uint64_t &mac) {
+    if (s.size != 17)return false;
+    mac = 0;
+    for (int i = 0; i < 6; ++i) {
+        int h = hexValue(s.data[i * 3]), l = hexValue(s.data[i * 3 + 1]);
+        if (h < 0 || l < 0 || (i < 5 && s.data[i * 3 + 2] != ':'))return false;
+        mac = (mac << 8) | (uint64_t) (h << 4 | l);
+    }
+    return true;
+}
+
+bool parseIPv4(StrView s, uint32_t &ip) {
+    ip = 0;
+    size_t pos = 0;
+    for (int part = 0; part < 4; ++part) {
+        if (part > 0) {
+            if (pos >= s.size || s.data[pos] != '.')return false;
+            ++pos;
+        }
+        size_t begin = pos;
+        uint32_t v = 0;
+        while (pos < s.size && s.data[pos] >= '0' && s.data[pos] <= '9' && pos - begin < 3)
+            v = v * 10 + (s.data[pos++] - '0');
+        if (pos == begin || v > 255)return false;
+        ip = (ip << 8) | v;
+    }
+    return pos == s.size;
+}
+
+bool parseIPv6(StrView s, uint64_t ip[2]) {
+    uint16_t words[8] = {0};
+    int n = 0, gap = -1; // gap: index of the words where "::" is
+    size_t pos = 0;
+    if (s.size >= 2 && s.data[0] == ':' && s.data[1] == ':') {
+        gap = 0;
+        pos = 2;
+    }
+    while (pos < s.size) {
+        if (n >= 8)return false;
+        size_t begin = pos;
+        uint32_t v = 0;
+        while (pos < s.size && hexValue(s.data[pos]) >= 0 && pos - begin < 4)v = v * 16 + hexValue(s.data[pos++]);
+        if (pos < s.size && s.data[pos] == '.') { // an embedded IPv4 address ends the address
+            uint32_t v4;
+            if (n > 6 || !parseIPv4(StrView{s.data + begin, s.size - begin}, v4))return false;
+            words[n++] = (uint16_t) (v4 >> 16);
+            words[n++] = (uint16_t) v4;
+            pos = s.size;
+            break;
+        }
+        if (pos == begin)return false;
+        words[n++] = (uint16_t) v;
+        if (pos == s.size)break;
+        if (s.data[pos] != ':')return false;
+        ++pos;
+        if (pos < s.size && s.data[pos] == ':') {
+            if (gap >= 0)return false;
+            gap = n;
+            ++pos;
+        } else if (pos == s.size)return false; // a single trailing ':'
+    }
+    if (gap < 0 && n != 8)return false;
+    if (gap >= 0) { // move the words after "::" to the end
+        if (n == 8)return false;
+        int tail = n - gap;
+        for (int i = 0; i < tail; ++i)words[7 - i] = words[n - 1 - i];
+        for (int i = gap; i < 8 - tail; ++i)words[i] = 0;
+    }
+    ip[0] = ip[1] = 0;
+    for (int i = 0; i < 4; ++i)ip[0] = (ip[0] << 16) | words[i];
+    for (int i = 4; i < 8; ++i)ip[1] = (ip[1] << 16) | words[i];
+    return true;
+}
+
+void hashText(StrView s, uint64_t h[2]) {
+    h[0] = 14695981039346656037ull;
+    h[1] = 9650029242287828579ull;
+    for (size_t i = 0; i < s.size; ++i) {
+        h[0] = (h[0] ^ (unsigned char) s.data[i]) * 1099511628211ull;
+        h[1] = (h[1] ^ (unsigned char) s.data[i]) * 0xc6a4a7935bd1e995ull;
+    }
+}
+
+
+// 只读地将整个文件映射到内存, 失败(或者平台不支持, 或者文件为空)返回nullptr
+const char *mapFileReadOnly(const char *filename, size_t &size) {
+#ifdef WIN32
+    return nullptr;
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // 映射建立后就不再需要文件描述符
+    if (p == MAP_FAILED)return nullptr;
+    madvise(p, st.st_size, MADV_SEQUENTIAL); // 顺序读取, 让内核提前预读
+    size = st.st_size;
+    return static_cast<const char *>(p);
+#endif
+}
+
+void unmapFile(const char *data, size_t size) {
+#ifndef WIN32
+    if (data != nullptr) munmap(const_cast<char *>(data), size);
+#endif
+}
+
+void *alignedAlloc(size_t size, size_t alignment) {
+    void *p = nullptr;
+#ifdef WIN32
+    p = _aligned_malloc(size, alignment);
+#else
+    if (posix_memalign(&p, alignment, size) != 0)p = nullptr;
+#endif
+    if (p == nullptr)throw std::bad_alloc();
+    return p;
+}
+
+void alignedFree(void *p) {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+
+SlabPool::SlabPool(size_t objectSize, size_t alignment, size_t slabObjects) {
+    // Every object starts on an alignment boundary and can hold the link of the free list
+    if (objectSize < sizeof(void *))objectSize = sizeof(void *);
+    this->objectSize = (objectSize + alignment - 1) / alignment * alignment;
+    this->alignment = alignment;
+    this->slabObjects = slabObjects > 0 ? slabObjects : 1;
+}
+
+void SlabPool::grow() {
+    size_t size = objectSize * slabObjects;
+    cursor = static_cast<char *>(alignedAlloc(size, alignment));
+    end = cursor + size;
+    slabs.push_back(cursor);
+    std::pair<const char *, size_t> slab(cursor, slabs.size() - 1);
+    byAddress.insert(std::upper_bound(byAddress.begin(), byAddress.end(), slab), slab);
+    liveBits.resize((slabs.size() * slabObjects + 63) / 64);
+    ++stats.slabs;
+    stats.bytes += size;
+}
+
+size_t SlabPool::indexOf(const void *p) const {
+    // The last slab that starts at or before p holds it
+    std::pair<const char *, size_t> key(static_cast<const char *>(p), SIZE_MAX);
+    const std::pair<const char *, size_t> &slab = *(std::upper_bound(byAddress.begin(), byAddress.end(), key) - 1);
+    return slab.second * slabObjects + (key.first - slab.first) / objectSize;
+}
+
+void SlabPool::findLive() {
+    std::fill(liveBits.begin(), liveBits.end(), ~(uint64_t) 0);
+    for (void *p = freeList; p != nullptr; p = *static_cast<void **>(p)) {
+        size_t i = indexOf(p);
+        liveBits[i / 64] &= ~((uint64_t) 1 << i % 64);
+    }
+}
+
+void SlabPool::save(SnapshotWriter &out) const {
+    size_t count = used();
+    out.put<uint64_t>(objectSize);
+    out.put<uint64_t>(count);
+    out.write(liveBits.data(), sizeof(uint64_t) * ((count + 63) / 64));
+    for (size_t i = 0; i < slabs.size(); ++i)
+        out.write(slabs[i], objectSize * std::min(slabObjects, count - i * slabObjects));
+    out.align();
+}
+
+void SlabPool::restore(SnapshotReader &in) {
+    size_t size = in.get<uint64_t>(), count = in.get<uint64_t>();
+    if (size != objectSize || !slabs.empty() || count > SIZE_MAX / objectSize) {
+        std::fprintf(stderr, "\nSlabPool: the image does not fit the pool!\n");
+        throw -1;
+    }
+    const uint64_t *bits = static_cast<const uint64_t *>(in.take(sizeof(uint64_t) * ((count + 63) / 64)));
+    const char *image = static_cast<const char *>(in.take(objectSize * count));
+    for (size_t done = 0; done < count;) {
+        grow();
+        size_t n = std::min(slabObjects, count - done);
+        std::memcpy(cursor, image + done * objectSize, n * objectSize);
+        cursor += n * objectSize;
+        done += n;
+    }
+    in.align();
+    // The objects that were free go back to the free list, the first of them on top
+    std::copy(bits, bits + (count + 63) / 64, liveBits.begin());
+    for (size_t i = count; i-- > 0;) {
+        if (isLive(i)) {
+            ++stats.live;
+            continue;
+        }
+        *static_cast<void **>(object(i)) = freeList;
+        freeList = object(i);
+    }
+    stats.allocations += stats.live;
+    if (stats.live > stats.peak)stats.peak = stats.live;
+}
 
-// 读取并预处理下一行, 如果读到了最后一行, 返回false
+SlabPool::~SlabPool() {
+    for (void *slab : slabs)alignedFree(slab);
+}
+
+// 将文件映射到内存, 失败(或者平台不支持)返回false, 这时使用普通的文件读取
+bool TsvReader::mapFile(const char *filename) {
+    mapped = mapFileReadOnly(filename, mappedSize);
+    mappedPos = 0;
+    return mapped != nullptr;
+}
+
+// 从fp中读取一整行到buffer中, 行比buffer长的时候扩容接着读
+bool TsvReader::readLine() {
+    if (std::fgets(buffer, bufferSize, fp) == nullptr) return false;
+    size_t len = std::strlen(buffer);
+    while (len + 1 == (size_t) bufferSize && buffer[len - 1] != '\n') {
+        char *bigger = new char[bufferSize * 2];
+        std::memcpy(bigger, buffer, len + 1);
+        delete[] buffer;
+        buffer = bigger;
+        bufferSize *= 2;
+        if (std::fgets(buffer + len, bufferSize - len, fp) == nullptr)break;
+        len += std::strlen(buffer + len);
+    }
+    line = buffer;
+    return true;
+}
+
+// 读取映射内存中的下一行, line直接指向映射的内存
+bool TsvReader::nextMappedLine() {
+    if (mappedPos >= mappedSize)return false;
+    const char *begin = mapped + mappedPos;
+    size_t rest = mappedSize - mappedPos;
+    const char *end = static_cast<const char *>(std::memchr(begin, '\n', rest));
+    if (end != nullptr) {
+        line = begin;
+        mappedPos += end - begin + 1;
+        return true;
+    }
+    // 最后一行没有换行符, 复制到buffer里面补上结束符, 防止解析时越过映射的末尾
+    if (rest + 1 > (size_t) bufferSize) {
+        delete[] buffer;
+        bufferSize = rest + 1;
+        buffer = new char[bufferSize];
+    }
+    std::memcpy(buffer, begin, rest);
+    buffer[rest] = '\0';
+    line = buffer;
+    mappedPos = mappedSize;
+    return true;
+}
+
+// 读取并预处理下一行, 如果读到了最后一行, 返回0
 int TsvReader::nextLine() {
     // 如果读到文件末尾, 返回0列
-    if (std::fgets(buffer, BufferSize, fp) == nullptr) return 0;
+    if (mapped != nullptr ? !nextMappedLine() : !readLine()) return 0;
     id.resize(1, 0); // 第0列从0开始的
-    for (int i = 1; buffer[i] != '\n' && buffer[i] != '\r' && buffer[i] != '\0'; ++i) {
+    for (int i = 0; line[i] != '\n' && line[i] != '\r' && line[i] != '\0'; ++i) {
         // 寻找分隔符, 找到下一个列的初始位置
-        if (buffer[i] == delimitor) {
+        if (line[i] == delimitor) {
             id.push_back(i + 1);
         }
     }
@@ -47,10 +344,212 @@ int TsvReader::nextLine() {
 
 // 将第col列变成string返回
 std::string TsvReader::getString(int col) {
-    std::string ans;
-    ans.clear();
-    int now = id[col];
-    while (buffer[now] != delimitor && buffer[now] != '\r' && buffer[now] != '\n' && buffer[now] != '\0')
-        ans.push_back(buffer[now++]);
-    return ans;
+    return getView(col).toString();
+}
+
+TsvReader::~TsvReader() {
+    if (fp != nullptr) {
+#ifdef WIN32
+        if (isPipe) _pclose(fp);
+#else
+        if (isPipe) pclose(fp);
+#endif
+        else std::fclose(fp);
+    }
+    unmapFile(mapped, mappedSize);
+    delete[] buffer;
+}
+
+
+FeatureBinReader::FeatureBinReader(const char *filename) {
+    FeatureBinHeader header;
+    mapped = mapFileReadOnly(filename, mappedSize);
+    if (mapped != nullptr) {
+        if (mappedSize < sizeof(header)) {
+            std::fprintf(stderr, "\nFeatureBinReader: File is too short!\n");
+            unmapFile(mapped, mappedSize);
+            throw -1;
+        }
+        std::memcpy(&header, mapped, sizeof(header));
+    } else { // 不能映射的时候逐行fread
+        fp = std::fopen(filename, "rb");
+        if (fp == nullptr || std::fread(&header, sizeof(header), 1, fp) != 1) {
+            std::fprintf(stderr, "\nFeatureBinReader: File name is invalid!\n");
+            if (fp != nullptr) std::fclose(fp);
+            throw -1;
+        }
+    }
+    if (std::memcmp(header.magic, FeatureBinHeader::Magic, sizeof(header.magic)) != 0 ||
+        header.version != FeatureBinHeader::Version || header.vectorSize == 0) {
+        std::fprintf(stderr, "\nFeatureBinReader: Not a FeatureBIN file!\n");
+        unmapFile(mapped, mappedSize);
+        if (fp != nullptr) std::fclose(fp);
+        throw -1;
+    }
+    vectorSize = header.vectorSize;
+    lambdas.resize(header.lambdaCount);
+    size_t dataOffset = sizeof(header) + sizeof(double) * header.lambdaCount;
+    if (mapped != nullptr) {
+        if (mappedSize < dataOffset) {
+            std::fprintf(stderr, "\nFeatureBinReader: Truncated header!\n");
+            unmapFile(mapped, mappedSize);
+            throw -1;
+        }
+        std::memcpy(lambdas.data(), mapped + sizeof(header), sizeof(double) * header.lambdaCount);
+        // 头部的大小是8的倍数, 映射的起始地址按页对齐, 所以可以直接当作double数组使用
+        rows = reinterpret_cast<const double *>(mapped + dataOffset);
+        rowCount = (mappedSize - dataOffset) / (sizeof(double) * vectorSize); // 不完整的最后一行被忽略
+    } else {
+        if (std::fread(lambdas.data(), sizeof(double), header.lambdaCount, fp) != header.lambdaCount) {
+            std::fprintf(stderr, "\nFeatureBinReader: Truncated header!\n");
+            std::fclose(fp);
+            throw -1;
+        }
+        buffer = new double[vectorSize];
+    }
+}
+
+const double *FeatureBinReader::next() {
+    if (mapped != nullptr) {
+        if (nowRow >= rowCount)return nullptr;
+        return rows + (nowRow++) * vectorSize;
+    }
+    if (std::fread(buffer, sizeof(double), vectorSize, fp) != (size_t) vectorSize)return nullptr;
+    ++nowRow;
+    return buffer;
+}
+
+const double *FeatureBinReader::nextBlock(int maxNum, int &num) {
+    if (mapped == nullptr) { // 不能映射的时候一次只有一行
+        const double *row = next();
+        num = row == nullptr ? 0 : 1;
+        return row;
+    }
+    size_t rest = rowCount - nowRow;
+    num = rest < (size_t) maxNum ? (int) rest : maxNum;
+    const double *block = rows + nowRow * vectorSize;
+    nowRow += num;
+    return block;
+}
+
+FeatureBinReader::~FeatureBinReader() {
+    unmapFile(mapped, mappedSize);
+    if (fp != nullptr) std::fclose(fp);
+    delete[] buffer;
+}
+
+const char FeatureBinHeader::Magic[8] = {'K', 'I', 'T', 'S', 'F', 'E', 'A', 'T'};
+
+FeatureBinWriter::FeatureBinWriter(const char *filename, int vector_size, const std::vector<double> &lambdas) {
+    fp = std::fopen(filename, "wb");
+    if (fp == nullptr) {
+        std::fprintf(stderr, "\nFeatureBinWriter: file open Error!\n");
+        throw -1;
+    }
+    vectorSize = vector_size;
+    FeatureBinHeader header;
+    std::memcpy(header.magic, FeatureBinHeader::Magic, sizeof(header.magic));
+    header.version = FeatureBinHeader::Version;
+    header.vectorSize = vector_size;
+    header.lambdaCount = lambdas.size();
+    header.reserved = 0;
+    std::fwrite(&header, sizeof(header), 1, fp);
+    std::fwrite(lambdas.data(), sizeof(double), lambdas.size(), fp);
+}
+
+
+const char SnapshotHeader::Magic[8] = {'K', 'I', 'T', 'S', 'S', 'N', 'A', 'P'};
+
+SnapshotWriter::SnapshotWriter(const char *filename, size_t bufferSize) : path(filename), capacity(bufferSize) {
+    tempPath = path + ".tmp";
+    fp = std::fopen(tempPath.c_str(), "wb");
+    if (fp == nullptr) {
+        std::fprintf(stderr, "\nSnapshotWriter: file open Error!\n");
+        throw -1;
+    }
+    // Our own buffer is the only one, stdio does not allocate one later
+    std::setvbuf(fp, nullptr, _IONBF, 0);
+    buffer = new char[capacity];
+}
+
+void SnapshotWriter::flush() {
+    if (used > 0 && std::fwrite(buffer, 1, used, fp) != used)failed = true;
+    used = 0;
+}
+
+void SnapshotWriter::write(const void *p, size_t n) {
+    const char *data = static_cast<const char *>(p);
+    written += n;
+    while (n > 0) {
+        if (used == capacity)flush();
+        size_t k = capacity - used < n ? capacity - used : n;
+        std::memcpy(buffer + used, data, k);
+        used += k;
+        data += k;
+        n -= k;
+    }
+}
+
+void SnapshotWriter::align() {
+    static const char zeros[8] = {0};
+    write(zeros, (8 - written % 8) % 8);
+}
+
+bool SnapshotWriter::finish() {
+    flush();
+    if (std::fclose(fp) != 0)failed = true;
+    fp = nullptr;
+    finished = true;
+    if (!failed) {
+#ifdef WIN32
+        std::remove(path.c_str()); // rename does not replace an existing file there
+#endif
+        failed = std::rename(tempPath.c_str(), path.c_str()) != 0;
+    }
+    if (failed)std::remove(tempPath.c_str());
+    return !failed;
+}
+
+void SnapshotWriter::detach() {
+    if (fp != nullptr)std::fclose(fp);
+    fp = nullptr;
+    finished = true;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (!finished) { // given up halfway, no partial file is left behind
+        std::fclose(fp);
+        std::remove(tempPath.c_str());
+    }
+    delete[] buffer;
+}
+
+SnapshotReader::SnapshotReader(const char *name) : filename(name) {
+    mapped = mapFileReadOnly(name, size);
+    if (mapped == nullptr) { // 不能映射的时候整个读进来
+        std::FILE *fp = std::fopen(name, "rb");
+        if (fp == nullptr) {
+            std::fprintf(stderr, "\nSnapshotReader: File name is invalid!\n");
+            throw -1;
+        }
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = std::fread(chunk, 1, sizeof(chunk), fp)) > 0)copy.insert(copy.end(), chunk, chunk + n);
+        std::fclose(fp);
+        size = copy.size();
+    }
+}
+
+const void *SnapshotReader::take(size_t n) {
+    if (n > size - pos) {
+        std::fprintf(stderr, "\nSnapshotReader: %s is truncated!\n", filename.c_str());
+        throw -1;
+    }
+    const char *p = (mapped != nullptr ? mapped : copy.data()) + pos;
+    pos += n;
+    return p;
+}
+
+SnapshotReader::~SnapshotReader() {
+    unmapFile(mapped, size);
 }
@@ -0,0 +1,64 @@
+/**
+ * @brief A worker thread fed through a lock-free single-producer single-consumer queue.
+ */
+#include "../include/workerThread.h"
+
+#include <chrono>
+
+
+// An idle thread first spins this many rounds, then yields this many rounds, then sleeps
+static const int SpinRounds = 2000, YieldRounds = 200;
+
+WorkerThread::WorkerThread(size_t capacity) : queue(capacity), completed(0), stopping(false), sleeping(false) {
+    thread = std::thread(&WorkerThread::loop, this);
+}
+
+WorkerThread::~WorkerThread() {
+    stopping.store(true);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_one();
+    }
+    thread.join();
+}
+
+void WorkerThread::loop() {
+    Job job;
+    int idle = 0;
+    while (true) {
+        if (queue.pop(job)) {
+            job.task(job.context);
+            completed.fetch_add(1, std::memory_order_release);
+            idle = 0;
+            continue;
+        }
+        if (stopping.load())return; // the queue is drained first
+        ++idle;
+        if (idle < SpinRounds)continue;
+        if (idle < SpinRounds + YieldRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+        // Sleep until submit wakes us up; the timeout covers a wakeup that races with falling asleep
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true);
+        if (queue.empty() && !stopping.load())
+            wakeup.wait_for(lock, std::chrono::milliseconds(1));
+        sleeping.store(false);
+    }
+}
+
+void WorkerThread::submit(Task task, void *context) {
+    Job job = {task, context};
+    while (!queue.push(job))std::this_thread::yield();
+    ++submitted;
+    if (sleeping.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_one();
+    }
+}
+
+void WorkerThread::wait() {
+    for (int round = 0; completed.load(std::memory_order_acquire) != submitted; ++round)
+        if (round >= SpinRounds)std::this_thread::yield();
+}
@@ -0,0 +1,88 @@
+//
+// The ensemble layer packed in one arena (AEEnsemble) against separately allocated autoencoders (AE),
+// for the sizes KitNET gives 100 features with autoencoders of at most 10 inputs
+//
+
+#include "../include/neuralnet.h"
+#include "test.h"
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// Trains the layer on the first half of the samples and reconstructs the second half, like KitNET does.
+// Keeps the fastest nanoseconds per sample of each, errors receives the errors of all the samples
+template<class Layer>
+static void run(Layer &layer, const vector<double> &x, int inputSize, int members, double &trainNs,
+                double &executeNs, vector<double> &errors) {
+    int samples = x.size() / inputSize, half = samples / 2;
+    auto start = chrono::steady_clock::now();
+    for (int s = 0; s < half; ++s)layer.train(&x[(size_t) s * inputSize], &errors[(size_t) s * members]);
+    auto middle = chrono::steady_clock::now();
+    for (int s = half; s < samples; ++s)layer.reconstruct(&x[(size_t) s * inputSize], &errors[(size_t) s * members]);
+    auto end = chrono::steady_clock::now();
+    trainNs = min(trainNs, chrono::duration<double, nano>(middle - start).count() / half);
+    executeNs = min(executeNs, chrono::duration<double, nano>(end - middle).count() / (samples - half));
+}
+
+// The autoencoders as KitNET had them, each with its own layers and buffers on the heap
+class SeparateAEs {
+private:
+    vector<AE *> members;
+    vector<int> visible;
+
+public:
+    SeparateAEs(const vector<int> &visibleSizes, const vector<int> &hiddenSizes, double lr) : visible(visibleSizes) {
+        for (size_t m = 0; m < visibleSizes.size(); ++m)members.push_back(new AE(visibleSizes[m], hiddenSizes[m], lr));
+    }
+
+    ~SeparateAEs() {
+        for (AE *ae: members)delete ae;
+    }
+
+    void train(const double *x, double *errors) {
+        for (size_t m = 0; m < members.size(); ++m) {
+            errors[m] = members[m]->train(x);
+            x += visible[m];
+        }
+    }
+
+    void reconstruct(const double *x, double *errors) {
+        for (size_t m = 0; m < members.size(); ++m) {
+            errors[m] = members[m]->reconstruct(x);
+            x += visible[m];
+        }
+    }
+};
+
+void benchAEEnsemble() {
+    const int features = 100, maxSize = 10, samples = 20000;
+    const double lr = 0.1;
+    vector<int> visible, hidden;
+    for (int left = features, v = 1; left > 0; v = v % maxSize + 1) { // sizes 1 to 10, then again
+        visible.push_back(min(v, left));
+        hidden.push_back((int) ceil(visible.back() * 0.75));
+        left -= visible.back();
+    }
+    int members = visible.size();
+
+    rand_uniform(0, 1); // seeds once, the weights below are made from srand
+    vector<double> x((size_t) samples * features), expected((size_t) samples * members), errors(expected.size());
+    for (double &value: x)value = rand_uniform(0, 1);
+
+    // The two take turns, so that a slow moment of the machine hits both
+    double separateTrain = INFINITY, separateExecute = INFINITY, packedTrain = INFINITY, packedExecute = INFINITY;
+    for (int repeat = 0; repeat < 5; ++repeat) {
+        srand(1);
+        SeparateAEs separate(visible, hidden, lr);
+        run(separate, x, features, members, separateTrain, separateExecute, expected);
+        srand(1);
+        AEEnsemble packed(visible, hidden, lr);
+        run(packed, x, features, members, packedTrain, packedExecute, errors);
+    }
+    printf("%d autoencoders, %d features, ns per sample\n", members, features);
+    printf("%10s %12s %12s\n", "", "train", "execute");
+    printf("%10s %12.1f %12.1f\n", "separate", separateTrain, separateExecute);
+    printf("%10s %12.1f %12.1f %s\n", "packed", packedTrain, packedExecute,
+           errors == expected ? "" : "(DIFFERENT ERRORS)");
+}
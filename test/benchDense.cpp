@@ -0,0 +1,163 @@
+//
+// Dense with the old row-pointer weights against the contiguous weights with each level of kernels and with sigmoid
+// inlined, for the autoencoders KitNET builds (visible size 1-10, hidden size ceil(0.75 * visible))
+//
+
+#include "../include/neuralnet.h"
+#include "test.h"
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// Dense as it was: one heap row of W per input, the forward pass reads W column by column
+class RowPointerDense {
+private:
+    int n_in, n_out;
+    double **W, *bias, *inputValue, *outputValue;
+    double (*activation)(double), (*activationDerivative)(double);
+    double learning_rate;
+
+public:
+    RowPointerDense(int inSize, int outSize, double (*activationFunc)(double),
+                    double (*activationDerivativeFunc)(double), double lr)
+            : n_in(inSize), n_out(outSize), activation(activationFunc), activationDerivative(activationDerivativeFunc),
+              learning_rate(lr) {
+        inputValue = new double[n_in];
+        outputValue = new double[n_out];
+        bias = new double[n_out];
+        W = new double *[n_in];
+        for (int i = 0; i < n_in; ++i)W[i] = new double[n_out];
+        double val = 1.0 / n_out;
+        for (int i = 0; i < n_in; ++i)
+            for (int j = 0; j < n_out; ++j)W[i][j] = rand_uniform(-val, val);
+        for (int i = 0; i < n_out; ++i)bias[i] = 0;
+    }
+
+    ~RowPointerDense() {
+        for (int i = 0; i < n_in; ++i)delete[] W[i];
+        delete[] W;
+        delete[] bias;
+        delete[] inputValue;
+        delete[] outputValue;
+    }
+
+    void feedForward(const double *input, double *output, bool saveValue = false) {
+        for (int i = 0; i < n_out; ++i) {
+            output[i] = bias[i];
+            for (int j = 0; j < n_in; ++j)output[i] += W[j][i] * input[j];
+            output[i] = activation(output[i]);
+        }
+        if (saveValue) {
+            memcpy(inputValue, input, sizeof(double) * n_in);
+            memcpy(outputValue, output, sizeof(double) * n_out);
+        }
+    }
+
+    void BackPropagation(double *g) {
+        for (int i = 0; i < n_out; ++i)outputValue[i] = g[i] * activationDerivative(outputValue[i]);
+        for (int i = 0; i < n_in; ++i) {
+            g[i] = 0;
+            for (int j = 0; j < n_out; ++j)g[i] += W[i][j] * outputValue[j];
+        }
+        for (int i = 0; i < n_out; ++i) {
+            outputValue[i] *= learning_rate;
+            bias[i] += outputValue[i];
+        }
+        for (int i = 0; i < n_in; ++i)
+            for (int j = 0; j < n_out; ++j)W[i][j] += inputValue[i] * outputValue[j];
+    }
+};
+
+// The sigmoid policy built like the other layers, the function pointers are only there for runOnce
+class InlinedSigmoidDense : public BasicDense<SigmoidActivation> {
+public:
+    InlinedSigmoidDense(int inSize, int outSize, double (*)(double), double (*)(double), double lr)
+            : BasicDense<SigmoidActivation>(inSize, outSize, SigmoidActivation(), lr) {}
+};
+
+// Trains an encoder and a decoder on the samples like AE::train does, then runs them forward on the samples again.
+// Gives the nanoseconds per sample of training and of running forward, the outputs of the last pass are kept in z
+template<class Layer>
+static void run(Layer &encoder, Layer &decoder, const vector<double> &x, int v, int rounds, double &trainNs,
+                double &forwardNs, vector<double> &z) {
+    int samples = x.size() / v;
+    double y[16], g[16];
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (int s = 0; s < samples; ++s) {
+            const double *in = &x[(size_t) s * v];
+            encoder.feedForward(in, y, true);
+            decoder.feedForward(y, &z[(size_t) s * v], true);
+            for (int i = 0; i < v; ++i)g[i] = in[i] - z[(size_t) s * v + i];
+            decoder.BackPropagation(g);
+            encoder.BackPropagation(g);
+        }
+    }
+    auto middle = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (int s = 0; s < samples; ++s) {
+            encoder.feedForward(&x[(size_t) s * v], y);
+            decoder.feedForward(y, &z[(size_t) s * v]);
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    trainNs = chrono::duration<double, nano>(middle - start).count() / ((double) rounds * samples);
+    forwardNs = chrono::duration<double, nano>(end - middle).count() / ((double) rounds * samples);
+}
+
+// One run from the same initial weights, keeps the fastest times
+template<class Layer>
+static void runOnce(int v, int h, double lr, const vector<double> &x, int rounds, double &trainNs, double &forwardNs,
+                    vector<double> &z) {
+    srand(v);
+    Layer encoder(v, h, sigmoid, sigmoidDerivative, lr), decoder(h, v, sigmoid, sigmoidDerivative, lr);
+    double t, f;
+    run(encoder, decoder, x, v, rounds, t, f, z);
+    trainNs = min(trainNs, t);
+    forwardNs = min(forwardNs, f);
+}
+
+void benchDense() {
+    const int samples = 1000, rounds = 50;
+    const double lr = 0.1;
+    const char *names[] = {"scalar", "AVX2", "AVX-512"};
+    SimdLevel available = detectSimdLevel();
+    printf("kernels up to %s, ns per sample (train = 2 forward + 2 backpropagation)\n", names[available]);
+    printf("%3s %3s %18s", "v", "h", "row pointers");
+    for (int level = SimdScalar; level <= available; ++level)printf(" %18s", names[level]);
+    printf(" %18s\n", "inlined sigmoid");
+
+    rand_uniform(0, 1); // seeds once, the weights below are made from srand
+    for (int v = 1; v <= 10; ++v) {
+        int h = (int) ceil(v * 0.75);
+        vector<double> x((size_t) samples * v), expected(x.size()), z(x.size());
+        for (double &value: x)value = rand_uniform(0, 1);
+
+        // The runs of the layouts and levels take turns, so that a slow moment of the machine hits all of them
+        const int inlined = available + 2;
+        double trainNs[5], forwardNs[5];
+        bool same[5];
+        for (int i = 0; i < 5; ++i)trainNs[i] = forwardNs[i] = INFINITY;
+        for (int repeat = 0; repeat < 5; ++repeat) {
+            runOnce<RowPointerDense>(v, h, lr, x, rounds, trainNs[0], forwardNs[0], expected);
+            for (int level = SimdScalar; level <= available; ++level) {
+                setDenseSimdLevel((SimdLevel) level);
+                runOnce<Dense>(v, h, lr, x, rounds, trainNs[level + 1], forwardNs[level + 1], z);
+                // Same sums in the same order, so the outputs are the same as with the row pointers
+                same[level + 1] = z == expected;
+            }
+            // With the kernels of the best level, the activation loops have no indirect call
+            runOnce<InlinedSigmoidDense>(v, h, lr, x, rounds, trainNs[inlined], forwardNs[inlined], z);
+            same[inlined] = z == expected;
+        }
+        printf("%3d %3d %8.1f /%8.1f", v, h, trainNs[0], forwardNs[0]);
+        for (int level = SimdScalar; level <= available; ++level)
+            printf(" %5.2fx / %5.2fx%s", trainNs[0] / trainNs[level + 1], forwardNs[0] / forwardNs[level + 1],
+                   same[level + 1] ? "" : "!");
+        printf(" %5.2fx / %5.2fx%s\n", trainNs[0] / trainNs[inlined], forwardNs[0] / forwardNs[inlined],
+               same[inlined] ? "" : "!");
+    }
+    setDenseSimdLevel(available);
+    printf("(! marks outputs different from the row pointers)\n");
+}
@@ -0,0 +1,95 @@
+//
+// Throughput of NetStat with a few feature masks (and an order), and the check that the masked vectors are the
+// selected columns of the full vectors
+//
+
+#include "../include/netStat.h"
+#include "test.h"
+#include <algorithm>
+
+using namespace std;
+
+// Whether every masked vector is the selected columns of the full vector of the same packet
+static bool sameColumns(const NetStatBase *netStat, const vector<double> &masked, const vector<double> &full) {
+    int size = netStat->getVectorSize(), fullSize = netStat->getFullVectorSize();
+    for (size_t row = 0; row < masked.size() / size; ++row)
+        for (int i = 0; i < size; ++i)
+            if (masked[row * size + i] != full[row * fullSize + netStat->getFeatureIndex(i)])return false;
+    return true;
+}
+
+// The best of a few runs, each on a new NetStat: a single run on a shared machine varies by more than a window saves
+static double bestRun(bool sharded, const FeatureMask &mask, const vector<PacketRecord> &trace, int batch,
+                      vector<double> &result) {
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+        NetStatBase *netStat = sharded ? newShardedNetStat(2) : newNetStat();
+        netStat->setFeatureMask(mask);
+        best = max(best, runTrace(netStat, trace, batch, result));
+        delete netStat;
+    }
+    return best;
+}
+
+void benchFeatureMask() {
+    const size_t packets = 200000;
+    const uint64_t hosts = 20000;
+    const int batch = 512;
+    vector<PacketRecord> trace = makeTrace(packets, hosts, 11);
+    int windows = defaultLambdas().size();
+
+    vector<pair<const char *, FeatureMask> > masks;
+    masks.emplace_back("all", FeatureMask(windows));
+    // Only the jit streams skip a window (see StatSelection), jit is a small part of the work
+    masks.emplace_back("no jit lambda 5", FeatureMask(windows).setFamily(FeatureMask::Jit, false, 0));
+    FeatureMask noLambda5(windows);
+    for (int f = 0; f < FeatureMask::FamilyCount; ++f)noLambda5.setFamily((FeatureMask::Family) f, false, 0);
+    masks.emplace_back("no lambda 5", noLambda5);
+    masks.emplace_back("no Hp cov/pcc", FeatureMask(windows).set(FeatureMask::Hp, FeatureMask::Cov, false)
+            .set(FeatureMask::Hp, FeatureMask::Pcc, false));
+    FeatureMask noCov(windows);
+    for (FeatureMask::Family f: {FeatureMask::H, FeatureMask::Hp})
+        noCov.set(f, FeatureMask::Cov, false).set(f, FeatureMask::Pcc, false);
+    masks.emplace_back("no cov/pcc", noCov);
+    FeatureMask only1D(windows);
+    for (FeatureMask::Family f: {FeatureMask::H, FeatureMask::Hp})
+        for (int s = FeatureMask::Radius; s < FeatureMask::StatCount; ++s)only1D.set(f, (FeatureMask::Stat) s, false);
+    masks.emplace_back("1D only", only1D);
+    masks.emplace_back("MI only", FeatureMask(windows).setFamily(FeatureMask::H, false)
+            .setFamily(FeatureMask::Jit, false).setFamily(FeatureMask::Hp, false));
+
+    printf("%zu packets, %llu hosts, batches of %d\n", packets, (unsigned long long) hosts, batch);
+    vector<double> full, result;
+    double base = 0;
+    for (auto &m: masks) {
+        NetStatBase *netStat = newNetStat();
+        netStat->setFeatureMask(m.second);
+        double pps = bestRun(false, m.second, trace, batch, m.second.count() == m.second.size() ? full : result);
+        if (base == 0)base = pps;
+        bool same = m.second.count() == m.second.size() || sameColumns(netStat, result, full);
+        printf("%-16s %3d features %12.0f packets/s %6.2fx%s\n", m.first, netStat->getVectorSize(), pps, pps / base,
+               same ? "" : "  (MISMATCH)");
+        delete netStat;
+
+        // The sharded form skips the same work
+        NetStatBase *sharded = newShardedNetStat(2);
+        sharded->setFeatureMask(m.second);
+        vector<double> shardedResult;
+        pps = bestRun(true, m.second, trace, batch, shardedResult);
+        same = m.second.count() == m.second.size() ? shardedResult == full : sameColumns(sharded, shardedResult, full);
+        printf("%-16s %3d features %12.0f packets/s %6.2fx%s\n", "  2 shards", sharded->getVectorSize(), pps,
+               pps / base, same ? "" : "  (MISMATCH)");
+        delete sharded;
+    }
+
+    // An order over the mask (every other feature, backwards) gathers the columns in the same pass
+    NetStatBase *netStat = newNetStat();
+    netStat->setFeatureMask(masks[3].second);
+    vector<int> order;
+    for (int i = netStat->getVectorSize() - 1; i >= 0; i -= 2)order.push_back(i);
+    netStat->setFeatureOrder(order);
+    double pps = runTrace(netStat, trace, batch, result);
+    printf("%-16s %3d features %12.0f packets/s %6.2fx%s\n", "  + order", netStat->getVectorSize(), pps, pps / base,
+           sameColumns(netStat, result, full) ? "" : "  (MISMATCH)");
+    delete netStat;
+}
@@ -0,0 +1,47 @@
+//
+// AE::reconstruct with the fused kernels against the layer by layer reconstruction, for the autoencoders KitNET
+// builds (hidden size ceil(0.75 * visible))
+//
+
+#include "../include/neuralnet.h"
+#include "test.h"
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// Trains an autoencoder made from the seed v on the samples, then reconstructs them.
+// Keeps the fastest nanoseconds per reconstructed sample, the errors are kept in rmse
+static void runOnce(bool fused, int v, int h, const vector<double> &x, int rounds, double &ns, vector<double> &rmse) {
+    setFusedAE(fused);
+    srand(v);
+    AE ae(v, h, 0.1);
+    int samples = x.size() / v;
+    for (int s = 0; s < samples; ++s)ae.train(&x[(size_t) s * v]);
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        for (int s = 0; s < samples; ++s)rmse[s] = ae.reconstruct(&x[(size_t) s * v]);
+    ns = min(ns, chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() /
+                 ((double) rounds * samples));
+}
+
+void benchFusedAE() {
+    const int samples = 1000, rounds = 100;
+    bool wasFused = getFusedAE();
+    printf("ns per reconstructed sample\n%3s %3s %12s %12s\n", "v", "h", "layers", "fused");
+    rand_uniform(0, 1); // seeds once, the weights below are made from srand
+    for (int v = 1; v <= FusedAEMaxSize; ++v) {
+        int h = (int) ceil(v * 0.75);
+        vector<double> x((size_t) samples * v), expected(samples), rmse(samples);
+        for (double &value: x)value = rand_uniform(0, 1);
+        // The two take turns, so that a slow moment of the machine hits both
+        double layersNs = INFINITY, fusedNs = INFINITY;
+        for (int repeat = 0; repeat < 5; ++repeat) {
+            runOnce(false, v, h, x, rounds, layersNs, expected);
+            runOnce(true, v, h, x, rounds, fusedNs, rmse);
+        }
+        printf("%3d %3d %12.1f %12.1f %6.2fx%s\n", v, h, layersNs, fusedNs, layersNs / fusedNs,
+               rmse == expected ? "" : "  (DIFFERENT)");
+    }
+    setFusedAE(wasFused);
+}
@@ -0,0 +1,84 @@
+//
+// KitNET one instance at a time against the batches, on 1, 2 and 4 threads, for 200 features and autoencoders of at
+// most 10 inputs, and the check that all of them give the same scores. Then the training with mini-batches
+//
+
+#include "../include/kitNET.h"
+#include "test.h"
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// The features in groups of 1 to 10, then again, like a feature map of KitNET
+static vector<vector<int> > *makeFeatureMap(int features, int maxSize) {
+    auto fm = new vector<vector<int> >;
+    for (int next = 0, v = 1; next < features; v = v % maxSize + 1) {
+        fm->emplace_back();
+        for (int i = 0; i < v && next < features; ++i)fm->back().push_back(next++);
+    }
+    return fm;
+}
+
+// Trains on the first half of the instances and executes the second half, keeps the fastest nanoseconds per instance
+static void run(int threads, bool batch, const vector<double> &X, int features, int maxSize, double &trainNs,
+                double &executeNs, vector<double> &scores, bool miniBatch = false) {
+    int samples = X.size() / features, half = samples / 2;
+    srand(1);
+    KitNET kitNET(makeFeatureMap(features, maxSize));
+    kitNET.setThreads(threads);
+    kitNET.setInputSize(features);
+    auto start = chrono::steady_clock::now();
+    if (batch)kitNET.trainBatch(X.data(), half, scores.data(), miniBatch);
+    else for (int s = 0; s < half; ++s)scores[s] = kitNET.train(&X[(size_t) s * features]);
+    auto middle = chrono::steady_clock::now();
+    if (batch)kitNET.executeBatch(&X[(size_t) half * features], samples - half, &scores[half]);
+    else for (int s = half; s < samples; ++s)scores[s] = kitNET.execute(&X[(size_t) s * features]);
+    auto end = chrono::steady_clock::now();
+    trainNs = min(trainNs, chrono::duration<double, nano>(middle - start).count() / half);
+    executeNs = min(executeNs, chrono::duration<double, nano>(end - middle).count() / (samples - half));
+}
+
+void benchKitNET() {
+    const int features = 200, maxSize = 10, samples = 20000;
+    const int threads[] = {1, 2, 4};
+    rand_uniform(0, 1); // seeds once, the weights below are made from srand
+    vector<double> X((size_t) samples * features), expected(samples), scores(samples);
+    for (double &value: X)value = rand_uniform(0, 1);
+
+    // The runs take turns, so that a slow moment of the machine hits all of them
+    double trainNs[3][2], executeNs[3][2];
+    bool same[3][2];
+    for (int t = 0; t < 3; ++t)
+        for (int b = 0; b < 2; ++b)trainNs[t][b] = executeNs[t][b] = INFINITY;
+    for (int repeat = 0; repeat < 3; ++repeat) {
+        for (int t = 0; t < 3; ++t) {
+            for (int b = 0; b < 2; ++b) {
+                run(threads[t], b == 1, X, features, maxSize, trainNs[t][b], executeNs[t][b],
+                    t == 0 && b == 0 ? expected : scores);
+                same[t][b] = t == 0 && b == 0 ? true : scores == expected;
+            }
+        }
+    }
+    printf("%d features, autoencoders of at most %d inputs, ns per instance\n", features, maxSize);
+    printf("%8s %24s %24s\n", "threads", "one at a time", "batches");
+    for (int t = 0; t < 3; ++t) {
+        printf("%8d", threads[t]);
+        for (int b = 0; b < 2; ++b)
+            printf(" %10.1f / %10.1f%s", trainNs[t][b], executeNs[t][b], same[t][b] ? " " : "!");
+        printf("\n");
+    }
+    printf("(train / execute, ! marks scores different from one thread one at a time)\n");
+
+    // Other scores: the mean score of the instances executed, against the one of the training one at a time
+    double miniTrainNs = INFINITY, miniExecuteNs = INFINITY;
+    for (int repeat = 0; repeat < 3; ++repeat)
+        run(1, true, X, features, maxSize, miniTrainNs, miniExecuteNs, scores, true);
+    double mean = 0, expectedMean = 0;
+    for (int s = samples / 2; s < samples; ++s) {
+        mean += scores[s];
+        expectedMean += expected[s];
+    }
+    printf("%8s %10.1f / %10.1f  mean score %.6f (%.6f one at a time)\n", "mini-batches", miniTrainNs, miniExecuteNs,
+           mean / (samples - samples / 2), expectedMean / (samples - samples / 2));
+}
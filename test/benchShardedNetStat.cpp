@@ -0,0 +1,42 @@
+//
+// Benchmark of ShardedNetStat: packets per second against the number of shards (threads)
+//
+
+#include "../include/netStat.h"
+#include "test.h"
+#include <thread>
+#include <cstring>
+
+using namespace std;
+
+void benchShardedNetStat() {
+    const size_t packets = 200000;
+    const uint64_t hosts = 20000;
+    const int batch = 512;
+    vector<PacketRecord> trace = makeTrace(packets, hosts, 42);
+    printf("%zu packets, %llu hosts, batches of %d, %u hardware threads\n", packets, (unsigned long long) hosts, batch,
+           thread::hardware_concurrency());
+
+    NetStatBase *serial = newNetStat();
+    vector<double> expected(packets * serial->getVectorSize()), result(expected.size());
+    double base = runTrace(serial, trace, batch, expected);
+    delete serial;
+    printf("%-16s %12.0f packets/s\n", "NetStat", base);
+
+    NetStatBase *pipeline = newNetStat();
+    pipeline->setParallel(true);
+    double pps = runTrace(pipeline, trace, batch, result);
+    delete pipeline;
+    printf("%-16s %12.0f packets/s %6.2fx%s\n", "NetStat parallel", pps, pps / base,
+           memcmp(result.data(), expected.data(), sizeof(double) * result.size()) == 0 ? "" : "  (MISMATCH)");
+
+    const int shardCounts[] = {1, 2, 4, 8};
+    for (int shards : shardCounts) {
+        NetStatBase *sharded = newShardedNetStat(shards);
+        pps = runTrace(sharded, trace, batch, result);
+        delete sharded;
+        // The trace has no packet from a stream to itself, so the vectors are the same as NetStat's
+        printf("%2d %-13s %12.0f packets/s %6.2fx%s\n", shards, shards == 1 ? "shard" : "shards", pps, pps / base,
+               memcmp(result.data(), expected.data(), sizeof(double) * result.size()) == 0 ? "" : "  (MISMATCH)");
+    }
+}
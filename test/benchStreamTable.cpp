@@ -0,0 +1,60 @@
+//
+// Benchmark of the stream lookup of IncStatDB: StreamTable against std::map
+//
+
+#include "../include/netStat.h"
+#include "test.h"
+#include <map>
+#include <chrono>
+#include <random>
+
+using namespace std;
+
+// Keys shaped like the HT_Hp keys of IPv4 hosts and ports
+static StreamKey makeKey(mt19937_64 &rng) {
+    StreamKey key = {{0, rng() & 0xffffffffull, 4 | 1 << 8 | (rng() & 0xffff) << 16, 0, 0}};
+    return key;
+}
+
+static double elapsedNs(chrono::steady_clock::time_point start, size_t ops) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+}
+
+void benchStreamTable() {
+    const size_t sizes[] = {10000, 100000, 1000000};
+    const size_t lookups = 5000000;
+    printf("%10s %14s %14s %14s %14s\n", "streams", "map insert", "table insert", "map find", "table find");
+    for (size_t n : sizes) {
+        mt19937_64 rng(n);
+        vector<StreamKey> keys(n);
+        for (auto &k : keys)k = makeKey(rng);
+        // Lookups follow a random order of the existing keys, like packets of many interleaved flows
+        vector<size_t> order(lookups);
+        for (auto &i : order)i = rng() % n;
+
+        map<StreamKey, void *> m;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i)m.insert(make_pair(keys[i], reinterpret_cast<void *>(i + 1)));
+        double mapInsert = elapsedNs(start, n);
+
+        StreamTable<void> table;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i)
+            if (table.find(keys[i], keys[i].hash()) == nullptr)
+                table.insert(keys[i], keys[i].hash(), reinterpret_cast<void *>(i + 1));
+        double tableInsert = elapsedNs(start, n);
+
+        size_t check = 0;
+        start = chrono::steady_clock::now();
+        for (size_t i : order)check += reinterpret_cast<size_t>(m.find(keys[i])->second);
+        double mapFind = elapsedNs(start, lookups);
+
+        size_t check2 = 0;
+        start = chrono::steady_clock::now();
+        for (size_t i : order)check2 += reinterpret_cast<size_t>(table.find(keys[i], keys[i].hash()));
+        double tableFind = elapsedNs(start, lookups);
+
+        printf("%10zu %11.1f ns %11.1f ns %11.1f ns %11.1f ns%s\n", n, mapInsert, tableInsert, mapFind, tableFind,
+               check == check2 ? "" : "  (MISMATCH)");
+    }
+}
@@ -0,0 +1,157 @@
+//
+// Accuracy of the compact NetStat (float state, nothing cached) against the double NetStat, and the memory it saves
+//
+
+#include "../include/featureExtractor.h"
+#include "test.h"
+#include <chrono>
+
+using namespace std;
+
+// Error of one feature (one kind of statistic in one time window) over all the packets.
+// The relative error is large for values that are almost 0 (a variance of 1e-9 against 1e-2 is still "wrong"),
+// so the error is also given relative to the range of the feature, which is what KitNET sees after normalizing
+struct FeatureError {
+    double maxRelative = 0, sumRelative = 0, maxAbsolute = 0, sumAbsolute = 0;
+    double lowest = INFINITY, highest = -INFINITY;
+    size_t relativeCount = 0, count = 0;
+
+    void add(double compact, double exact) {
+        double error = fabs(compact - exact);
+        maxAbsolute = max(maxAbsolute, error);
+        sumAbsolute += error;
+        lowest = min(lowest, exact);
+        highest = max(highest, exact);
+        ++count;
+        if (fabs(exact) > 1e-6) {
+            double relative = error / fabs(exact);
+            maxRelative = max(maxRelative, relative);
+            sumRelative += relative;
+            ++relativeCount;
+        }
+    }
+
+    // Like the normalization of the autoencoders (see AE), a constant feature has a range of 1e-13.
+    // A feature that is constant up to rounding with double (a cov of 1e-15) shows up large here,
+    // the compact values of it are the rounding noise of float instead
+    double range() const { return highest - lowest + 1e-13; }
+};
+
+// The pcc of the two paths. With double state it is only a correlation in [-1,1] when both streams vary: the cov
+// comes from extrapolated values, and with a variance near 0 (one value in a long-decayed window) the cov is divided
+// by almost nothing, up to 1e9 on the synthetic trace. The compact state cannot resolve such a variance, it is under
+// the noise floor and the pcc is 0, so the error is reported apart for the pcc that are correlations
+struct PccError {
+    double maxError = 0, sumError = 0;
+    size_t count = 0, zero = 0, outside = 0;
+
+    void add(double compact, double exact) {
+        if (fabs(exact) > 1) {
+            ++outside;
+            return;
+        }
+        double error = fabs(compact - exact);
+        maxError = max(maxError, error);
+        sumError += error;
+        ++count;
+        if (compact == 0 && exact != 0)++zero;
+    }
+};
+
+// Runs the next batch of at most n packets through netStat (or fe, which decodes them too), returns the number of packets
+static int nextBatch(NetStatBase *netStat, FE *fe, const vector<PacketRecord> &trace, size_t done, int n, double *X,
+                     double &seconds) {
+    auto start = chrono::steady_clock::now();
+    if (fe != nullptr)n = fe->nextBatch(X, n);
+    else {
+        n = (int) min((size_t) n, trace.size() - done);
+        if (n > 0)netStat->updateAndGetBatch(&trace[done], n, X);
+    }
+    seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return n;
+}
+
+// filename: a packet file of type ft as the reference trace, nullptr for a synthetic trace of 1e6 packets
+void compactNetStatAccuracy(const char *filename, FileType ft) {
+    // Two FEs read the reference trace, one of them with the compact NetStat
+    FE *feExact = nullptr, *feCompact = nullptr;
+    NetStatBase *exact, *compact;
+    vector<PacketRecord> trace;
+    if (filename != nullptr) {
+        feExact = new FE(filename, ft);
+        feCompact = new FE(filename, ft);
+        feCompact->useCompactState();
+        exact = feExact->getNetStat();
+        compact = feCompact->getNetStat();
+        printf("reference trace %s\n", filename);
+    } else {
+        exact = newNetStat();
+        compact = newCompactNetStat();
+        trace = makeTrace(1000000, 20000, 7);
+        printf("synthetic trace\n");
+    }
+    int size = exact->getVectorSize(), W = exact->getLambdas().size();
+
+    // The names of the 20 features of a window, in the order of the instance vector (see NetStat::updateAndGetStats)
+    const char *names[] = {"MI weight", "MI mean", "MI var", "H weight", "H mean", "H var", "H radius", "H magnitude",
+                           "H cov", "H pcc", "jit weight", "jit mean", "jit var", "Hp weight", "Hp mean", "Hp var",
+                           "Hp radius", "Hp magnitude", "Hp cov", "Hp pcc"};
+    vector<FeatureError> errors(size);
+    PccError pcc;
+
+    const int batch = 512;
+    vector<double> x(batch * size), y(batch * size);
+    double exactTime = 0, compactTime = 0;
+    size_t packets = 0;
+    while (true) {
+        int n = nextBatch(exact, feExact, trace, packets, batch, x.data(), exactTime);
+        if (n == 0 || nextBatch(compact, feCompact, trace, packets, batch, y.data(), compactTime) != n)break;
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < size; ++j)errors[j].add(y[i * size + j], x[i * size + j]);
+        // The pcc of H and Hp (the 10th and 20th features of each window)
+        for (int i = 0; i < n; ++i)
+            for (int k = 9; k < 20; k += 10)
+                for (int j = k * W; j < (k + 1) * W; ++j)pcc.add(y[i * size + j], x[i * size + j]);
+        packets += n;
+    }
+    printf("%zu packets, %d time windows\n\n", packets, W);
+
+    // The windows of a kind of feature are summed up in one line
+    printf("%-14s %14s %14s %14s %14s\n", "feature", "max rel err", "mean rel err", "max err/range",
+           "mean err/range");
+    for (int k = 0; k < 20; ++k) {
+        double maxRelative = 0, sumRelative = 0, maxNormalized = 0, sumNormalized = 0;
+        size_t relativeCount = 0;
+        for (int i = 0; i < W; ++i) {
+            const FeatureError &e = errors[k * W + i];
+            maxRelative = max(maxRelative, e.maxRelative);
+            sumRelative += e.sumRelative;
+            relativeCount += e.relativeCount;
+            maxNormalized = max(maxNormalized, e.maxAbsolute / e.range());
+            sumNormalized += e.sumAbsolute / e.range() / max(e.count, (size_t) 1);
+        }
+        printf("%-14s %14.3e %14.3e %14.3e %14.3e\n", names[k], maxRelative,
+               relativeCount > 0 ? sumRelative / relativeCount : 0.0, maxNormalized, sumNormalized / W);
+    }
+
+    printf("\npcc in [-1,1] with double: %zu values, max err %.3e, mean err %.3e, %zu are 0 for a variance under the "
+           "noise floor\n", pcc.count, pcc.maxError, pcc.count > 0 ? pcc.sumError / pcc.count : 0.0, pcc.zero);
+    printf("pcc outside [-1,1] with double: %zu values\n", pcc.outside);
+
+    PoolStats s1 = exact->getStreamPoolStats(), s2 = compact->getStreamPoolStats();
+    PoolStats e1 = exact->getEdgePoolStats(), e2 = compact->getEdgePoolStats();
+    printf("\n%-8s %10s %14s %10s %14s %12s\n", "", "streams", "stream bytes", "edges", "edge bytes", "packets/s");
+    printf("%-8s %10zu %14zu %10zu %14zu %12.0f\n", "double", s1.live, s1.bytes, e1.live, e1.bytes,
+           packets / exactTime);
+    printf("%-8s %10zu %14zu %10zu %14zu %12.0f\n", "compact", s2.live, s2.bytes, e2.live, e2.bytes,
+           packets / compactTime);
+    printf("compact / double memory: %.2f\n", (double) (s2.bytes + e2.bytes) / (s1.bytes + e1.bytes));
+
+    if (filename != nullptr) {
+        delete feExact; // the FEs own their NetStats
+        delete feCompact;
+    } else {
+        delete exact;
+        delete compact;
+    }
+}
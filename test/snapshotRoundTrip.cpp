@@ -0,0 +1,94 @@
+//
+// Snapshots of NetStat: a NetStat loaded from a snapshot and the one that saved it give the same vectors afterwards
+//
+
+#include "../include/netStat.h"
+#include "test.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// One configuration of NetStat to save and load
+struct RoundTrip {
+    const char *name;
+    int shards; // 0 for NetStat
+    bool lazy, compact, background;
+    EvictionPolicy policy;
+    bool masked; // without the time window lambda 5, the loaded NetStat is given the same mask
+};
+
+static FeatureMask roundTripMask() {
+    FeatureMask mask(defaultLambdas().size());
+    for (int f = 0; f < FeatureMask::FamilyCount; ++f)mask.setFamily((FeatureMask::Family) f, false, 0);
+    return mask;
+}
+
+static NetStatBase *newRoundTripNetStat(const RoundTrip &r) {
+    NetStatBase *netStat = r.compact ? newCompactNetStat() : r.shards > 0 ? newShardedNetStat(r.shards) : newNetStat();
+    if (r.lazy)netStat->setLazyEdges(true);
+    netStat->setEvictionPolicy(r.policy);
+    if (r.masked)netStat->setFeatureMask(roundTripMask());
+    return netStat;
+}
+
+// The first half of the trace goes to a NetStat that is saved, then both it and the NetStat loaded from the snapshot
+// take the second half. With background, the NetStat goes on with the second half while the snapshot is written.
+// Returns whether the vectors of the second half are bit-identical
+static bool roundTrip(const RoundTrip &r, const vector<PacketRecord> &first, const vector<PacketRecord> &second,
+                      const char *filename) {
+    const int batch = 512;
+    vector<double> result, expected, restored;
+    NetStatBase *netStat = newRoundTripNetStat(r);
+    runTrace(netStat, first, batch, result);
+    if (r.background) {
+        netStat->saveSnapshotInBackground(filename);
+        runTrace(netStat, second, batch, expected);
+        if (!netStat->waitSnapshot()) {
+            delete netStat;
+            return false;
+        }
+    } else {
+        netStat->saveSnapshot(filename);
+        runTrace(netStat, second, batch, expected);
+    }
+    NetStatBase *loaded = loadNetStat(filename);
+    if (r.masked)loaded->setFeatureMask(roundTripMask());
+    runTrace(loaded, second, batch, restored);
+    bool same = restored.size() == expected.size() &&
+                memcmp(restored.data(), expected.data(), sizeof(double) * expected.size()) == 0;
+    delete loaded;
+    delete netStat;
+    remove(filename);
+    return same;
+}
+
+void snapshotRoundTrip() {
+    const size_t packets = 100000;
+    const uint64_t hosts = 2000;
+    vector<PacketRecord> trace = makeTrace(packets, hosts, 3);
+    vector<PacketRecord> first(trace.begin(), trace.begin() + packets / 2), second(trace.begin() + packets / 2,
+                                                                                    trace.end());
+    // The LRU limit is well below the number of streams, so that streams and edges are evicted before and after
+    EvictionPolicy none, lru;
+    lru.epsilon = 1e-3;
+    lru.maxStreams = 500;
+
+    const RoundTrip trips[] = {
+            {"eager edges",        0, false, false, false, none, false},
+            {"lazy edges",         0, true,  false, false, none, false},
+            {"LRU",                0, false, false, false, lru,  false},
+            {"LRU, lazy edges",    0, true,  false, false, lru,  false},
+            {"compact",            0, false, true,  false, none, false},
+            {"3 shards",           3, false, false, false, none, false},
+            {"3 shards, lazy",     3, true,  false, false, none, false},
+            {"3 shards, LRU",      3, false, false, false, lru,  false},
+            {"background",         0, false, false, true,  lru,  false},
+            {"background, shards", 3, true,  false, true,  none, false},
+            {"masked, lazy, LRU",  0, true,  false, false, lru,  true},
+            {"3 shards, masked",   3, false, false, false, none, true},
+    };
+    printf("%zu packets, %llu hosts, saved after %zu packets\n", packets, (unsigned long long) hosts, first.size());
+    for (const RoundTrip &r: trips)
+        printf("%-20s %s\n", r.name, roundTrip(r, first, second, "snapshotRoundTrip.snap") ? "bit-identical" : "MISMATCH");
+}
@@ -0,0 +1,48 @@
+//
+// The synthetic trace and the batch loop shared by the NetStat benchmarks
+//
+
+#include "../include/netStat.h"
+#include "test.h"
+#include <chrono>
+#include <random>
+
+using namespace std;
+
+// Many hosts talking to each other: most packets go to one of a few peers of the source,
+// the rest to random hosts, ports change from flow to flow. No packet goes from a host to itself
+vector<PacketRecord> makeTrace(size_t packets, uint64_t hosts, uint64_t seed) {
+    mt19937_64 rng(seed);
+    vector<PacketRecord> trace(packets);
+    double t = 0;
+    for (PacketRecord &pkt : trace) {
+        t += 1e-5 * (rng() % 100);
+        uint64_t src = rng() % hosts;
+        uint64_t dst = rng() % 4 != 0 ? (src * 7919 + rng() % 8) % hosts : rng() % hosts;
+        if (dst == src)dst = (dst + 1) % hosts;
+        pkt.srcMAC = src;
+        pkt.dstMAC = dst;
+        pkt.ipVersion = 4;
+        pkt.protocol = rng() % 4 != 0 ? ProtoTCP : ProtoUDP;
+        pkt.srcIP[0] = pkt.dstIP[0] = 0;
+        pkt.srcIP[1] = 0x0a000000 + src;
+        pkt.dstIP[1] = 0x0a000000 + dst;
+        pkt.srcPort = 1024 + (src * 31 + rng() % 4) % 60000;
+        pkt.dstPort = rng() % 2 != 0 ? 443 : 80;
+        pkt.datagramSize = 60 + rng() % 1440;
+        pkt.timestamp = t;
+    }
+    return trace;
+}
+
+// Runs the whole trace in batches, returns the packets per second
+double runTrace(NetStatBase *netStat, const vector<PacketRecord> &trace, int batch, vector<double> &result) {
+    int size = netStat->getVectorSize();
+    result.resize(trace.size() * size);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < trace.size(); i += batch) {
+        int n = (int) min((size_t) batch, trace.size() - i);
+        netStat->updateAndGetBatch(&trace[i], n, &result[i * size]);
+    }
+    return trace.size() / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
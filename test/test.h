@@ -5,10 +5,48 @@
 #ifndef KITSUNE_CPP_TEST_H
 #define KITSUNE_CPP_TEST_H
 
+#include "../include/featureExtractor.h"
+
 // 测试的头文件.包含测试的函数
 
+// 合成的流量: hosts个主机互相通信, 大部分包发给源主机的几个固定的对端, 其余的发给随机的主机, seed为随机数种子
+std::vector<PacketRecord> makeTrace(size_t packets, uint64_t hosts, uint64_t seed);
+
+// 将trace按每批batch个包交给netStat处理, 统计向量写入result, 返回每秒处理的包数
+double runTrace(NetStatBase *netStat, const std::vector<PacketRecord> &trace, int batch, std::vector<double> &result);
+
 void testDense();
 
+// 连续存储权重的Dense (各级SIMD的kernel) 与原来按行指针存储的Dense的速度对比
+void benchDense();
+
+// AE::reconstruct 融合的kernel与逐层重建的速度对比, 以及两者的误差是否相同
+void benchFusedAE();
+
+// 集成层的自编码器放在一块连续内存中(AEEnsemble)与分别分配的AE的速度对比, 以及两者的误差是否相同
+void benchAEEnsemble();
+
+// KitNET逐个实例与成批处理, 以及集成层使用1, 2, 4个线程时的速度对比, 以及各自的分数是否相同;
+// 以及小批量(mini-batch)训练的速度与分数
+void benchKitNET();
+
 void kitsuneExample();
 
+// StreamTable 与 std::map 查找流的性能对比
+void benchStreamTable();
+
+// ShardedNetStat 的吞吐量与分片(线程)个数的关系
+void benchShardedNetStat();
+
+// 紧凑模式(float)的NetStat与double的NetStat的统计向量的误差, 以及节省的内存.
+// filename 为参照的包文件, 为nullptr时使用合成的流量
+void compactNetStatAccuracy(const char *filename = nullptr, FileType ft = PacketTSV);
+
+// 不同特征掩码下NetStat的吞吐量, 以及掩码后的统计向量是否是完整的统计向量中选中的列
+void benchFeatureMask();
+
+// 快照的往返测试: 保存 -> 读回 -> 继续处理之后, 读回的NetStat与保存它的NetStat的统计向量是否完全相同
+// (立即更新和懒更新的边, LRU删除, 紧凑模式, 分片, 后台保存, 特征掩码)
+void snapshotRoundTrip();
+
 #endif //KITSUNE_CPP_TEST_H